@@ -0,0 +1,226 @@
+/**
+ * @file async_log.c
+ * @author oclyke
+ * @brief messages logged from the event loops without touching stdio
+ *
+ * Every thread that logs gets a ring of its own the first time it does so.
+ * The ring is a single producer single consumer queue of records: the thread
+ * fills the next slot and publishes it with a release store of the head, the
+ * writer thread reads the slots up to an acquire load of the head and gives
+ * them back with a release store of the tail. Taking a ring happens once per
+ * thread and is the only place with a lock.
+ *
+ * The writer thread wakes up every few milliseconds, writes out whatever the
+ * rings hold and flushes stdout and stderr. Nothing wakes it up early, which
+ * keeps the logging side free of syscalls. Messages from one thread keep
+ * their order, messages from different threads may be written out of order.
+ */
+
+#define _GNU_SOURCE
+
+#include "async_log.h"
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// records per ring, a power of two
+#define ASYNC_LOG_RING_LEN 4096
+#define ASYNC_LOG_CACHE_LINE 64
+#define ASYNC_LOG_FLUSH_INTERVAL_NS 5000000
+
+/**
+ * @brief one logged message
+ */
+struct async_log_record {
+  const char* format;
+  int64_t args[ASYNC_LOG_MAX_ARGS];
+  bool error;
+};
+
+/**
+ * @brief the records of one thread
+ *
+ * head and tail count records ever written and read, each is written by one
+ * side only and lives on its own cache line.
+ */
+struct async_log_ring {
+  // set before the ring is published and never changed
+  struct async_log_ring* next;
+  // written by the logging thread
+  alignas(ASYNC_LOG_CACHE_LINE) _Atomic uint64_t head;
+  _Atomic uint64_t dropped;
+  // written by the writer thread
+  alignas(ASYNC_LOG_CACHE_LINE) _Atomic uint64_t tail;
+  uint64_t dropped_reported;
+  alignas(ASYNC_LOG_CACHE_LINE)
+      struct async_log_record records[ASYNC_LOG_RING_LEN];
+};
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(struct async_log_ring*) rings = NULL;
+static _Thread_local struct async_log_ring* thread_ring = NULL;
+static _Atomic bool running = false;
+static _Atomic bool stopping = false;
+static pthread_t writer_thread;
+
+static void* run_writer(void* arg);
+static bool write_out(void);
+static void write_record(const struct async_log_record* record);
+static struct async_log_ring* take_ring(void);
+
+int async_log_start(void) {
+  int ret = 0;
+
+  atomic_store(&stopping, false);
+  if (0 != pthread_create(&writer_thread, NULL, run_writer, NULL)) {
+    fprintf(stderr, "ERROR: failed to start the log writer thread\n");
+    ret = 1;
+    goto out;
+  }
+  atomic_store(&running, true);
+
+out:
+  return ret;
+}
+
+void async_log_stop(void) {
+  if (!atomic_load(&running)) {
+    return;
+  }
+  atomic_store(&stopping, true);
+  pthread_join(writer_thread, NULL);
+  atomic_store(&running, false);
+
+  // every thread that logged is done, so the rings can go
+  struct async_log_ring* ring = atomic_exchange(&rings, NULL);
+  while (NULL != ring) {
+    struct async_log_ring* next = ring->next;
+    free(ring);
+    ring = next;
+  }
+  thread_ring = NULL;
+}
+
+void async_log_write(bool error, const char* format, const int64_t* args) {
+  struct async_log_record record = {.format = format, .error = error};
+  memcpy(record.args, args, sizeof(record.args));
+  if (!atomic_load_explicit(&running, memory_order_relaxed)) {
+    write_record(&record);
+    return;
+  }
+
+  struct async_log_ring* ring = thread_ring;
+  if (NULL == ring) {
+    ring = take_ring();
+    if (NULL == ring) {
+      return;
+    }
+  }
+
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if ((head - tail) >= ASYNC_LOG_RING_LEN) {
+    atomic_store_explicit(
+        &ring->dropped,
+        atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+        memory_order_relaxed);
+    return;
+  }
+  ring->records[head & (ASYNC_LOG_RING_LEN - 1)] = record;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/**
+ * @brief entry point of the writer thread
+ *
+ * @param arg unused
+ * @return void* always NULL
+ */
+static void* run_writer(void* arg) {
+  (void)arg;
+  struct timespec interval = {.tv_nsec = ASYNC_LOG_FLUSH_INTERVAL_NS};
+  while (!atomic_load(&stopping)) {
+    if (!write_out()) {
+      nanosleep(&interval, NULL);
+    }
+  }
+  // whatever was logged before the stop
+  write_out();
+  return NULL;
+}
+
+/**
+ * @brief writes out every record the rings hold
+ *
+ * @return bool whether there was anything to write
+ */
+static bool write_out(void) {
+  bool wrote = false;
+
+  struct async_log_ring* ring =
+      atomic_load_explicit(&rings, memory_order_acquire);
+  for (; NULL != ring; ring = ring->next) {
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    for (; tail != head; tail++) {
+      write_record(&ring->records[tail & (ASYNC_LOG_RING_LEN - 1)]);
+      wrote = true;
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    uint64_t dropped =
+        atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    if (dropped != ring->dropped_reported) {
+      fprintf(
+          stderr, "ERROR: the log dropped %llu messages\n",
+          (unsigned long long)(dropped - ring->dropped_reported));
+      ring->dropped_reported = dropped;
+      wrote = true;
+    }
+  }
+
+  if (wrote) {
+    fflush(stdout);
+    fflush(stderr);
+  }
+  return wrote;
+}
+
+/**
+ * @brief formats one record
+ *
+ * @param record the record
+ */
+static void write_record(const struct async_log_record* record) {
+  fprintf(
+      record->error ? stderr : stdout, record->format,
+      (long long)record->args[0], (long long)record->args[1],
+      (long long)record->args[2]);
+}
+
+/**
+ * @brief gives the calling thread a ring of its own
+ *
+ * @return struct async_log_ring* the ring, NULL if it could not be allocated
+ */
+static struct async_log_ring* take_ring(void) {
+  struct async_log_ring* ring =
+      aligned_alloc(ASYNC_LOG_CACHE_LINE, sizeof(struct async_log_ring));
+  if (NULL == ring) {
+    return NULL;
+  }
+  memset(ring, 0, sizeof(*ring));
+
+  pthread_mutex_lock(&rings_lock);
+  ring->next = atomic_load_explicit(&rings, memory_order_relaxed);
+  atomic_store_explicit(&rings, ring, memory_order_release);
+  pthread_mutex_unlock(&rings_lock);
+
+  thread_ring = ring;
+  return ring;
+}
@@ -0,0 +1,79 @@
+/**
+ * @file async_log.h
+ * @author oclyke
+ * @brief messages logged from the event loops without touching stdio
+ *
+ * printf() on the connection path takes the stdio lock and may block on a
+ * slow terminal or a full pipe, right in the middle of an event loop. Here a
+ * message is a fixed-size binary record instead: a pointer to its format and
+ * up to ASYNC_LOG_MAX_ARGS integer arguments, stored into a ring owned by the
+ * calling thread. A background thread formats the records and writes them
+ * out. Logging costs a few stores, never blocks and never waits for a lock;
+ * when a ring is full the message is dropped and counted.
+ *
+ * The format is kept as a pointer and only read when the record is written
+ * out, so it has to be a string literal. Every argument is passed on as a
+ * long long, so every conversion in the format has to be one of %lld, %llu
+ * or %llx.
+ *
+ * Before async_log_start() and after async_log_stop() messages are written
+ * right away, like with fprintf().
+ */
+
+#ifndef ASYNC_LOG_H_
+#define ASYNC_LOG_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ASYNC_LOG_MAX_ARGS 3
+
+/**
+ * @brief logs a message for stdout
+ *
+ * @param ... a string literal format, see the top of the file, then up to
+ * ASYNC_LOG_MAX_ARGS integers
+ */
+#define LOG_INFO(...) ASYNC_LOG_WRITE(false, __VA_ARGS__, 0)
+
+/**
+ * @brief logs a message for stderr
+ *
+ * @param ... a string literal format, see the top of the file, then up to
+ * ASYNC_LOG_MAX_ARGS integers
+ */
+#define LOG_ERROR(...) ASYNC_LOG_WRITE(true, __VA_ARGS__, 0)
+
+// the trailing 0 appended by LOG_INFO() and LOG_ERROR() keeps the argument
+// list from being empty for messages without arguments, which ISO C does
+// not allow for either a variadic macro or an initializer
+#define ASYNC_LOG_WRITE(error, format, ...) \
+  async_log_write(                          \
+      (error), (format),                    \
+      (const int64_t[ASYNC_LOG_MAX_ARGS + 1]){__VA_ARGS__})
+
+/**
+ * @brief starts the thread that writes logged messages out
+ *
+ * @return int nonzero if the thread could not be started, messages are then
+ * written right away
+ */
+int async_log_start(void);
+
+/**
+ * @brief writes out every message logged so far and stops the thread
+ *
+ * call once no other thread logs anymore, the rings are freed.
+ */
+void async_log_stop(void);
+
+/**
+ * @brief logs a message, use LOG_INFO() and LOG_ERROR() instead
+ *
+ * @param error whether the message goes to stderr rather than stdout
+ * @param format a string literal, see the top of the file
+ * @param args ASYNC_LOG_MAX_ARGS arguments, unused ones are ignored
+ */
+void async_log_write(bool error, const char* format, const int64_t* args);
+
+#endif  // ASYNC_LOG_H_
@@ -0,0 +1,186 @@
+/**
+ * @file buffer_pool.c
+ * @author oclyke
+ * @brief size-classed pool of connection buffers
+ *
+ * Buffers smaller than a slab are carved out of 64 KiB slabs that are kept
+ * until the pool is destroyed. Larger buffers are requested one at a time and
+ * only a few free ones are cached per size, so a burst of huge frames does not
+ * pin its memory forever.
+ */
+
+#include "buffer_pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BUFFER_POOL_SLAB_SIZE ((size_t)64 * 1024)
+#define BUFFER_POOL_ALIGNMENT 64
+#define BUFFER_POOL_MAX_FREE_LARGE 4
+
+static int class_index(size_t size);
+static int grow_class(struct buffer_pool* pool, struct buffer_pool_class* cls);
+static int track_slab(struct buffer_pool* pool, void* slab);
+
+void buffer_pool_init(struct buffer_pool* pool) {
+  memset(pool, 0, sizeof(*pool));
+  for (int idx = 0; idx < BUFFER_POOL_NUM_CLASSES; idx++) {
+    pool->classes[idx].size = BUFFER_POOL_MIN_SIZE << idx;
+  }
+}
+
+void buffer_pool_destroy(struct buffer_pool* pool) {
+  // large buffers are not part of any slab, the free ones are freed one by one
+  for (int idx = 0; idx < BUFFER_POOL_NUM_CLASSES; idx++) {
+    struct buffer_pool_class* cls = &pool->classes[idx];
+    if (cls->size < BUFFER_POOL_SLAB_SIZE) {
+      continue;
+    }
+    while (NULL != cls->free_list) {
+      void* buffer = cls->free_list;
+      cls->free_list = *(void**)buffer;
+      free(buffer);
+    }
+  }
+
+  for (size_t idx = 0; idx < pool->num_slabs; idx++) {
+    free(pool->slabs[idx]);
+  }
+  free(pool->slabs);
+  buffer_pool_init(pool);
+}
+
+void* buffer_pool_get(
+    struct buffer_pool* pool, size_t min_size, size_t* size_out) {
+  int idx = class_index(min_size);
+  if (idx < 0) {
+    return NULL;
+  }
+  struct buffer_pool_class* cls = &pool->classes[idx];
+
+  if ((NULL == cls->free_list) && (0 != grow_class(pool, cls))) {
+    return NULL;
+  }
+
+  void* buffer = cls->free_list;
+  cls->free_list = *(void**)buffer;
+  cls->free_count--;
+  cls->in_use++;
+  pool->buffers_in_use++;
+  pool->bytes_in_use += cls->size;
+
+  if (NULL != size_out) {
+    *size_out = cls->size;
+  }
+  return buffer;
+}
+
+void buffer_pool_put(struct buffer_pool* pool, void* buffer, size_t size) {
+  int idx = class_index(size);
+  if ((idx < 0) || (NULL == buffer)) {
+    return;
+  }
+  struct buffer_pool_class* cls = &pool->classes[idx];
+
+  cls->in_use--;
+  pool->buffers_in_use--;
+  pool->bytes_in_use -= cls->size;
+
+  if ((cls->size >= BUFFER_POOL_SLAB_SIZE) &&
+      (cls->free_count >= BUFFER_POOL_MAX_FREE_LARGE)) {
+    free(buffer);
+    pool->bytes_reserved -= cls->size;
+    return;
+  }
+
+  *(void**)buffer = cls->free_list;
+  cls->free_list = buffer;
+  cls->free_count++;
+}
+
+/**
+ * @brief finds the smallest size class that fits a size
+ *
+ * @param size the size
+ * @return int the class index, negative if the size is too large
+ */
+static int class_index(size_t size) {
+  if (size <= BUFFER_POOL_MIN_SIZE) {
+    return 0;
+  }
+  if (size > BUFFER_POOL_MAX_SIZE) {
+    return -1;
+  }
+  int shift = 64 - __builtin_clzll(size - 1);
+  return shift - BUFFER_POOL_MIN_SHIFT;
+}
+
+/**
+ * @brief adds free buffers to an empty size class
+ *
+ * @param pool the pool
+ * @param cls the class
+ * @return int nonzero if memory ran out
+ */
+static int grow_class(struct buffer_pool* pool, struct buffer_pool_class* cls) {
+  int ret = 0;
+
+  // large buffers are requested on their own
+  if (cls->size >= BUFFER_POOL_SLAB_SIZE) {
+    void* buffer = aligned_alloc(BUFFER_POOL_ALIGNMENT, cls->size);
+    if (NULL == buffer) {
+      ret = 1;
+      goto out;
+    }
+    *(void**)buffer = NULL;
+    cls->free_list = buffer;
+    cls->free_count = 1;
+    pool->bytes_reserved += cls->size;
+    pool->slab_allocations++;
+    goto out;
+  }
+
+  // small buffers are carved out of a slab
+  char* slab = aligned_alloc(BUFFER_POOL_ALIGNMENT, BUFFER_POOL_SLAB_SIZE);
+  if (NULL == slab) {
+    ret = 1;
+    goto out;
+  }
+  if (0 != track_slab(pool, slab)) {
+    free(slab);
+    ret = 1;
+    goto out;
+  }
+
+  size_t count = BUFFER_POOL_SLAB_SIZE / cls->size;
+  for (size_t idx = 0; idx < count; idx++) {
+    void* buffer = slab + idx * cls->size;
+    *(void**)buffer = cls->free_list;
+    cls->free_list = buffer;
+  }
+  cls->free_count += count;
+  pool->bytes_reserved += BUFFER_POOL_SLAB_SIZE;
+  pool->slab_allocations++;
+
+out:
+  return ret;
+}
+
+static int track_slab(struct buffer_pool* pool, void* slab) {
+  int ret = 0;
+
+  if (pool->num_slabs == pool->slabs_cap) {
+    size_t cap = (0 == pool->slabs_cap) ? 16 : 2 * pool->slabs_cap;
+    void** slabs = realloc(pool->slabs, cap * sizeof(void*));
+    if (NULL == slabs) {
+      ret = 1;
+      goto out;
+    }
+    pool->slabs = slabs;
+    pool->slabs_cap = cap;
+  }
+  pool->slabs[pool->num_slabs++] = slab;
+
+out:
+  return ret;
+}
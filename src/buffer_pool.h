@@ -0,0 +1,91 @@
+/**
+ * @file buffer_pool.h
+ * @author oclyke
+ * @brief size-classed pool of connection buffers
+ */
+
+#ifndef BUFFER_POOL_H_
+#define BUFFER_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BUFFER_POOL_MIN_SHIFT 9
+#define BUFFER_POOL_MAX_SHIFT 21
+#define BUFFER_POOL_NUM_CLASSES \
+  (BUFFER_POOL_MAX_SHIFT - BUFFER_POOL_MIN_SHIFT + 1)
+#define BUFFER_POOL_MIN_SIZE ((size_t)1 << BUFFER_POOL_MIN_SHIFT)
+#define BUFFER_POOL_MAX_SIZE ((size_t)1 << BUFFER_POOL_MAX_SHIFT)
+
+/**
+ * @brief free buffers of one size
+ */
+struct buffer_pool_class {
+  size_t size;
+  void* free_list;
+  size_t free_count;
+  size_t in_use;
+};
+
+/**
+ * @brief a pool of power of two sized buffers owned by one thread
+ *
+ * buffers from 512 bytes to 2 MiB are handed out from per-size free lists.
+ * small sizes are carved out of larger slabs so that they share pages and
+ * never fragment the heap, and every buffer starts on a cache line. memory is
+ * only requested from the system when a free list is empty, so after warming
+ * up getting and putting buffers costs a couple of pointer updates. the pool
+ * is not thread safe, every thread uses its own.
+ */
+struct buffer_pool {
+  struct buffer_pool_class classes[BUFFER_POOL_NUM_CLASSES];
+
+  // every block of memory requested from the system, to be freed at the end
+  void** slabs;
+  size_t num_slabs;
+  size_t slabs_cap;
+
+  // counters
+  uint64_t bytes_reserved;
+  uint64_t bytes_in_use;
+  uint64_t buffers_in_use;
+  uint64_t slab_allocations;
+};
+
+/**
+ * @brief sets up an empty pool
+ *
+ * @param pool the pool
+ */
+void buffer_pool_init(struct buffer_pool* pool);
+
+/**
+ * @brief returns all memory held by the pool to the system
+ *
+ * every buffer handed out by the pool becomes invalid.
+ *
+ * @param pool the pool
+ */
+void buffer_pool_destroy(struct buffer_pool* pool);
+
+/**
+ * @brief gets a buffer of at least the given size
+ *
+ * @param pool the pool
+ * @param min_size the smallest acceptable size, at most BUFFER_POOL_MAX_SIZE
+ * @param size_out the actual size of the buffer
+ * @return void* the buffer, NULL if the size is too large or memory ran out
+ */
+void* buffer_pool_get(
+    struct buffer_pool* pool, size_t min_size, size_t* size_out);
+
+/**
+ * @brief gives a buffer back to the pool
+ *
+ * @param pool the pool the buffer came from
+ * @param buffer the buffer
+ * @param size the size reported when the buffer was handed out
+ */
+void buffer_pool_put(struct buffer_pool* pool, void* buffer, size_t size);
+
+#endif  // BUFFER_POOL_H_
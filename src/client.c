@@ -5,18 +5,68 @@
  *
  * This code implements a client to send a message to the
  * server and read the response.
+ *
+ * Given any of the load options it instead turns into a load
+ * generator that keeps many connections busy for a while and
+ * reports the aggregate throughput (see client_load.c).
+ *
+ * With --shm it talks to a server on the same machine through
+ * shared memory instead of a socket (see shm_ring.h), and with
+ * --tls it encrypts with kernel TLS after an OpenSSL handshake
+ * (see tls.c).
+ *
+ * --fastopen puts the message in the SYN with TCP Fast Open, and
+ * --reconnect repeats the echo over a new connection each time
+ * to measure what the handshake costs a connection-per-request
+ * client.
+ *
+ * --timestamps has the kernel timestamp the request as it leaves
+ * and the echo as it arrives (see timestamping.h), which gives
+ * the round trip without the time the client itself takes to
+ * send and to wake up.
  */
 
+#include <errno.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "client_load.h"
+#include "histogram.h"
+#include "protocol.h"
+#include "shm_ring.h"
+#include "timestamping.h"
+#include "tls.h"
+
+#define UDP_ECHO_TIMEOUT_S 1
+#define SHM_ECHO_TIMEOUT_NS 1000000000ull
+#define NSEC_PER_USEC 1000ull
+#define RECONNECT_HISTOGRAM_MAX_NS (60 * 1000000000ull)
+
 static int show_usage(char* progname);
+static int recv_all(int sockfd, char* buffer, int len, uint64_t* rx_ns_out);
+static int echo_over_shm(const char* shm_name, const char* message);
+static bool shm_echo_ready(void* arg);
+static int echo_per_connection(
+    const struct sockaddr_storage* serv_addr, socklen_t serv_addr_len,
+    const char* message, bool fastopen, bool timestamps, int count);
+static int send_all(
+    int sockfd, const struct sockaddr_storage* serv_addr,
+    socklen_t serv_addr_len, const char* message, int len, bool fastopen);
+static bool sent_in_syn(int sockfd);
+static void print_transmit_timestamps(int sockfd, uint64_t rx_ns);
+static uint64_t now_ns(void);
 
 int main(int argc, char* argv[]) {
   // set some initial values
@@ -24,6 +74,28 @@ int main(int argc, char* argv[]) {
   char* hostname = "localhost";
   int port_number = -1;
   char* message = "hello world";
+  bool load_mode = false;
+  int num_connections = 1;
+  int num_threads = 1;
+  double duration_s = 10.0;
+  double rate = 0.0;
+  char* histogram_path = NULL;
+  bool framed = false;
+  int pipeline_depth = 1;
+  int message_size = 0;
+  bool sink = false;
+  bool udp = false;
+  int batch = 32;
+  bool gso = false;
+  char* unix_path = NULL;
+  bool seqpacket = false;
+  char* shm_name = NULL;
+  bool tls = false;
+  char* tls_ca_path = NULL;
+  bool fastopen = false;
+  int reconnect_count = 0;
+  bool timestamps = false;
+  int tcp_info_interval_ms = 0;
 
   // parse arguments
   // - the supplied arguments always begins with the name of the program
@@ -49,64 +121,386 @@ int main(int argc, char* argv[]) {
     } else if (strcmp(arg, "--message") == 0) {
       idx++;
       message = argv[idx];
+    } else if (strcmp(arg, "--connections") == 0) {
+      idx++;
+      num_connections = atoi(argv[idx]);
+      load_mode = true;
+    } else if (strcmp(arg, "--threads") == 0) {
+      idx++;
+      num_threads = atoi(argv[idx]);
+      load_mode = true;
+    } else if (strcmp(arg, "--duration") == 0) {
+      idx++;
+      duration_s = atof(argv[idx]);
+      load_mode = true;
+    } else if (strcmp(arg, "--rate") == 0) {
+      idx++;
+      rate = atof(argv[idx]);
+      load_mode = true;
+    } else if (strcmp(arg, "--histogram") == 0) {
+      idx++;
+      histogram_path = argv[idx];
+      load_mode = true;
+    } else if (strcmp(arg, "--pipeline-depth") == 0) {
+      idx++;
+      pipeline_depth = atoi(argv[idx]);
+      load_mode = true;
+    } else if (strcmp(arg, "--message-size") == 0) {
+      idx++;
+      message_size = atoi(argv[idx]);
+      load_mode = true;
+    } else if (strcmp(arg, "--tcp-info") == 0) {
+      idx++;
+      tcp_info_interval_ms = atoi(argv[idx]);
+      load_mode = true;
+    } else if (strcmp(arg, "--framed") == 0) {
+      framed = true;
+    } else if (strcmp(arg, "--sink") == 0) {
+      sink = true;
+      load_mode = true;
+    } else if (strcmp(arg, "--udp") == 0) {
+      udp = true;
+    } else if (strcmp(arg, "--batch") == 0) {
+      idx++;
+      batch = atoi(argv[idx]);
+      load_mode = true;
+    } else if (strcmp(arg, "--gso") == 0) {
+      gso = true;
+      load_mode = true;
+    } else if (strcmp(arg, "--unix") == 0) {
+      idx++;
+      unix_path = argv[idx];
+    } else if (strcmp(arg, "--seqpacket") == 0) {
+      seqpacket = true;
+    } else if (strcmp(arg, "--shm") == 0) {
+      idx++;
+      shm_name = argv[idx];
+    } else if (strcmp(arg, "--tls") == 0) {
+      tls = true;
+    } else if (strcmp(arg, "--tls-ca") == 0) {
+      idx++;
+      tls_ca_path = argv[idx];
+      tls = true;
+    } else if (strcmp(arg, "--fastopen") == 0) {
+      fastopen = true;
+    } else if (strcmp(arg, "--reconnect") == 0) {
+      idx++;
+      reconnect_count = atoi(argv[idx]);
+    } else if (strcmp(arg, "--timestamps") == 0) {
+      timestamps = true;
     } else {
       port_number = atoi(arg);
     }
   }
 
-  // construct a socket to be used in connection mode
-  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  if (sockfd < 0) {
-    fprintf(stderr, "ERROR creating socket\n");
+  // validate arguments
+  if ((port_number <= 0) && (NULL == unix_path) && (NULL == shm_name)) {
+    fprintf(stderr, "ERROR: invalid port number: %d\n", port_number);
+    show_usage(progname);
     return 1;
   }
+  if (load_mode) {
+    if ((num_connections <= 0) || (num_threads <= 0) || (duration_s <= 0) ||
+        (rate < 0) || (pipeline_depth <= 0) || (message_size < 0) ||
+        (batch <= 0) || (batch > LOAD_UDP_MAX_BATCH) ||
+        (tcp_info_interval_ms < 0)) {
+      fprintf(stderr, "ERROR: invalid load options\n");
+      show_usage(progname);
+      return 1;
+    }
+    if (num_threads > num_connections) {
+      num_threads = num_connections;
+    }
+    // a shared memory lane is a single byte stream that its thread spins on
+    if (NULL != shm_name) {
+      num_threads = num_connections;
+    }
+  }
 
-  // get server information
-  struct hostent* server = gethostbyname(hostname);
-  if (server == NULL) {
-    fprintf(stderr, "ERROR, no such host\n");
+  // bulk messages are generated rather than typed on the command line
+  if (message_size > 0) {
+    char* generated = malloc(message_size + 1);
+    if (NULL == generated) {
+      fprintf(stderr, "ERROR: failed to allocate the message\n");
+      return 1;
+    }
+    for (int idx = 0; idx < message_size; idx++) {
+      generated[idx] = 'a' + (idx % 26);
+    }
+    generated[message_size] = 0;
+    message = generated;
+  }
+  if (framed && (strlen(message) > FRAME_MAX_PAYLOAD_LEN)) {
+    fprintf(stderr, "ERROR: message is too long for a frame\n");
+    return 1;
+  }
+  if (gso && !udp) {
+    fprintf(stderr, "ERROR: --gso needs --udp\n");
+    return 1;
+  }
+  if (udp && framed) {
+    fprintf(stderr, "ERROR: --udp does not go with --framed\n");
+    return 1;
+  }
+  if (udp && (strlen(message) > LOAD_UDP_MAX_DATAGRAM_LEN)) {
+    fprintf(stderr, "ERROR: message is too long for a datagram\n");
+    return 1;
+  }
+  if ((NULL != unix_path) && udp) {
+    fprintf(stderr, "ERROR: --unix does not go with --udp\n");
+    return 1;
+  }
+  if (seqpacket && ((NULL == unix_path) || framed)) {
+    fprintf(stderr, "ERROR: --seqpacket needs --unix and not --framed\n");
+    return 1;
+  }
+  if (seqpacket && (strlen(message) > LOAD_MAX_RECORD_LEN)) {
+    fprintf(stderr, "ERROR: message is too long for a record\n");
+    return 1;
+  }
+  if ((NULL != shm_name) &&
+      (framed || sink || udp || (NULL != unix_path) || seqpacket)) {
+    fprintf(
+        stderr,
+        "ERROR: --shm does not go with --framed, --sink, --udp, --unix or "
+        "--seqpacket\n");
+    return 1;
+  }
+  if (tls && (udp || (NULL != unix_path) || (NULL != shm_name))) {
+    fprintf(stderr, "ERROR: --tls needs TCP, not --udp, --unix or --shm\n");
+    return 1;
+  }
+  if ((tcp_info_interval_ms > 0) &&
+      (udp || (NULL != unix_path) || (NULL != shm_name))) {
+    fprintf(
+        stderr, "ERROR: --tcp-info needs TCP, not --udp, --unix or --shm\n");
+    return 1;
+  }
+  if (reconnect_count < 0) {
+    fprintf(stderr, "ERROR: invalid number of connections to reconnect\n");
+    return 1;
+  }
+  if ((fastopen || (reconnect_count > 0)) &&
+      (load_mode || framed || udp || (NULL != unix_path) ||
+       (NULL != shm_name) || tls)) {
+    fprintf(
+        stderr,
+        "ERROR: --fastopen and --reconnect need plain TCP without load "
+        "options, --framed, --udp, --unix, --shm or --tls\n");
+    return 1;
+  }
+  // transmit timestamps are numbered from the connected socket, which Fast
+  // Open only connects with its first send
+  if (timestamps &&
+      (load_mode || udp || (NULL != unix_path) || (NULL != shm_name) || tls ||
+       fastopen)) {
+    fprintf(
+        stderr,
+        "ERROR: --timestamps needs plain TCP without load options, --udp, "
+        "--unix, --shm, --tls or --fastopen\n");
     return 1;
   }
+  struct tls_context* tls_context = NULL;
+  if (tls && (0 != tls_context_create_client(tls_ca_path, &tls_context))) {
+    return 1;
+  }
+  int socket_type = seqpacket ? SOCK_SEQPACKET : SOCK_STREAM;
+  if (udp) {
+    socket_type = SOCK_DGRAM;
+  }
 
   // get server address information
-  struct sockaddr_in serv_addr;
+  // a unix domain socket is found by its path, anything else by host and port
+  struct sockaddr_storage serv_addr;
+  socklen_t serv_addr_len;
+  char address[128];
   bzero((char*)&serv_addr, sizeof(serv_addr));
-  serv_addr.sin_family = AF_INET;
-  bcopy(
-      (char*)server->h_addr, (char*)&serv_addr.sin_addr.s_addr,
-      server->h_length);
-  serv_addr.sin_port = htons(port_number);
+  if (NULL != shm_name) {
+    // there is no socket to address, the name finds the region
+    serv_addr_len = 0;
+    snprintf(address, sizeof(address), "%s (shared memory)", shm_name);
+  } else if (NULL != unix_path) {
+    struct sockaddr_un* unix_addr = (struct sockaddr_un*)&serv_addr;
+    if (strlen(unix_path) >= sizeof(unix_addr->sun_path)) {
+      fprintf(stderr, "ERROR: unix socket path is too long\n");
+      return 1;
+    }
+    unix_addr->sun_family = AF_UNIX;
+    strcpy(unix_addr->sun_path, unix_path);
+    serv_addr_len = sizeof(*unix_addr);
+    snprintf(address, sizeof(address), "%s", unix_path);
+  } else {
+    // get server information
+    struct hostent* server = gethostbyname(hostname);
+    if (server == NULL) {
+      fprintf(stderr, "ERROR, no such host\n");
+      return 1;
+    }
 
-  // connect the socket to the server
-  printf("connecting to server at %s:%d\n", hostname, port_number);
-  ret = connect(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr));
-  if (ret < 0) {
-    fprintf(stderr, "ERROR connecting to server\n");
+    struct sockaddr_in* ip_addr = (struct sockaddr_in*)&serv_addr;
+    ip_addr->sin_family = AF_INET;
+    bcopy(
+        (char*)server->h_addr, (char*)&ip_addr->sin_addr.s_addr,
+        server->h_length);
+    ip_addr->sin_port = htons(port_number);
+    serv_addr_len = sizeof(*ip_addr);
+    snprintf(address, sizeof(address), "%s:%d", hostname, port_number);
+  }
+
+  // in load mode the load generator takes it from here
+  if (load_mode) {
+    struct load_config config = {
+        .server_addr = serv_addr,
+        .server_addr_len = serv_addr_len,
+        .socket_type = socket_type,
+        .message = message,
+        .message_len = strlen(message),
+        .num_connections = num_connections,
+        .num_threads = num_threads,
+        .duration_s = duration_s,
+        .rate = rate,
+        .pipeline_depth = pipeline_depth,
+        .framed = framed,
+        .sink = sink,
+        .udp = udp,
+        .batch = batch,
+        .gso = gso,
+        .shm_name = shm_name,
+        .tls = tls_context,
+        .histogram_path = histogram_path,
+        .tcp_info_interval_ms = tcp_info_interval_ms,
+    };
+    printf("load testing server at %s for %.2f s\n", address, duration_s);
+    return run_load(&config);
+  }
+  if (NULL != shm_name) {
+    printf("connecting to server at %s\n", address);
+    return echo_over_shm(shm_name, message);
+  }
+  if (reconnect_count > 0) {
+    printf(
+        "echoing over %d new connections to server at %s%s\n",
+        reconnect_count, address, fastopen ? " with TCP Fast Open" : "");
+    return echo_per_connection(
+        &serv_addr, serv_addr_len, message, fastopen, timestamps,
+        reconnect_count);
+  }
+
+  // construct a socket to be used in connection mode
+  // a connected UDP socket only talks to the server, so the rest works the
+  // same except that the whole echo arrives as one datagram (or not at all)
+  int sockfd = socket(serv_addr.ss_family, socket_type, 0);
+  if (sockfd < 0) {
+    fprintf(stderr, "ERROR creating socket\n");
     return 1;
   }
+  if (udp) {
+    struct timeval timeout = {.tv_sec = UDP_ECHO_TIMEOUT_S};
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  }
 
-  // send the message to the server
+  // connect the socket to the server
+  // with TCP Fast Open there is no separate connect, the first send opens the
+  // connection and carries the message in the SYN
+  // the time to connect is counted separately, so that a connection per
+  // request can be compared with and without Fast Open
+  printf("connecting to server at %s\n", address);
   printf("sending message: \"%s\"\n", message);
-  int message_len = strlen(message);
-  int chars_sent = send(sockfd, &message, message_len, 0);
-  if (chars_sent < 0) {
-    fprintf(stderr, "ERROR sending message\n");
+  struct timespec connect_time;
+  clock_gettime(CLOCK_MONOTONIC, &connect_time);
+  if (!fastopen) {
+    ret = connect(sockfd, (struct sockaddr*)&serv_addr, serv_addr_len);
+    if (ret < 0) {
+      fprintf(stderr, "ERROR connecting to server\n");
+      return 1;
+    }
+  }
+
+  // after the handshake the kernel encrypts and decrypts, the socket is used
+  // just like a plain one
+  if ((NULL != tls_context) && (0 != tls_handshake(tls_context, sockfd))) {
+    fprintf(stderr, "ERROR: TLS handshake with the server failed\n");
     return 1;
   }
-  if (chars_sent != message_len) {
-    fprintf(
-        stderr,
-        "ERROR: expected to send %d characters but actually sent %d "
-        "characters\n",
-        message_len, chars_sent);
+
+  // the kernel notes when the request leaves and when the echo arrives
+  if (timestamps && (0 != timestamping_enable(sockfd, true))) {
+    fprintf(stderr, "ERROR: failed to enable timestamps\n");
     return 1;
   }
 
+  // send the message to the server
+  // the round trip is timed from just before the send until the last echoed
+  // character arrives
+  struct timespec send_time;
+  clock_gettime(CLOCK_MONOTONIC, &send_time);
+  int message_len = strlen(message);
+
+  // in framed mode the message is preceded by its header, MSG_MORE lets the
+  // kernel put both in the same segment
+  const uint32_t request_id = 1;
+  if (framed) {
+    char header[FRAME_HEADER_LEN];
+    struct frame_header frame = {
+        .length = message_len,
+        .request_id = request_id,
+    };
+    frame_header_encode(header, &frame);
+    if (send(sockfd, header, FRAME_HEADER_LEN, MSG_MORE) != FRAME_HEADER_LEN) {
+      fprintf(stderr, "ERROR sending frame header\n");
+      return 1;
+    }
+  }
+
+  if (fastopen) {
+    if (0 != send_all(
+                 sockfd, &serv_addr, serv_addr_len, message, message_len,
+                 true)) {
+      fprintf(stderr, "ERROR sending message in the SYN\n");
+      return 1;
+    }
+  } else {
+    int chars_sent = send(sockfd, message, message_len, 0);
+    if (chars_sent < 0) {
+      fprintf(stderr, "ERROR sending message\n");
+      return 1;
+    }
+    if (chars_sent != message_len) {
+      fprintf(
+          stderr,
+          "ERROR: expected to send %d characters but actually sent %d "
+          "characters\n",
+          message_len, chars_sent);
+      return 1;
+    }
+  }
+
+  // in framed mode the response header says how long the echo is and which
+  // request it answers
+  if (framed) {
+    char header[FRAME_HEADER_LEN];
+    if (0 != recv_all(sockfd, header, FRAME_HEADER_LEN, NULL)) {
+      fprintf(stderr, "ERROR receiving frame header\n");
+      return 1;
+    }
+    struct frame_header frame;
+    frame_header_decode(header, &frame);
+    // message_len came from strlen(), so it is never negative
+    if ((frame.request_id != request_id) ||
+        (frame.length != (uint32_t)message_len)) {
+      fprintf(
+          stderr, "ERROR: unexpected response frame (id %u, %u chars)\n",
+          frame.request_id, frame.length);
+      return 1;
+    }
+  }
+
   // read the response from the server
   printf("receiving response: \"");
   const size_t rx_buffer_len = message_len;
   char rx_buffer[rx_buffer_len + 1];
   int total_received = 0;
+  uint64_t rx_ns = 0;
   while (total_received < message_len) {
     // determine how many characters left to get back the whole message
     int chars_remaining = message_len - total_received;
@@ -119,15 +513,25 @@ int main(int argc, char* argv[]) {
     }
 
     // receive a chunk from the server
-    int chars_received = recv(sockfd, &rx_buffer, chars_request, 0);
+    // a stream socket may hand back fewer characters than requested, the rest
+    // arrive on later iterations. the last chunk's timestamp is when the
+    // whole echo was in
+    int chars_received =
+        timestamps
+            ? timestamping_recv(sockfd, rx_buffer, chars_request, 0, &rx_ns)
+            : recv(sockfd, rx_buffer, chars_request, 0);
     if (chars_received < 0) {
+      if (udp && ((EAGAIN == errno) || (EWOULDBLOCK == errno))) {
+        fprintf(stderr, "ERROR: no echo within %d s\n", UDP_ECHO_TIMEOUT_S);
+        return 1;
+      }
       fprintf(stderr, "ERROR receiving message\n");
       return 1;
     }
-    if (chars_received != chars_request) {
+    if (0 == chars_received) {
       fprintf(
-          stderr, "ERROR: expected to read %d chars but actually read %d\n",
-          chars_request, chars_received);
+          stderr, "ERROR: server closed the connection after %d of %d chars\n",
+          total_received, message_len);
       return 1;
     }
 
@@ -137,13 +541,35 @@ int main(int argc, char* argv[]) {
     // ensure null-termination
     // (this uses a secret extra entry in the rx buffer that is not accounted
     // for in rx_buffer_len)
-    rx_buffer[rx_buffer_len] = 0;
+    rx_buffer[chars_received] = 0;
 
     // show the portion of received characters:
-    printf("%s");
+    printf("%s", rx_buffer);
   }
   printf("\"\n");
 
+  struct timespec receive_time;
+  clock_gettime(CLOCK_MONOTONIC, &receive_time);
+  double round_trip_us = (receive_time.tv_sec - send_time.tv_sec) * 1e6 +
+                         (receive_time.tv_nsec - send_time.tv_nsec) / 1e3;
+  printf("round trip: %.3f us\n", round_trip_us);
+  double connect_round_trip_us =
+      (receive_time.tv_sec - connect_time.tv_sec) * 1e6 +
+      (receive_time.tv_nsec - connect_time.tv_nsec) / 1e3;
+  printf("round trip with the handshake: %.3f us\n", connect_round_trip_us);
+  if (timestamps) {
+    print_transmit_timestamps(sockfd, rx_ns);
+  }
+
+  // the first connection to a server only fetches a cookie, later ones can
+  // use it to put their data in the SYN
+  if (fastopen) {
+    printf(
+        "%s\n", sent_in_syn(sockfd)
+                    ? "the message went out in the SYN"
+                    : "the message waited for the handshake (no cookie yet?)");
+  }
+
   return 0;
 }
 
@@ -154,9 +580,391 @@ static int show_usage(char* progname) {
       "Usage: %s [options] <listening port number>\n"
       "Options:\n"
       "--hostname <hostname>: the hostname to use, defualts to \"localhost\"\n"
-      "--message <message>: the message to send to the server\n",
+      "--message <message>: the message to send to the server\n"
+      "--framed: send length-prefixed frames (see protocol.h), the server "
+      "must be started with --framed too\n"
+      "--udp: send UDP datagrams, the server must be started with --udp too\n"
+      "--unix <path>: connect to a unix domain socket instead of a TCP port\n"
+      "--seqpacket: with --unix, send every request as a SOCK_SEQPACKET "
+      "record, the server must be started with --seqpacket too\n"
+      "--shm <name>: talk to a server on this machine through its shared "
+      "memory object instead of a socket, the server must be started with "
+      "--shm too. in load mode every connection gets a thread of its own\n"
+      "--tls: shake hands over TLS and leave the records to kernel TLS, the "
+      "server must be started with --tls-cert and --tls-key. the server's "
+      "certificate is not checked\n"
+      "--tls-ca <file>: like --tls, but check the server's certificate "
+      "against the PEM certificates in this file\n"
+      "--fastopen: send the message in the SYN with TCP Fast Open, once an "
+      "earlier connection has fetched a cookie from the server\n"
+      "--reconnect <count>: echo the message over this many connections one "
+      "after the other, a new one for every echo, and report the latency "
+      "including the handshake\n"
+      "--timestamps: also report the round trip between the kernel sending "
+      "the message and receiving its echo, not with --fastopen\n"
+      "\n"
+      "Load options (any of these turns the client into a load generator):\n"
+      "--connections <count>: connections to keep busy, defaults to 1\n"
+      "--threads <count>: threads driving the connections, defaults to 1\n"
+      "--duration <seconds>: how long to run, defaults to 10\n"
+      "--rate <requests/sec>: send open-loop on a fixed timetable at this "
+      "total rate and measure latency from each intended send time, defaults "
+      "to closed-loop as fast as possible\n"
+      "--pipeline-depth <count>: requests kept in flight per connection in "
+      "closed-loop mode, defaults to 1\n"
+      "--histogram <file>: write the full latency distribution to a file\n"
+      "--tcp-info <ms>: sample TCP_INFO of every connection this often and "
+      "report the round trip times, congestion windows, delivery rates and "
+      "retransmits, not with --udp, --unix or --shm\n"
+      "--message-size <bytes>: send a generated message of this size instead "
+      "of --message, for bulk throughput tests\n"
+      "--sink: only send, for a server started with --sink. latency is then "
+      "the time until a request has been handed to the kernel\n"
+      "--batch <count>: datagrams per sendmmsg() and recvmmsg() with --udp, "
+      "at most 1024, defaults to 32\n"
+      "--gso: with --udp, send up to 64 datagrams per buffer with UDP_SEGMENT "
+      "and receive coalesced echoes with UDP_GRO\n",
       progname);
 
 out:
   return ret;
 }
+
+/**
+ * @brief receives exactly len characters
+ *
+ * @param sockfd a connected blocking socket
+ * @param buffer where to put the characters
+ * @param len the number of characters to receive
+ * @param rx_ns_out if not NULL, set to the kernel's receive timestamp of the
+ * last characters, which needs timestamps enabled on the socket
+ * @return int nonzero if the connection failed or closed first
+ */
+static int recv_all(int sockfd, char* buffer, int len, uint64_t* rx_ns_out) {
+  int ret = 0;
+
+  int total_received = 0;
+  while (total_received < len) {
+    int chars_received =
+        (NULL != rx_ns_out)
+            ? timestamping_recv(
+                  sockfd, buffer + total_received, len - total_received, 0,
+                  rx_ns_out)
+            : recv(sockfd, buffer + total_received, len - total_received, 0);
+    if (chars_received <= 0) {
+      ret = 1;
+      goto out;
+    }
+    total_received += chars_received;
+  }
+
+out:
+  return ret;
+}
+
+/**
+ * @brief sends one message through a lane of a shared memory region and
+ * prints its echo
+ *
+ * the message and its echo may be larger than a ring, so both directions
+ * make progress in the same loop. with nothing to do the client spins and
+ * then sleeps on its doorbell like the load generator does.
+ *
+ * @param shm_name the name of the server's shared memory object
+ * @param message the message
+ * @return int nonzero if the echo did not come back in full
+ */
+static int echo_over_shm(const char* shm_name, const char* message) {
+  int ret = 0;
+
+  struct shm_region* region;
+  size_t region_len;
+  if (0 != shm_region_open(shm_name, &region, &region_len)) {
+    ret = 1;
+    goto out;
+  }
+  struct shm_lane* lane = shm_lane_attach(region);
+  if (NULL == lane) {
+    fprintf(stderr, "ERROR: every lane of %s is taken\n", shm_name);
+    ret = 1;
+    goto cleanup;
+  }
+
+  printf("sending message: \"%s\"\n", message);
+  printf("receiving response: \"");
+  struct timespec send_time;
+  clock_gettime(CLOCK_MONOTONIC, &send_time);
+  size_t message_len = strlen(message);
+  size_t total_sent = 0;
+  size_t total_received = 0;
+  struct shm_waiter waiter;
+  shm_waiter_init(&waiter);
+  while (total_received < message_len) {
+    bool busy = false;
+    if (total_sent < message_len) {
+      size_t written = shm_ring_write(
+          &lane->requests, message + total_sent, message_len - total_sent);
+      if (written > 0) {
+        total_sent += written;
+        shm_doorbell_ring(&lane->server_bell);
+        busy = true;
+      }
+    }
+
+    const char* data;
+    size_t len = shm_ring_peek(&lane->responses, &data);
+    if (len > 0) {
+      if (len > (message_len - total_received)) {
+        len = message_len - total_received;
+      }
+      printf("%.*s", (int)len, data);
+      total_received += len;
+      shm_ring_consume(&lane->responses, len);
+      shm_doorbell_ring(&lane->server_bell);
+      busy = true;
+    }
+
+    if (!busy) {
+      // the server answers right away or not at all
+      uint64_t sleeps = waiter.sleeps;
+      shm_wait(
+          &waiter, &lane->client_bell, shm_echo_ready, lane,
+          SHM_ECHO_TIMEOUT_NS);
+      if ((waiter.sleeps > sleeps) && !shm_echo_ready(lane)) {
+        printf("\"\n");
+        fprintf(stderr, "ERROR: no echo within 1 s\n");
+        ret = 1;
+        goto detach;
+      }
+    }
+  }
+  printf("\"\n");
+
+  struct timespec receive_time;
+  clock_gettime(CLOCK_MONOTONIC, &receive_time);
+  double round_trip_us = (receive_time.tv_sec - send_time.tv_sec) * 1e6 +
+                         (receive_time.tv_nsec - send_time.tv_nsec) / 1e3;
+  printf("round trip: %.3f us\n", round_trip_us);
+
+detach:
+  shm_lane_detach(lane);
+
+cleanup:
+  shm_region_close(region, region_len);
+
+out:
+  return ret;
+}
+
+/**
+ * @brief tells whether an echo is waiting in a lane
+ *
+ * @param arg the lane
+ * @return bool whether the response ring holds anything
+ */
+static bool shm_echo_ready(void* arg) {
+  struct shm_lane* lane = arg;
+  return shm_ring_used(&lane->responses) > 0;
+}
+
+/**
+ * @brief echoes the message over a new connection each time and reports the
+ * latencies
+ *
+ * every latency runs from just before the connection is opened until the
+ * whole echo has arrived, so it includes the handshake. closing the
+ * connection is not counted, the client closes first and that costs it no
+ * round trip.
+ *
+ * @param serv_addr the server's address
+ * @param serv_addr_len the length of the address
+ * @param message the message
+ * @param fastopen send the message in the SYN with TCP Fast Open
+ * @param timestamps also report the latencies between the kernel sending
+ * the message and receiving the whole echo
+ * @param count the number of connections
+ * @return int nonzero if any echo failed
+ */
+static int echo_per_connection(
+    const struct sockaddr_storage* serv_addr, socklen_t serv_addr_len,
+    const char* message, bool fastopen, bool timestamps, int count) {
+  int ret = 0;
+
+  struct histogram latency;
+  struct histogram wire_latency;
+  if (0 != histogram_init(&latency, RECONNECT_HISTOGRAM_MAX_NS)) {
+    fprintf(stderr, "ERROR: failed to allocate latency histogram\n");
+    ret = 1;
+    goto out;
+  }
+  if (0 != histogram_init(&wire_latency, RECONNECT_HISTOGRAM_MAX_NS)) {
+    fprintf(stderr, "ERROR: failed to allocate latency histogram\n");
+    histogram_destroy(&latency);
+    ret = 1;
+    goto out;
+  }
+  int message_len = strlen(message);
+  char* rx_buffer = malloc(message_len);
+  if (NULL == rx_buffer) {
+    fprintf(stderr, "ERROR: failed to allocate receive buffer\n");
+    ret = 1;
+    goto cleanup;
+  }
+
+  int num_in_syn = 0;
+  uint64_t start_ns = now_ns();
+  for (int idx = 0; idx < count; idx++) {
+    int sockfd = socket(serv_addr->ss_family, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+      fprintf(stderr, "ERROR creating socket\n");
+      ret = 1;
+      goto free_buffer;
+    }
+
+    uint64_t connect_ns = now_ns();
+    // with fastopen the first send connects
+    int connected = fastopen ? 0
+                             : connect(
+                                   sockfd, (const struct sockaddr*)serv_addr,
+                                   serv_addr_len);
+    uint64_t rx_ns = 0;
+    if ((0 != connected) ||
+        (timestamps && (0 != timestamping_enable(sockfd, true))) ||
+        (0 != send_all(
+                  sockfd, serv_addr, serv_addr_len, message, message_len,
+                  fastopen)) ||
+        (0 != recv_all(
+                  sockfd, rx_buffer, message_len,
+                  timestamps ? &rx_ns : NULL))) {
+      fprintf(stderr, "ERROR: echo %d of %d failed\n", idx + 1, count);
+      close(sockfd);
+      ret = 1;
+      goto free_buffer;
+    }
+    histogram_record(&latency, now_ns() - connect_ns);
+    struct timestamping_transmit transmit = {0};
+    if (timestamps && (timestamping_read_transmit(sockfd, &transmit) > 0) &&
+        (0 != transmit.sent_ns) && (rx_ns > transmit.sent_ns)) {
+      histogram_record(&wire_latency, rx_ns - transmit.sent_ns);
+    }
+    if (sent_in_syn(sockfd)) {
+      num_in_syn++;
+    }
+    close(sockfd);
+  }
+  double elapsed_s = (now_ns() - start_ns) / 1e9;
+
+  printf(
+      "connections: %d in %.3f s (%.0f/sec), %d with the message in the "
+      "SYN\n",
+      count, elapsed_s, count / elapsed_s, num_in_syn);
+  histogram_print_percentiles(
+      &latency, stdout, "latency", NSEC_PER_USEC, "us");
+  if (timestamps) {
+    histogram_print_percentiles(
+        &wire_latency, stdout, "sent to echo received, kernel timestamps",
+        NSEC_PER_USEC, "us");
+  }
+
+free_buffer:
+  free(rx_buffer);
+
+cleanup:
+  histogram_destroy(&wire_latency);
+  histogram_destroy(&latency);
+
+out:
+  return ret;
+}
+
+/**
+ * @brief sends exactly len characters, opening the connection first with TCP
+ * Fast Open if asked to
+ *
+ * @param sockfd a blocking stream socket, connected unless fastopen is set
+ * @param serv_addr with fastopen, the server's address
+ * @param serv_addr_len the length of the address
+ * @param message the characters
+ * @param len the number of characters
+ * @param fastopen connect with MSG_FASTOPEN, which puts the first characters
+ * in the SYN when a cookie from an earlier connection is at hand and falls
+ * back to a regular handshake otherwise
+ * @return int nonzero if the connection failed
+ */
+static int send_all(
+    int sockfd, const struct sockaddr_storage* serv_addr,
+    socklen_t serv_addr_len, const char* message, int len, bool fastopen) {
+  int ret = 0;
+
+  int total_sent = 0;
+  if (fastopen) {
+    total_sent = sendto(
+        sockfd, message, len, MSG_FASTOPEN, (const struct sockaddr*)serv_addr,
+        serv_addr_len);
+    if (total_sent < 0) {
+      ret = 1;
+      goto out;
+    }
+  }
+  while (total_sent < len) {
+    int chars_sent = send(sockfd, message + total_sent, len - total_sent, 0);
+    if (chars_sent < 0) {
+      ret = 1;
+      goto out;
+    }
+    total_sent += chars_sent;
+  }
+
+out:
+  return ret;
+}
+
+/**
+ * @brief tells whether the server took data from the SYN of a connection
+ *
+ * @param sockfd the connected socket
+ * @return bool whether the server acknowledged data sent in the SYN
+ */
+static bool sent_in_syn(int sockfd) {
+  struct tcp_info info;
+  socklen_t info_len = sizeof(info);
+  if (0 != getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &info_len)) {
+    return false;
+  }
+  return 0 != (info.tcpi_options & TCPI_OPT_SYN_DATA);
+}
+
+/**
+ * @brief prints the kernel's view of an echo
+ *
+ * the request's transmit timestamps are on the error queue by the time its
+ * echo has arrived: the echo itself acknowledges the request.
+ *
+ * @param sockfd the socket, with transmit timestamps enabled
+ * @param rx_ns the receive timestamp of the end of the echo, 0 for none
+ */
+static void print_transmit_timestamps(int sockfd, uint64_t rx_ns) {
+  struct timestamping_transmit transmit = {0};
+  if (timestamping_read_transmit(sockfd, &transmit) < 0) {
+    fprintf(stderr, "ERROR reading transmit timestamps\n");
+    return;
+  }
+  if ((0 == transmit.sent_ns) || (0 == rx_ns)) {
+    printf("no kernel timestamps for the echo\n");
+    return;
+  }
+  printf(
+      "round trip from the kernel sending to receiving: %.3f us\n",
+      ((int64_t)(rx_ns - transmit.sent_ns)) / 1e3);
+  if (0 != transmit.acked_ns) {
+    printf(
+        "request acknowledged after: %.3f us\n",
+        ((int64_t)(transmit.acked_ns - transmit.sent_ns)) / 1e3);
+  }
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
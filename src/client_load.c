@@ -0,0 +1,1789 @@
+/**
+ * @file client_load.c
+ * @author oclyke
+ * @brief load generator mode of the client
+ *
+ * Instead of sending one message and exiting the client can open many
+ * connections from several threads and keep them all busy for a fixed amount
+ * of time. Each thread owns a share of the connections and drives them from
+ * its own epoll loop with non-blocking sockets, so no thread ever waits on any
+ * single connection.
+ *
+ * Without a rate the load is closed-loop: each connection keeps a fixed number
+ * of requests in flight (the pipeline depth) and sends the next request as
+ * soon as an earlier one is answered. With a rate the load is
+ * open-loop: each connection gets its own slots in a fixed timetable and sends
+ * on schedule whether or not earlier echoes have come back. Latency is then
+ * measured from the slot a request was *meant* to be sent in, so a server
+ * stall delays every request scheduled during it, exactly like it would delay
+ * real users (this is the coordinated omission correction). Connections wait
+ * for their next slot in a min-heap ordered by send time so the loop knows
+ * how long it may sleep.
+ *
+ * Against a sink server nothing comes back, so a request is complete once all
+ * of it has been handed to the kernel and closed-loop connections simply keep
+ * their socket full.
+ *
+ * With TLS every connection shakes hands as soon as it is connected and then
+ * leaves encryption to the kernel (see tls.c), so the rest of the test runs
+ * exactly like it would on plain connections. The handshake blocks its
+ * thread, which only matters while the connections are being set up.
+ *
+ * Over a unix domain socket the connections work the same, and with
+ * SOCK_SEQPACKET every request is sent as a record of its own.
+ *
+ * In framed mode (see protocol.h) every request carries a per-connection
+ * request id, and responses are matched to requests by that id rather than
+ * by counting echoed bytes.
+ *
+ * In UDP mode every connection is a connected UDP socket and every request a
+ * datagram that starts with its sequence number and intended send time, so
+ * echoes need no bookkeeping beyond a count of what is in flight. Datagrams
+ * are sent and received in batches with sendmmsg() and recvmmsg(). An echo
+ * that arrives after a later one counts as reordered, and whatever was sent
+ * but never came back (after a short grace period at the end) as lost. In
+ * closed-loop mode a connection that has not seen an echo for a while writes
+ * off its window and starts a new one, so lost datagrams cannot stall it.
+ * With GSO each buffer handed to sendmmsg() holds as many datagrams as fit
+ * and is split by the kernel (UDP_SEGMENT), and echoes that the kernel
+ * coalesced (UDP_GRO) are split again here.
+ *
+ * Over shared memory (see shm_ring.h) every thread claims a lane of the
+ * server's region and drives it as its only connection: queued requests are
+ * copied into the request ring and echoes are counted straight out of the
+ * response ring. A thread with nothing to do spins and then sleeps on the
+ * lane's doorbell until the server answers or the next send is due.
+ *
+ * Every round trip is recorded into a per-thread latency histogram, and the
+ * histograms are merged once the threads are done so that recording never
+ * needs any synchronization. The same goes for the TCP_INFO samples (see
+ * tcp_stats.h) that TCP threads take of their connections every so often,
+ * between events, so that a load test shows how the transport fared too.
+ */
+
+#define _GNU_SOURCE
+
+#include "client_load.h"
+
+#include <errno.h>
+#include <netinet/udp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "histogram.h"
+#include "protocol.h"
+#include "shm_ring.h"
+#include "tcp_stats.h"
+
+#define LOAD_MAX_EVENTS 256
+#define LOAD_RX_BUFFER_LEN LOAD_MAX_RECORD_LEN
+#define NSEC_PER_SEC 1000000000ull
+#define NSEC_PER_MSEC 1000000ull
+#define NSEC_PER_USEC 1000ull
+#define LOAD_HISTOGRAM_MAX_NS (3600 * NSEC_PER_SEC)
+#define LOAD_INITIAL_OUTSTANDING 16
+#define LOAD_REQUEST_DONE UINT64_MAX
+// sequence number and intended send time at the start of every datagram
+#define LOAD_UDP_HEADER_LEN 12
+#define LOAD_UDP_TIMEOUT_NS (100 * NSEC_PER_MSEC)
+#define LOAD_UDP_DRAIN_NS (100 * NSEC_PER_MSEC)
+// the kernel splits a buffer into at most this many datagrams
+#define LOAD_UDP_MAX_SEGMENTS 64
+// a coalesced echo is at most as large as the largest datagram
+#define LOAD_UDP_GRO_BUFFER_LEN 65536
+#define LOAD_UDP_CONTROL_LEN CMSG_SPACE(sizeof(int))
+
+enum load_state {
+  LOAD_CLOSED,
+  LOAD_CONNECTING,
+  LOAD_CONNECTED,
+};
+
+/**
+ * @brief one connection of the load test
+ *
+ * issued requests are appended to a growable transmit buffer, so however many
+ * are due they leave in as few sends as the socket allows. the intended start
+ * time of every request that has not been answered yet is kept in a growable
+ * ring, oldest first. request ids are handed out in order, so the slot of a
+ * request is its id minus the id of the oldest outstanding request. without
+ * framing the echoed bytes complete requests strictly in order.
+ */
+struct load_connection {
+  int sockfd;
+  enum load_state state;
+  uint32_t events;
+
+  char* tx_buffer;
+  size_t tx_cap;
+  size_t tx_start;
+  size_t tx_end;
+
+  // receive progress: bytes of the oldest echo without framing, or the
+  // header and payload of the current response frame with framing
+  size_t rx_offset;
+  char rx_header[FRAME_HEADER_LEN];
+  size_t rx_header_len;
+  uint32_t rx_request_id;
+
+  uint32_t next_request_id;
+  uint32_t oldest_request_id;
+  uint64_t* outstanding;
+  size_t outstanding_cap;
+  size_t outstanding_head;
+  size_t outstanding_len;
+  uint64_t next_send_ns;
+  int heap_index;
+
+  // udp only: the highest sequence number echoed so far and when the last
+  // echo arrived
+  uint32_t highest_echoed_id;
+  bool echoed_any;
+  uint64_t last_echo_ns;
+
+  // retransmitted segments as of the last TCP_INFO sample
+  uint32_t total_retrans;
+};
+
+/**
+ * @brief what a shared memory thread checks while it waits
+ */
+struct load_shm_wait {
+  struct load_connection* conn;
+  struct shm_lane* lane;
+  uint64_t wake_ns;
+};
+
+/**
+ * @brief headers and buffers for one batch of datagrams
+ */
+struct load_udp_batch {
+  struct mmsghdr* msgs;
+  struct iovec* iovs;
+  char* buffers;
+  size_t buffer_len;
+  char* controls;
+};
+
+struct load_thread {
+  const struct load_config* config;
+  pthread_t thread;
+  int ret;
+
+  // the connections owned by this thread and their index in the timetable
+  int first_connection;
+  int num_connections;
+  struct load_connection* connections;
+
+  // idle connections ordered by their next send time
+  struct load_connection** heap;
+  int heap_len;
+
+  int epollfd;
+  uint64_t start_ns;
+  uint64_t end_ns;
+  uint64_t interval_ns;
+  char rx_buffer[LOAD_RX_BUFFER_LEN];
+
+  // udp only: every datagram of the test has the same length, and with gso
+  // several of them share a buffer
+  size_t datagram_len;
+  int datagrams_per_buffer;
+  struct load_udp_batch udp_tx;
+  struct load_udp_batch udp_rx;
+
+  // results
+  uint64_t requests;
+  uint64_t bytes_sent;
+  uint64_t bytes_received;
+  uint64_t errors;
+  uint64_t unfinished;
+  uint64_t datagrams_sent;
+  uint64_t datagrams_echoed;
+  uint64_t datagrams_reordered;
+  uint64_t datagrams_refused;
+  struct histogram latency;
+  // only set up with tcp_info_interval_ms
+  struct tcp_stats tcp_stats;
+  uint64_t next_tcp_info_ns;
+};
+
+static uint64_t now_ns(void);
+static void* load_thread_main(void* arg);
+static int load_connect(
+    struct load_thread* thread, struct load_connection* conn);
+static void load_finish_connect(
+    struct load_thread* thread, struct load_connection* conn);
+static int load_issue_request(
+    struct load_thread* thread, struct load_connection* conn,
+    uint64_t intended_ns);
+static void load_send(struct load_thread* thread, struct load_connection* conn);
+static void load_recv(struct load_thread* thread, struct load_connection* conn);
+static void load_consume(
+    struct load_thread* thread, struct load_connection* conn, const char* data,
+    size_t len);
+static void load_complete_request(
+    struct load_thread* thread, struct load_connection* conn,
+    uint32_t request_id);
+static int load_append(
+    struct load_connection* conn, const char* data, size_t len);
+static void load_set_events(
+    struct load_thread* thread, struct load_connection* conn, uint32_t events);
+static void load_close(
+    struct load_thread* thread, struct load_connection* conn, bool failed);
+static void load_sample_tcp_info(struct load_thread* thread);
+static void* load_udp_thread_main(void* arg);
+static int load_udp_connect(
+    struct load_thread* thread, struct load_connection* conn);
+static void load_udp_send(
+    struct load_thread* thread, struct load_connection* conn, int count,
+    uint64_t intended_ns, uint64_t interval_ns);
+static void load_udp_recv(
+    struct load_thread* thread, struct load_connection* conn);
+static void load_udp_echoed(
+    struct load_thread* thread, struct load_connection* conn,
+    const char* datagram, size_t len, uint64_t now);
+static int load_udp_batch_init(
+    struct load_udp_batch* batch, int size, size_t buffer_len);
+static void load_udp_batch_destroy(struct load_udp_batch* batch);
+static void* load_shm_thread_main(void* arg);
+static bool load_shm_ready(void* arg);
+static void heap_push(struct load_thread* thread, struct load_connection* conn);
+static void heap_remove(
+    struct load_thread* thread, struct load_connection* conn);
+static struct load_connection* heap_pop(struct load_thread* thread);
+
+int run_load(const struct load_config* config) {
+  int ret = 0;
+
+  // every connection needs a descriptor, so ask for as many as allowed
+  struct rlimit limit;
+  if (0 == getrlimit(RLIMIT_NOFILE, &limit)) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  struct histogram latency;
+  if (0 != histogram_init(&latency, LOAD_HISTOGRAM_MAX_NS)) {
+    fprintf(stderr, "ERROR: failed to allocate latency histogram\n");
+    ret = 1;
+    goto out;
+  }
+  struct tcp_stats tcp_stats = {0};
+  if ((config->tcp_info_interval_ms > 0) &&
+      (0 != tcp_stats_init(&tcp_stats))) {
+    fprintf(stderr, "ERROR: failed to allocate TCP_INFO histograms\n");
+    histogram_destroy(&latency);
+    ret = 1;
+    goto out;
+  }
+
+  int num_initialized = 0;
+  struct load_thread* threads =
+      calloc(config->num_threads, sizeof(struct load_thread));
+  if (NULL == threads) {
+    fprintf(stderr, "ERROR: failed to allocate load threads\n");
+    ret = 1;
+    goto cleanup;
+  }
+  for (; num_initialized < config->num_threads; num_initialized++) {
+    if (0 != histogram_init(
+                 &threads[num_initialized].latency, LOAD_HISTOGRAM_MAX_NS)) {
+      fprintf(stderr, "ERROR: failed to allocate latency histogram\n");
+      ret = 1;
+      goto cleanup;
+    }
+    if ((config->tcp_info_interval_ms > 0) &&
+        (0 != tcp_stats_init(&threads[num_initialized].tcp_stats))) {
+      fprintf(stderr, "ERROR: failed to allocate TCP_INFO histograms\n");
+      histogram_destroy(&threads[num_initialized].latency);
+      ret = 1;
+      goto cleanup;
+    }
+  }
+
+  // split the connections as evenly as possible between the threads and
+  // start them all against a common clock
+  uint64_t start_ns = now_ns();
+  int first_connection = 0;
+  for (int idx = 0; idx < config->num_threads; idx++) {
+    struct load_thread* thread = &threads[idx];
+    thread->config = config;
+    thread->first_connection = first_connection;
+    thread->num_connections = config->num_connections / config->num_threads;
+    if (idx < (config->num_connections % config->num_threads)) {
+      thread->num_connections++;
+    }
+    first_connection += thread->num_connections;
+    thread->start_ns = start_ns;
+    thread->end_ns = start_ns + (uint64_t)(config->duration_s * NSEC_PER_SEC);
+  }
+
+  void* (*thread_main)(void*) = load_thread_main;
+  if (config->udp) {
+    thread_main = load_udp_thread_main;
+  } else if (NULL != config->shm_name) {
+    thread_main = load_shm_thread_main;
+  }
+  int num_running = 0;
+  for (; num_running < config->num_threads; num_running++) {
+    struct load_thread* thread = &threads[num_running];
+    if (0 != pthread_create(&thread->thread, NULL, thread_main, thread)) {
+      fprintf(stderr, "ERROR: failed to start load thread %d\n", num_running);
+      ret = 1;
+      break;
+    }
+  }
+
+  // collect the results
+  uint64_t requests = 0;
+  uint64_t bytes_sent = 0;
+  uint64_t bytes_received = 0;
+  uint64_t errors = 0;
+  uint64_t unfinished = 0;
+  uint64_t datagrams_sent = 0;
+  uint64_t datagrams_echoed = 0;
+  uint64_t datagrams_reordered = 0;
+  uint64_t datagrams_refused = 0;
+  for (int idx = 0; idx < num_running; idx++) {
+    struct load_thread* thread = &threads[idx];
+    pthread_join(thread->thread, NULL);
+    if (0 != thread->ret) {
+      ret = 1;
+    }
+    requests += thread->requests;
+    bytes_sent += thread->bytes_sent;
+    bytes_received += thread->bytes_received;
+    errors += thread->errors;
+    unfinished += thread->unfinished;
+    datagrams_sent += thread->datagrams_sent;
+    datagrams_echoed += thread->datagrams_echoed;
+    datagrams_reordered += thread->datagrams_reordered;
+    datagrams_refused += thread->datagrams_refused;
+    histogram_merge(&latency, &thread->latency);
+    if (config->tcp_info_interval_ms > 0) {
+      tcp_stats_merge(&tcp_stats, &thread->tcp_stats);
+    }
+  }
+  double elapsed_s = (double)(now_ns() - start_ns) / NSEC_PER_SEC;
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  double user_s = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+  double system_s = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+
+  printf(
+      "%d connection(s) on %d thread(s) for %.2f s, %s\n",
+      config->num_connections, config->num_threads, elapsed_s,
+      (config->rate > 0) ? "open-loop" : "closed-loop");
+  printf(
+      "requests: %lu (%.1f requests/sec)\n", (unsigned long)requests,
+      requests / elapsed_s);
+  printf(
+      "sent: %lu bytes (%.3f MB/sec)\n", (unsigned long)bytes_sent,
+      bytes_sent / elapsed_s / 1e6);
+  printf(
+      "received: %lu bytes (%.3f MB/sec)\n", (unsigned long)bytes_received,
+      bytes_received / elapsed_s / 1e6);
+  printf(
+      "cpu: %.3f s user, %.3f s system (%.1f%% of one core)\n", user_s,
+      system_s, 100.0 * (user_s + system_s) / elapsed_s);
+  printf("errors: %lu\n", (unsigned long)errors);
+  printf("unfinished at end: %lu\n", (unsigned long)unfinished);
+  if (config->udp) {
+    printf(
+        "datagrams: %lu sent, %lu refused by a full socket\n",
+        (unsigned long)datagrams_sent, (unsigned long)datagrams_refused);
+  }
+  if (config->udp && !config->sink) {
+    uint64_t lost = (datagrams_sent > datagrams_echoed)
+                        ? datagrams_sent - datagrams_echoed
+                        : 0;
+    printf(
+        "echoes: %lu lost (%.3f%%), %lu reordered\n", (unsigned long)lost,
+        (datagrams_sent > 0) ? 100.0 * lost / datagrams_sent : 0.0,
+        (unsigned long)datagrams_reordered);
+  }
+  histogram_print_percentiles(
+      &latency, stdout, "latency", NSEC_PER_USEC, "us");
+  tcp_stats_print(&tcp_stats, stdout, "tcp_info");
+
+  if (NULL != config->histogram_path) {
+    FILE* file = fopen(config->histogram_path, "w");
+    if ((NULL == file) ||
+        (0 != histogram_write_distribution(&latency, file, NSEC_PER_USEC))) {
+      fprintf(
+          stderr, "ERROR: failed to write histogram to %s\n",
+          config->histogram_path);
+      ret = 1;
+    }
+    if (NULL != file) {
+      fclose(file);
+    }
+  }
+
+cleanup:
+  if (NULL != threads) {
+    for (int idx = 0; idx < num_initialized; idx++) {
+      histogram_destroy(&threads[idx].latency);
+      tcp_stats_destroy(&threads[idx].tcp_stats);
+    }
+    free(threads);
+  }
+  tcp_stats_destroy(&tcp_stats);
+  histogram_destroy(&latency);
+
+out:
+  return ret;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * @brief runs the event loop of one load thread until the test is over
+ *
+ * @param arg the struct load_thread to run
+ * @return void* always NULL
+ */
+static void* load_thread_main(void* arg) {
+  struct load_thread* thread = arg;
+  const struct load_config* config = thread->config;
+  struct epoll_event events[LOAD_MAX_EVENTS];
+
+  thread->epollfd = -1;
+  thread->connections =
+      calloc(thread->num_connections, sizeof(struct load_connection));
+  thread->heap =
+      calloc(thread->num_connections, sizeof(struct load_connection*));
+  if ((NULL == thread->connections) || (NULL == thread->heap)) {
+    fprintf(stderr, "ERROR: failed to allocate connection state\n");
+    thread->ret = 1;
+    goto cleanup;
+  }
+
+  thread->epollfd = epoll_create1(0);
+  if (thread->epollfd < 0) {
+    fprintf(stderr, "ERROR creating epoll instance\n");
+    thread->ret = 1;
+    goto cleanup;
+  }
+
+  // with a rate every connection sends once per interval, and the
+  // connections are staggered so that together they send evenly. the
+  // timetable starts right away, connecting counts towards the latency of
+  // the first requests
+  if (config->rate > 0) {
+    thread->interval_ns =
+        (uint64_t)(config->num_connections * (NSEC_PER_SEC / config->rate));
+  }
+
+  for (int idx = 0; idx < thread->num_connections; idx++) {
+    struct load_connection* conn = &thread->connections[idx];
+    conn->heap_index = -1;
+    if (0 != load_connect(thread, conn)) {
+      thread->errors++;
+      continue;
+    }
+    if (config->rate > 0) {
+      conn->next_send_ns =
+          thread->start_ns + (uint64_t)((thread->first_connection + idx) *
+                                        (NSEC_PER_SEC / config->rate));
+      heap_push(thread, conn);
+    }
+  }
+
+  uint64_t tcp_info_interval_ns =
+      (uint64_t)config->tcp_info_interval_ms * NSEC_PER_MSEC;
+  thread->next_tcp_info_ns = thread->start_ns + tcp_info_interval_ns;
+  for (;;) {
+    // the connections are sampled once more at the end, so that a test
+    // shorter than the sampling period still has samples
+    uint64_t now = now_ns();
+    if (now >= thread->end_ns) {
+      if (tcp_info_interval_ns > 0) {
+        load_sample_tcp_info(thread);
+      }
+      break;
+    }
+    if ((tcp_info_interval_ns > 0) && (now >= thread->next_tcp_info_ns)) {
+      load_sample_tcp_info(thread);
+      thread->next_tcp_info_ns = now + tcp_info_interval_ns;
+    }
+
+    // issue every request that is due and book the next slot of its
+    // connection
+    while ((thread->heap_len > 0) && (thread->heap[0]->next_send_ns <= now)) {
+      struct load_connection* conn = heap_pop(thread);
+      uint64_t intended_ns = conn->next_send_ns;
+      conn->next_send_ns += thread->interval_ns;
+      heap_push(thread, conn);
+      if ((0 == load_issue_request(thread, conn, intended_ns)) &&
+          (LOAD_CONNECTED == conn->state)) {
+        load_send(thread, conn);
+      }
+    }
+
+    // sleep until the next scheduled send or the end of the test, whichever
+    // comes first. waits shorter than the epoll resolution turn into polls
+    uint64_t wake_ns = thread->end_ns;
+    if ((thread->heap_len > 0) && (thread->heap[0]->next_send_ns < wake_ns)) {
+      wake_ns = thread->heap[0]->next_send_ns;
+    }
+    if ((tcp_info_interval_ns > 0) && (thread->next_tcp_info_ns < wake_ns)) {
+      wake_ns = thread->next_tcp_info_ns;
+    }
+    int timeout_ms = (wake_ns > now) ? (wake_ns - now) / NSEC_PER_MSEC : 0;
+
+    int ready =
+        epoll_wait(thread->epollfd, events, LOAD_MAX_EVENTS, timeout_ms);
+    if (ready < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      fprintf(stderr, "ERROR waiting for epoll events\n");
+      thread->ret = 1;
+      goto cleanup;
+    }
+
+    for (int idx = 0; idx < ready; idx++) {
+      struct load_connection* conn = events[idx].data.ptr;
+      uint32_t flags = events[idx].events;
+
+      if (LOAD_CONNECTING == conn->state) {
+        load_finish_connect(thread, conn);
+        continue;
+      }
+      if (flags & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        load_recv(thread, conn);
+      }
+      if ((flags & EPOLLOUT) && (LOAD_CONNECTED == conn->state)) {
+        load_send(thread, conn);
+      }
+    }
+  }
+
+cleanup:
+  if (NULL != thread->connections) {
+    for (int idx = 0; idx < thread->num_connections; idx++) {
+      struct load_connection* conn = &thread->connections[idx];
+      if (LOAD_CLOSED != conn->state) {
+        thread->unfinished += conn->outstanding_len;
+        close(conn->sockfd);
+      }
+      free(conn->outstanding);
+      free(conn->tx_buffer);
+    }
+  }
+  if (thread->epollfd >= 0) {
+    close(thread->epollfd);
+  }
+  free(thread->heap);
+  free(thread->connections);
+  return NULL;
+}
+
+/**
+ * @brief starts a non-blocking connect to the server
+ *
+ * @param thread the thread that owns the connection
+ * @param conn the connection
+ * @return int nonzero if the connection could not be started
+ */
+static int load_connect(
+    struct load_thread* thread, struct load_connection* conn) {
+  int ret = 0;
+
+  conn->state = LOAD_CLOSED;
+  const struct load_config* config = thread->config;
+  conn->sockfd = socket(
+      config->server_addr.ss_family, config->socket_type | SOCK_NONBLOCK, 0);
+  if (conn->sockfd < 0) {
+    fprintf(stderr, "ERROR creating socket\n");
+    ret = 1;
+    goto out;
+  }
+
+  // a unix domain socket connects right away (or fails with EAGAIN when the
+  // backlog is full), either way the outcome is checked once it is writable
+  ret = connect(
+      conn->sockfd, (const struct sockaddr*)&config->server_addr,
+      config->server_addr_len);
+  if ((0 != ret) && (EINPROGRESS != errno)) {
+    fprintf(stderr, "ERROR connecting to server\n");
+    close(conn->sockfd);
+    ret = 1;
+    goto out;
+  }
+  ret = 0;
+
+  // the connection is writable once the handshake is done
+  conn->state = LOAD_CONNECTING;
+  conn->events = EPOLLOUT;
+  struct epoll_event event = {.events = conn->events, .data.ptr = conn};
+  if (0 != epoll_ctl(thread->epollfd, EPOLL_CTL_ADD, conn->sockfd, &event)) {
+    fprintf(stderr, "ERROR: failed to add the connection to epoll\n");
+    close(conn->sockfd);
+    conn->state = LOAD_CLOSED;
+    ret = 1;
+    goto out;
+  }
+
+out:
+  return ret;
+}
+
+/**
+ * @brief checks the outcome of a connect and schedules the first request
+ *
+ * @param thread the thread that owns the connection
+ * @param conn the connection
+ */
+static void load_finish_connect(
+    struct load_thread* thread, struct load_connection* conn) {
+  int error = 0;
+  socklen_t error_len = sizeof(error);
+  if ((0 != getsockopt(conn->sockfd, SOL_SOCKET, SO_ERROR, &error, &error_len))
+      || (0 != error)) {
+    fprintf(stderr, "ERROR connecting to server (%d)\n", error);
+    load_close(thread, conn, true);
+    return;
+  }
+  if ((NULL != thread->config->tls) &&
+      (0 != tls_handshake(thread->config->tls, conn->sockfd))) {
+    load_close(thread, conn, true);
+    return;
+  }
+
+  // requests may already be waiting for the connection in open-loop mode,
+  // in closed-loop mode the first pipeline's worth of requests goes out now
+  conn->state = LOAD_CONNECTED;
+  if (0 == thread->interval_ns) {
+    uint64_t now = now_ns();
+    for (int idx = 0; idx < thread->config->pipeline_depth; idx++) {
+      if (0 != load_issue_request(thread, conn, now)) {
+        return;
+      }
+    }
+  }
+  load_send(thread, conn);
+}
+
+/**
+ * @brief queues one more request on a connection
+ *
+ * the request is only added to the transmit buffer, callers send once they
+ * have queued everything that is due.
+ *
+ * @param thread the thread that owns the connection
+ * @param conn the connection
+ * @param intended_ns when the request should be considered sent
+ * @return int nonzero if the connection had to be closed
+ */
+static int load_issue_request(
+    struct load_thread* thread, struct load_connection* conn,
+    uint64_t intended_ns) {
+  int ret = 0;
+
+  // grow the ring of outstanding requests, keeping the oldest first
+  if (conn->outstanding_len == conn->outstanding_cap) {
+    size_t cap = (0 == conn->outstanding_cap) ? LOAD_INITIAL_OUTSTANDING
+                                              : 2 * conn->outstanding_cap;
+    uint64_t* outstanding = malloc(cap * sizeof(uint64_t));
+    if (NULL == outstanding) {
+      fprintf(stderr, "ERROR: failed to allocate outstanding requests\n");
+      load_close(thread, conn, true);
+      ret = 1;
+      goto out;
+    }
+    for (size_t idx = 0; idx < conn->outstanding_len; idx++) {
+      outstanding[idx] =
+          conn->outstanding[(conn->outstanding_head + idx) %
+                            conn->outstanding_cap];
+    }
+    free(conn->outstanding);
+    conn->outstanding = outstanding;
+    conn->outstanding_cap = cap;
+    conn->outstanding_head = 0;
+  }
+
+  // queue the bytes of the request
+  const struct load_config* config = thread->config;
+  if (config->framed) {
+    char header[FRAME_HEADER_LEN];
+    struct frame_header frame = {
+        .length = config->message_len,
+        .request_id = conn->next_request_id,
+    };
+    frame_header_encode(header, &frame);
+    if (0 != load_append(conn, header, FRAME_HEADER_LEN)) {
+      load_close(thread, conn, true);
+      ret = 1;
+      goto out;
+    }
+  }
+  if (0 != load_append(conn, config->message, config->message_len)) {
+    load_close(thread, conn, true);
+    ret = 1;
+    goto out;
+  }
+
+  conn->outstanding[(conn->outstanding_head + conn->outstanding_len) %
+                    conn->outstanding_cap] = intended_ns;
+  conn->outstanding_len++;
+  conn->next_request_id++;
+
+out:
+  return ret;
+}
+
+/**
+ * @brief sends as much of the queued requests as the socket will take
+ *
+ * @param thread the thread that owns the connection
+ * @param conn the connection
+ */
+static void load_send(
+    struct load_thread* thread, struct load_connection* conn) {
+  // a seqpacket send is a record of its own and is taken whole or not at all
+  size_t max_send_len = SIZE_MAX;
+  if (SOCK_SEQPACKET == thread->config->socket_type) {
+    max_send_len = thread->config->message_len;
+  }
+
+  for (;;) {
+    while (conn->tx_start < conn->tx_end) {
+      size_t send_len = conn->tx_end - conn->tx_start;
+      if (send_len > max_send_len) {
+        send_len = max_send_len;
+      }
+      ssize_t chars_sent = send(
+          conn->sockfd, conn->tx_buffer + conn->tx_start, send_len,
+          MSG_NOSIGNAL);
+      if (chars_sent < 0) {
+        if (EINTR == errno) {
+          continue;
+        }
+        if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+          break;
+        }
+        load_close(thread, conn, true);
+        return;
+      }
+      conn->tx_start += chars_sent;
+      thread->bytes_sent += chars_sent;
+    }
+    if (conn->tx_start != conn->tx_end) {
+      break;
+    }
+    conn->tx_start = 0;
+    conn->tx_end = 0;
+
+    // against a sink every sent request is complete. in closed-loop mode
+    // completing them queues the next ones, which go out right away
+    if (!thread->config->sink || (0 == conn->outstanding_len) ||
+        (now_ns() >= thread->end_ns)) {
+      break;
+    }
+    size_t sent_requests = conn->outstanding_len;
+    for (size_t idx = 0; idx < sent_requests; idx++) {
+      load_complete_request(thread, conn, conn->oldest_request_id);
+      if (LOAD_CLOSED == conn->state) {
+        return;
+      }
+    }
+  }
+
+  load_set_events(
+      thread, conn,
+      (conn->tx_end > conn->tx_start) ? (EPOLLIN | EPOLLOUT) : EPOLLIN);
+}
+
+/**
+ * @brief appends bytes to the transmit buffer of a connection
+ *
+ * @param conn the connection
+ * @param data the bytes
+ * @param len the number of bytes
+ * @return int nonzero if the buffer could not grow
+ */
+static int load_append(
+    struct load_connection* conn, const char* data, size_t len) {
+  int ret = 0;
+
+  if ((conn->tx_end + len) > conn->tx_cap) {
+    // reuse the space of bytes that were already sent before growing
+    size_t pending = conn->tx_end - conn->tx_start;
+    if ((conn->tx_start > 0) && (pending > 0)) {
+      memmove(conn->tx_buffer, conn->tx_buffer + conn->tx_start, pending);
+    }
+    conn->tx_start = 0;
+    conn->tx_end = pending;
+
+    if ((pending + len) > conn->tx_cap) {
+      size_t cap = 2 * conn->tx_cap;
+      if (cap < (pending + len)) {
+        cap = pending + len;
+      }
+      char* tx_buffer = realloc(conn->tx_buffer, cap);
+      if (NULL == tx_buffer) {
+        fprintf(stderr, "ERROR: failed to grow the transmit buffer\n");
+        ret = 1;
+        goto out;
+      }
+      conn->tx_buffer = tx_buffer;
+      conn->tx_cap = cap;
+    }
+  }
+
+  memcpy(conn->tx_buffer + conn->tx_end, data, len);
+  conn->tx_end += len;
+
+out:
+  return ret;
+}
+
+/**
+ * @brief receives echoed bytes and completes every request that is now fully
+ * echoed
+ *
+ * @param thread the thread that owns the connection
+ * @param conn the connection
+ */
+static void load_recv(
+    struct load_thread* thread, struct load_connection* conn) {
+  ssize_t chars_received =
+      recv(conn->sockfd, thread->rx_buffer, LOAD_RX_BUFFER_LEN, 0);
+  if (0 == chars_received) {
+    load_close(thread, conn, true);
+    return;
+  } else if (chars_received < 0) {
+    if ((EAGAIN != errno) && (EWOULDBLOCK != errno) && (EINTR != errno)) {
+      load_close(thread, conn, true);
+    }
+    return;
+  }
+  thread->bytes_received += chars_received;
+  load_consume(thread, conn, thread->rx_buffer, chars_received);
+  if (LOAD_CLOSED == conn->state) {
+    return;
+  }
+
+  // requests that replaced the answered ones leave together
+  if (conn->tx_end > conn->tx_start) {
+    load_send(thread, conn);
+  }
+}
+
+/**
+ * @brief completes every request that the echoed bytes finish
+ *
+ * @param thread the thread that owns the connection
+ * @param conn the connection
+ * @param data the echoed bytes
+ * @param len the number of bytes
+ */
+static void load_consume(
+    struct load_thread* thread, struct load_connection* conn, const char* data,
+    size_t len) {
+  size_t message_len = thread->config->message_len;
+
+  size_t remaining = len;
+  while (remaining > 0) {
+    // anything beyond the outstanding requests means the server is not echoing
+    if (0 == conn->outstanding_len) {
+      load_close(thread, conn, true);
+      return;
+    }
+
+    if (!thread->config->framed) {
+      size_t chunk = message_len - conn->rx_offset;
+      if (chunk > remaining) {
+        chunk = remaining;
+      }
+      conn->rx_offset += chunk;
+      remaining -= chunk;
+      if (message_len == conn->rx_offset) {
+        conn->rx_offset = 0;
+        load_complete_request(thread, conn, conn->oldest_request_id);
+        if (LOAD_CLOSED == conn->state) {
+          return;
+        }
+      }
+      continue;
+    }
+
+    // collect the response header, which may be split across receives
+    if (conn->rx_header_len < FRAME_HEADER_LEN) {
+      size_t chunk = FRAME_HEADER_LEN - conn->rx_header_len;
+      if (chunk > remaining) {
+        chunk = remaining;
+      }
+      memcpy(conn->rx_header + conn->rx_header_len, data, chunk);
+      conn->rx_header_len += chunk;
+      data += chunk;
+      remaining -= chunk;
+      if (conn->rx_header_len < FRAME_HEADER_LEN) {
+        break;
+      }
+
+      struct frame_header header;
+      frame_header_decode(conn->rx_header, &header);
+      if (header.length != message_len) {
+        load_close(thread, conn, true);
+        return;
+      }
+      conn->rx_request_id = header.request_id;
+      conn->rx_offset = 0;
+    }
+
+    // skip over the payload, only its end matters
+    size_t chunk = message_len - conn->rx_offset;
+    if (chunk > remaining) {
+      chunk = remaining;
+    }
+    conn->rx_offset += chunk;
+    data += chunk;
+    remaining -= chunk;
+    if (message_len == conn->rx_offset) {
+      conn->rx_header_len = 0;
+      conn->rx_offset = 0;
+      load_complete_request(thread, conn, conn->rx_request_id);
+      if (LOAD_CLOSED == conn->state) {
+        return;
+      }
+    }
+  }
+}
+
+/**
+ * @brief records an outstanding request as complete
+ *
+ * the oldest requests are retired once they are complete, and in closed-loop
+ * mode the next request is queued right away to keep the pipeline full.
+ *
+ * @param thread the thread that owns the connection
+ * @param conn the connection
+ * @param request_id the id of the answered request
+ */
+static void load_complete_request(
+    struct load_thread* thread, struct load_connection* conn,
+    uint32_t request_id) {
+  uint64_t now = now_ns();
+
+  // ids wrap around together with the oldest id, so the difference is the
+  // slot in the ring
+  uint32_t slot = request_id - conn->oldest_request_id;
+  if (slot >= conn->outstanding_len) {
+    load_close(thread, conn, true);
+    return;
+  }
+  size_t idx = (conn->outstanding_head + slot) % conn->outstanding_cap;
+  if (LOAD_REQUEST_DONE == conn->outstanding[idx]) {
+    load_close(thread, conn, true);
+    return;
+  }
+
+  if (now < thread->end_ns) {
+    thread->requests++;
+    histogram_record(&thread->latency, now - conn->outstanding[idx]);
+  }
+  conn->outstanding[idx] = LOAD_REQUEST_DONE;
+
+  while ((conn->outstanding_len > 0) &&
+         (LOAD_REQUEST_DONE == conn->outstanding[conn->outstanding_head])) {
+    conn->outstanding_head =
+        (conn->outstanding_head + 1) % conn->outstanding_cap;
+    conn->outstanding_len--;
+    conn->oldest_request_id++;
+  }
+
+  if (0 == thread->interval_ns) {
+    load_issue_request(thread, conn, now);
+  }
+}
+
+static void load_set_events(
+    struct load_thread* thread, struct load_connection* conn,
+    uint32_t events) {
+  if (events == conn->events) {
+    return;
+  }
+  struct epoll_event event = {.events = events, .data.ptr = conn};
+  if (0 != epoll_ctl(thread->epollfd, EPOLL_CTL_MOD, conn->sockfd, &event)) {
+    load_close(thread, conn, true);
+    return;
+  }
+  conn->events = events;
+}
+
+/**
+ * @brief closes a connection for the rest of the test
+ *
+ * @param thread the thread that owns the connection
+ * @param conn the connection
+ * @param failed whether to count this as an error
+ */
+static void load_close(
+    struct load_thread* thread, struct load_connection* conn, bool failed) {
+  if (LOAD_CLOSED == conn->state) {
+    return;
+  }
+  if (failed) {
+    thread->errors++;
+  }
+  if (conn->heap_index >= 0) {
+    heap_remove(thread, conn);
+  }
+  conn->state = LOAD_CLOSED;
+  // a shared memory connection has no socket
+  if (conn->sockfd >= 0) {
+    epoll_ctl(thread->epollfd, EPOLL_CTL_DEL, conn->sockfd, NULL);
+    close(conn->sockfd);
+  }
+}
+
+/**
+ * @brief samples TCP_INFO of every connected connection of a thread
+ *
+ * @param thread the thread
+ */
+static void load_sample_tcp_info(struct load_thread* thread) {
+  for (int idx = 0; idx < thread->num_connections; idx++) {
+    struct load_connection* conn = &thread->connections[idx];
+    if (LOAD_CONNECTED == conn->state) {
+      tcp_stats_sample(
+          &thread->tcp_stats, conn->sockfd, &conn->total_retrans);
+    }
+  }
+}
+
+/**
+ * @brief runs the event loop of one UDP load thread until the test is over
+ *
+ * sending stops at the end of the test, but echoes are still collected for a
+ * short while so that late ones are not counted as lost.
+ *
+ * @param arg the struct load_thread to run
+ * @return void* always NULL
+ */
+static void* load_udp_thread_main(void* arg) {
+  struct load_thread* thread = arg;
+  const struct load_config* config = thread->config;
+  struct epoll_event events[LOAD_MAX_EVENTS];
+
+  thread->epollfd = -1;
+  thread->datagram_len = config->message_len;
+  if (thread->datagram_len < LOAD_UDP_HEADER_LEN) {
+    thread->datagram_len = LOAD_UDP_HEADER_LEN;
+  }
+  thread->datagrams_per_buffer = 1;
+  size_t rx_buffer_len = thread->datagram_len;
+  if (config->gso) {
+    thread->datagrams_per_buffer =
+        LOAD_UDP_MAX_DATAGRAM_LEN / thread->datagram_len;
+    if (thread->datagrams_per_buffer > LOAD_UDP_MAX_SEGMENTS) {
+      thread->datagrams_per_buffer = LOAD_UDP_MAX_SEGMENTS;
+    }
+    rx_buffer_len = LOAD_UDP_GRO_BUFFER_LEN;
+  }
+  thread->connections =
+      calloc(thread->num_connections, sizeof(struct load_connection));
+  thread->heap =
+      calloc(thread->num_connections, sizeof(struct load_connection*));
+  if ((NULL == thread->connections) || (NULL == thread->heap) ||
+      (0 != load_udp_batch_init(
+                &thread->udp_tx, config->batch,
+                thread->datagrams_per_buffer * thread->datagram_len)) ||
+      (0 != load_udp_batch_init(
+                &thread->udp_rx, config->batch, rx_buffer_len))) {
+    fprintf(stderr, "ERROR: failed to allocate connection state\n");
+    thread->ret = 1;
+    goto cleanup;
+  }
+
+  // every datagram carries the message, only the header changes from one
+  // send to the next. with gso every buffer is cut into datagrams of the same
+  // size
+  for (int idx = 0; idx < config->batch; idx++) {
+    char* buffer = thread->udp_tx.iovs[idx].iov_base;
+    for (int seg = 0; seg < thread->datagrams_per_buffer; seg++) {
+      memcpy(
+          buffer + seg * thread->datagram_len, config->message,
+          config->message_len);
+    }
+    if (config->gso) {
+      struct msghdr* msg = &thread->udp_tx.msgs[idx].msg_hdr;
+      uint16_t segment_size = thread->datagram_len;
+      msg->msg_control = thread->udp_tx.controls + idx * LOAD_UDP_CONTROL_LEN;
+      msg->msg_controllen = CMSG_SPACE(sizeof(segment_size));
+      struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(segment_size));
+      memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+    }
+  }
+
+  thread->epollfd = epoll_create1(0);
+  if (thread->epollfd < 0) {
+    fprintf(stderr, "ERROR creating epoll instance\n");
+    thread->ret = 1;
+    goto cleanup;
+  }
+
+  if (config->rate > 0) {
+    thread->interval_ns =
+        (uint64_t)(config->num_connections * (NSEC_PER_SEC / config->rate));
+  }
+
+  for (int idx = 0; idx < thread->num_connections; idx++) {
+    struct load_connection* conn = &thread->connections[idx];
+    conn->heap_index = -1;
+    if (0 != load_udp_connect(thread, conn)) {
+      thread->errors++;
+      continue;
+    }
+    if (config->rate > 0) {
+      conn->next_send_ns =
+          thread->start_ns + (uint64_t)((thread->first_connection + idx) *
+                                        (NSEC_PER_SEC / config->rate));
+      heap_push(thread, conn);
+    } else if (!config->sink) {
+      load_udp_send(thread, conn, config->pipeline_depth, now_ns(), 0);
+    }
+  }
+
+  uint64_t drain_end_ns = thread->end_ns + LOAD_UDP_DRAIN_NS;
+  uint64_t next_timeout_check_ns = thread->start_ns + LOAD_UDP_TIMEOUT_NS;
+  for (;;) {
+    uint64_t now = now_ns();
+    bool sending = now < thread->end_ns;
+    if (!sending) {
+      bool in_flight = false;
+      for (int idx = 0; idx < thread->num_connections; idx++) {
+        struct load_connection* conn = &thread->connections[idx];
+        if ((LOAD_CONNECTED == conn->state) && (conn->outstanding_len > 0)) {
+          in_flight = true;
+          break;
+        }
+      }
+      if (!in_flight || (now >= drain_end_ns)) {
+        break;
+      }
+    }
+
+    // send every datagram that is due, each connection's due datagrams in
+    // batches
+    while (sending && (thread->heap_len > 0) &&
+           (thread->heap[0]->next_send_ns <= now)) {
+      struct load_connection* conn = heap_pop(thread);
+      uint64_t intended_ns = conn->next_send_ns;
+      int count = 0;
+      while ((count < config->batch) && (conn->next_send_ns <= now)) {
+        conn->next_send_ns += thread->interval_ns;
+        count++;
+      }
+      heap_push(thread, conn);
+      load_udp_send(thread, conn, count, intended_ns, thread->interval_ns);
+    }
+
+    // in closed-loop mode a connection whose echoes stopped coming back
+    // writes off its window and sends a new one
+    if (sending && (0 == thread->interval_ns) && !config->sink &&
+        (now >= next_timeout_check_ns)) {
+      for (int idx = 0; idx < thread->num_connections; idx++) {
+        struct load_connection* conn = &thread->connections[idx];
+        if ((LOAD_CONNECTED == conn->state) &&
+            ((now - conn->last_echo_ns) >= LOAD_UDP_TIMEOUT_NS)) {
+          conn->outstanding_len = 0;
+          conn->last_echo_ns = now;
+          load_udp_send(thread, conn, config->pipeline_depth, now, 0);
+        }
+      }
+      next_timeout_check_ns = now + LOAD_UDP_TIMEOUT_NS / 4;
+    }
+
+    uint64_t wake_ns = sending ? thread->end_ns : drain_end_ns;
+    if ((thread->heap_len > 0) && (thread->heap[0]->next_send_ns < wake_ns)) {
+      wake_ns = thread->heap[0]->next_send_ns;
+    }
+    if ((0 == thread->interval_ns) && (next_timeout_check_ns < wake_ns)) {
+      wake_ns = next_timeout_check_ns;
+    }
+    int timeout_ms = (wake_ns > now) ? (wake_ns - now) / NSEC_PER_MSEC : 0;
+
+    int ready =
+        epoll_wait(thread->epollfd, events, LOAD_MAX_EVENTS, timeout_ms);
+    if (ready < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      fprintf(stderr, "ERROR waiting for epoll events\n");
+      thread->ret = 1;
+      goto cleanup;
+    }
+
+    for (int idx = 0; idx < ready; idx++) {
+      struct load_connection* conn = events[idx].data.ptr;
+      uint32_t flags = events[idx].events;
+
+      if (flags & (EPOLLIN | EPOLLERR)) {
+        load_udp_recv(thread, conn);
+      }
+      // a closed-loop connection to a sink sends whenever the socket has room
+      if ((flags & EPOLLOUT) && (LOAD_CONNECTED == conn->state) && sending) {
+        load_udp_send(thread, conn, config->batch, now_ns(), 0);
+      }
+    }
+  }
+
+cleanup:
+  if (NULL != thread->connections) {
+    for (int idx = 0; idx < thread->num_connections; idx++) {
+      load_close(thread, &thread->connections[idx], false);
+    }
+  }
+  if (thread->epollfd >= 0) {
+    close(thread->epollfd);
+  }
+  load_udp_batch_destroy(&thread->udp_tx);
+  load_udp_batch_destroy(&thread->udp_rx);
+  free(thread->heap);
+  free(thread->connections);
+  return NULL;
+}
+
+/**
+ * @brief opens a UDP socket connected to the server
+ *
+ * connecting a UDP socket only fixes its peer, so the connection is ready
+ * right away. a closed-loop connection to a sink waits for room in the socket
+ * instead of for echoes.
+ *
+ * @param thread the thread that owns the connection
+ * @param conn the connection
+ * @return int nonzero if the socket could not be set up
+ */
+static int load_udp_connect(
+    struct load_thread* thread, struct load_connection* conn) {
+  int ret = 0;
+
+  conn->state = LOAD_CLOSED;
+  conn->sockfd = socket(
+      thread->config->server_addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (conn->sockfd < 0) {
+    fprintf(stderr, "ERROR creating socket\n");
+    ret = 1;
+    goto out;
+  }
+
+  ret = connect(
+      conn->sockfd, (const struct sockaddr*)&thread->config->server_addr,
+      thread->config->server_addr_len);
+  if (0 != ret) {
+    fprintf(stderr, "ERROR connecting to server\n");
+    close(conn->sockfd);
+    ret = 1;
+    goto out;
+  }
+  if (thread->config->gso) {
+    int on = 1;
+    if (0 != setsockopt(conn->sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on))) {
+      fprintf(stderr, "ERROR: failed to enable UDP_GRO (%d)\n", errno);
+      close(conn->sockfd);
+      ret = 1;
+      goto out;
+    }
+  }
+
+  conn->state = LOAD_CONNECTED;
+  conn->last_echo_ns = now_ns();
+  conn->events = EPOLLIN;
+  if (thread->config->sink && (thread->config->rate <= 0)) {
+    conn->events = EPOLLOUT;
+  }
+  struct epoll_event event = {.events = conn->events, .data.ptr = conn};
+  if (0 != epoll_ctl(thread->epollfd, EPOLL_CTL_ADD, conn->sockfd, &event)) {
+    fprintf(stderr, "ERROR: failed to add the connection to epoll\n");
+    close(conn->sockfd);
+    conn->state = LOAD_CLOSED;
+    ret = 1;
+    goto out;
+  }
+
+out:
+  return ret;
+}
+
+/**
+ * @brief sends datagrams in batches for as long as the socket takes them
+ *
+ * datagrams the socket refuses are not retried: in open-loop mode their slot
+ * has passed, in closed-loop mode the window is refilled by later echoes.
+ * against a sink every sent datagram is a complete request.
+ *
+ * @param thread the thread that owns the connection
+ * @param conn the connection
+ * @param count the number of datagrams to send
+ * @param intended_ns the intended send time of the first datagram
+ * @param interval_ns how much later each following datagram was meant to go
+ */
+static void load_udp_send(
+    struct load_thread* thread, struct load_connection* conn, int count,
+    uint64_t intended_ns, uint64_t interval_ns) {
+  const struct load_config* config = thread->config;
+  struct load_udp_batch* tx = &thread->udp_tx;
+  int per_buffer = thread->datagrams_per_buffer;
+
+  while ((count > 0) && (LOAD_CONNECTED == conn->state)) {
+    // fill the buffers, only the last one may hold fewer datagrams
+    int chunk = 0;
+    int num_buffers = 0;
+    while ((num_buffers < config->batch) && (chunk < count)) {
+      char* buffer = tx->iovs[num_buffers].iov_base;
+      int datagrams = count - chunk;
+      if (datagrams > per_buffer) {
+        datagrams = per_buffer;
+      }
+      for (int idx = 0; idx < datagrams; idx++) {
+        char* datagram = buffer + idx * thread->datagram_len;
+        uint32_t request_id = htonl(conn->next_request_id + chunk + idx);
+        uint64_t datagram_ns = intended_ns + (chunk + idx) * interval_ns;
+        memcpy(datagram, &request_id, sizeof(request_id));
+        memcpy(
+            datagram + sizeof(request_id), &datagram_ns, sizeof(datagram_ns));
+      }
+      tx->iovs[num_buffers].iov_len = datagrams * thread->datagram_len;
+      chunk += datagrams;
+      num_buffers++;
+    }
+
+    int sent_buffers;
+    do {
+      sent_buffers =
+          sendmmsg(conn->sockfd, tx->msgs, num_buffers, MSG_DONTWAIT);
+    } while ((sent_buffers < 0) && (EINTR == errno));
+    if (sent_buffers < 0) {
+      if ((EAGAIN == errno) || (EWOULDBLOCK == errno) || (ENOBUFS == errno)) {
+        break;
+      }
+      load_close(thread, conn, true);
+      return;
+    }
+    int sent = sent_buffers * per_buffer;
+    if (sent > chunk) {
+      sent = chunk;
+    }
+
+    thread->datagrams_sent += sent;
+    thread->bytes_sent += sent * thread->datagram_len;
+    conn->next_request_id += sent;
+    if (!config->sink) {
+      conn->outstanding_len += sent;
+    } else {
+      uint64_t now = now_ns();
+      for (int idx = 0; (idx < sent) && (now < thread->end_ns); idx++) {
+        thread->requests++;
+        histogram_record(
+            &thread->latency, now - (intended_ns + idx * interval_ns));
+      }
+    }
+    intended_ns += sent * interval_ns;
+    count -= sent;
+    if (sent < chunk) {
+      break;
+    }
+  }
+  thread->datagrams_refused += count;
+}
+
+/**
+ * @brief receives every waiting echo in batches
+ *
+ * a coalesced echo is split into its datagrams by the segment size the
+ * kernel reports. in closed-loop mode the window is then topped up in one go.
+ *
+ * @param thread the thread that owns the connection
+ * @param conn the connection
+ */
+static void load_udp_recv(
+    struct load_thread* thread, struct load_connection* conn) {
+  const struct load_config* config = thread->config;
+  struct load_udp_batch* rx = &thread->udp_rx;
+
+  for (;;) {
+    for (int idx = 0; idx < config->batch; idx++) {
+      rx->iovs[idx].iov_len = rx->buffer_len;
+      if (config->gso) {
+        rx->msgs[idx].msg_hdr.msg_control =
+            rx->controls + idx * LOAD_UDP_CONTROL_LEN;
+        rx->msgs[idx].msg_hdr.msg_controllen = LOAD_UDP_CONTROL_LEN;
+      }
+    }
+    int received;
+    do {
+      received =
+          recvmmsg(conn->sockfd, rx->msgs, config->batch, MSG_DONTWAIT, NULL);
+    } while ((received < 0) && (EINTR == errno));
+    if (received < 0) {
+      // nothing listening on the server port shows up as ECONNREFUSED
+      if ((EAGAIN != errno) && (EWOULDBLOCK != errno)) {
+        load_close(thread, conn, true);
+        return;
+      }
+      break;
+    }
+
+    uint64_t now = now_ns();
+    for (int idx = 0; idx < received; idx++) {
+      struct msghdr* msg = &rx->msgs[idx].msg_hdr;
+      const char* buffer = rx->iovs[idx].iov_base;
+      size_t len = rx->msgs[idx].msg_len;
+      thread->bytes_received += len;
+
+      size_t segment_size = len;
+      for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg);
+           config->gso && (NULL != cmsg); cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if ((SOL_UDP == cmsg->cmsg_level) && (UDP_GRO == cmsg->cmsg_type)) {
+          int gro_size;
+          memcpy(&gro_size, CMSG_DATA(cmsg), sizeof(gro_size));
+          segment_size = gro_size;
+        }
+      }
+      for (size_t offset = 0; offset < len; offset += segment_size) {
+        size_t datagram_len = len - offset;
+        if (datagram_len > segment_size) {
+          datagram_len = segment_size;
+        }
+        load_udp_echoed(thread, conn, buffer + offset, datagram_len, now);
+      }
+    }
+    if (received > 0) {
+      conn->last_echo_ns = now;
+    }
+    if (received < config->batch) {
+      break;
+    }
+  }
+
+  if ((0 == thread->interval_ns) && (now_ns() < thread->end_ns) &&
+      (conn->outstanding_len < (size_t)config->pipeline_depth)) {
+    load_udp_send(
+        thread, conn, config->pipeline_depth - conn->outstanding_len, now_ns(),
+        0);
+  }
+}
+
+/**
+ * @brief records one echoed datagram
+ *
+ * @param thread the thread that owns the connection
+ * @param conn the connection
+ * @param datagram the echo
+ * @param len the length of the echo
+ * @param now when the echo was received
+ */
+static void load_udp_echoed(
+    struct load_thread* thread, struct load_connection* conn,
+    const char* datagram, size_t len, uint64_t now) {
+  if (len < LOAD_UDP_HEADER_LEN) {
+    return;
+  }
+  uint32_t request_id;
+  uint64_t intended_ns;
+  memcpy(&request_id, datagram, sizeof(request_id));
+  memcpy(&intended_ns, datagram + sizeof(request_id), sizeof(intended_ns));
+  request_id = ntohl(request_id);
+
+  thread->datagrams_echoed++;
+  if (conn->echoed_any &&
+      ((int32_t)(request_id - conn->highest_echoed_id) < 0)) {
+    thread->datagrams_reordered++;
+  } else {
+    conn->highest_echoed_id = request_id;
+    conn->echoed_any = true;
+  }
+  if (conn->outstanding_len > 0) {
+    conn->outstanding_len--;
+  }
+  if (now < thread->end_ns) {
+    thread->requests++;
+    histogram_record(&thread->latency, now - intended_ns);
+  }
+}
+
+/**
+ * @brief allocates a batch and points every header at its own buffer
+ *
+ * @param batch the batch to set up
+ * @param size the number of buffers in the batch
+ * @param buffer_len the size of each buffer
+ * @return int nonzero if memory ran out
+ */
+static int load_udp_batch_init(
+    struct load_udp_batch* batch, int size, size_t buffer_len) {
+  int ret = 0;
+
+  batch->msgs = calloc(size, sizeof(*batch->msgs));
+  batch->iovs = calloc(size, sizeof(*batch->iovs));
+  batch->buffers = malloc(size * buffer_len);
+  batch->buffer_len = buffer_len;
+  batch->controls = calloc(size, LOAD_UDP_CONTROL_LEN);
+  if ((NULL == batch->msgs) || (NULL == batch->iovs) ||
+      (NULL == batch->buffers) || (NULL == batch->controls)) {
+    ret = 1;
+    goto out;
+  }
+
+  for (int idx = 0; idx < size; idx++) {
+    batch->iovs[idx].iov_base = batch->buffers + idx * buffer_len;
+    batch->iovs[idx].iov_len = buffer_len;
+    batch->msgs[idx].msg_hdr.msg_iov = &batch->iovs[idx];
+    batch->msgs[idx].msg_hdr.msg_iovlen = 1;
+  }
+
+out:
+  return ret;
+}
+
+static void load_udp_batch_destroy(struct load_udp_batch* batch) {
+  free(batch->msgs);
+  free(batch->iovs);
+  free(batch->buffers);
+  free(batch->controls);
+  batch->msgs = NULL;
+  batch->iovs = NULL;
+  batch->buffers = NULL;
+  batch->controls = NULL;
+}
+
+/**
+ * @brief runs the single shared memory connection of a thread until the test
+ * is over
+ *
+ * @param arg the struct load_thread to run
+ * @return void* always NULL
+ */
+static void* load_shm_thread_main(void* arg) {
+  struct load_thread* thread = arg;
+  const struct load_config* config = thread->config;
+  struct shm_region* region = NULL;
+  size_t region_len = 0;
+  struct shm_lane* lane = NULL;
+  struct shm_waiter waiter;
+  shm_waiter_init(&waiter);
+
+  thread->epollfd = -1;
+  thread->connections = calloc(1, sizeof(struct load_connection));
+  if (NULL == thread->connections) {
+    fprintf(stderr, "ERROR: failed to allocate connection state\n");
+    thread->ret = 1;
+    goto cleanup;
+  }
+  struct load_connection* conn = &thread->connections[0];
+  conn->sockfd = -1;
+  conn->heap_index = -1;
+
+  if (0 != shm_region_open(config->shm_name, &region, &region_len)) {
+    thread->errors++;
+    goto cleanup;
+  }
+  lane = shm_lane_attach(region);
+  if (NULL == lane) {
+    fprintf(
+        stderr, "ERROR: every lane of %s is taken, start more workers\n",
+        config->shm_name);
+    thread->errors++;
+    goto cleanup;
+  }
+  conn->state = LOAD_CONNECTED;
+
+  // the same timetable as over sockets, with one connection per thread. the
+  // thread sleeps on a futex until its next send, which the default timer
+  // slack of 50 us would make late every time
+  if (config->rate > 0) {
+    prctl(PR_SET_TIMERSLACK, 1);
+    thread->interval_ns =
+        (uint64_t)(config->num_connections * (NSEC_PER_SEC / config->rate));
+    conn->next_send_ns =
+        thread->start_ns +
+        (uint64_t)(thread->first_connection * (NSEC_PER_SEC / config->rate));
+  } else {
+    uint64_t now = now_ns();
+    for (int idx = 0; idx < config->pipeline_depth; idx++) {
+      load_issue_request(thread, conn, now);
+    }
+  }
+
+  while (LOAD_CONNECTED == conn->state) {
+    uint64_t now = now_ns();
+    if (now >= thread->end_ns) {
+      break;
+    }
+    while ((thread->interval_ns > 0) && (conn->next_send_ns <= now) &&
+           (LOAD_CONNECTED == conn->state)) {
+      load_issue_request(thread, conn, conn->next_send_ns);
+      conn->next_send_ns += thread->interval_ns;
+    }
+
+    // the server waits either for requests or for room to echo into, each
+    // side of the exchange gives it one of them
+    bool busy = false;
+    if (conn->tx_end > conn->tx_start) {
+      size_t written = shm_ring_write(
+          &lane->requests, conn->tx_buffer + conn->tx_start,
+          conn->tx_end - conn->tx_start);
+      if (written > 0) {
+        conn->tx_start += written;
+        thread->bytes_sent += written;
+        if (conn->tx_start == conn->tx_end) {
+          conn->tx_start = 0;
+          conn->tx_end = 0;
+        }
+        shm_doorbell_ring(&lane->server_bell);
+        busy = true;
+      }
+    }
+    const char* data;
+    size_t len = shm_ring_peek(&lane->responses, &data);
+    if (len > 0) {
+      thread->bytes_received += len;
+      load_consume(thread, conn, data, len);
+      shm_ring_consume(&lane->responses, len);
+      shm_doorbell_ring(&lane->server_bell);
+      busy = true;
+    }
+    if (busy) {
+      continue;
+    }
+
+    // sleep until the server answers, the next send or the end of the test
+    struct load_shm_wait waiting = {
+        .conn = conn,
+        .lane = lane,
+        .wake_ns = thread->end_ns,
+    };
+    if ((thread->interval_ns > 0) && (conn->next_send_ns < waiting.wake_ns)) {
+      waiting.wake_ns = conn->next_send_ns;
+    }
+    shm_wait(
+        &waiter, &lane->client_bell, load_shm_ready, &waiting,
+        (waiting.wake_ns > now) ? waiting.wake_ns - now : 0);
+  }
+
+cleanup:
+  if (NULL != thread->connections) {
+    struct load_connection* conn = &thread->connections[0];
+    if (LOAD_CONNECTED == conn->state) {
+      thread->unfinished += conn->outstanding_len;
+    }
+    free(conn->outstanding);
+    free(conn->tx_buffer);
+  }
+  if (NULL != lane) {
+    shm_lane_detach(lane);
+  }
+  if (NULL != region) {
+    shm_region_close(region, region_len);
+  }
+  free(thread->connections);
+  return NULL;
+}
+
+/**
+ * @brief tells whether a waiting shared memory thread has anything to do
+ *
+ * @param arg the struct load_shm_wait of the thread
+ * @return bool whether echoes arrived, queued requests fit into the ring or
+ * it is time to wake up
+ */
+static bool load_shm_ready(void* arg) {
+  struct load_shm_wait* waiting = arg;
+  if (shm_ring_used(&waiting->lane->responses) > 0) {
+    return true;
+  }
+  if ((waiting->conn->tx_end > waiting->conn->tx_start) &&
+      (shm_ring_used(&waiting->lane->requests) < SHM_RING_LEN)) {
+    return true;
+  }
+  return now_ns() >= waiting->wake_ns;
+}
+
+static void heap_swap(struct load_thread* thread, int a, int b) {
+  struct load_connection* tmp = thread->heap[a];
+  thread->heap[a] = thread->heap[b];
+  thread->heap[b] = tmp;
+  thread->heap[a]->heap_index = a;
+  thread->heap[b]->heap_index = b;
+}
+
+static void heap_sift_up(struct load_thread* thread, int idx) {
+  while (idx > 0) {
+    int parent = (idx - 1) / 2;
+    if (thread->heap[parent]->next_send_ns <= thread->heap[idx]->next_send_ns) {
+      break;
+    }
+    heap_swap(thread, idx, parent);
+    idx = parent;
+  }
+}
+
+static void heap_sift_down(struct load_thread* thread, int idx) {
+  for (;;) {
+    int smallest = idx;
+    int left = 2 * idx + 1;
+    int right = left + 1;
+    if ((left < thread->heap_len) && (thread->heap[left]->next_send_ns <
+                                      thread->heap[smallest]->next_send_ns)) {
+      smallest = left;
+    }
+    if ((right < thread->heap_len) && (thread->heap[right]->next_send_ns <
+                                       thread->heap[smallest]->next_send_ns)) {
+      smallest = right;
+    }
+    if (smallest == idx) {
+      break;
+    }
+    heap_swap(thread, idx, smallest);
+    idx = smallest;
+  }
+}
+
+static void heap_push(
+    struct load_thread* thread, struct load_connection* conn) {
+  int idx = thread->heap_len++;
+  thread->heap[idx] = conn;
+  conn->heap_index = idx;
+  heap_sift_up(thread, idx);
+}
+
+static void heap_remove(
+    struct load_thread* thread, struct load_connection* conn) {
+  int idx = conn->heap_index;
+  thread->heap_len--;
+  if (idx != thread->heap_len) {
+    heap_swap(thread, idx, thread->heap_len);
+    heap_sift_down(thread, idx);
+    heap_sift_up(thread, idx);
+  }
+  conn->heap_index = -1;
+}
+
+static struct load_connection* heap_pop(struct load_thread* thread) {
+  struct load_connection* top = thread->heap[0];
+  heap_remove(thread, top);
+  return top;
+}
@@ -0,0 +1,84 @@
+/**
+ * @file client_load.h
+ * @author oclyke
+ * @brief load generator mode of the client
+ */
+
+#ifndef CLIENT_LOAD_H_
+#define CLIENT_LOAD_H_
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+#include "tls.h"
+
+// the largest payload of a UDP datagram over IPv4
+#define LOAD_UDP_MAX_DATAGRAM_LEN 65507
+// sendmmsg() never sends more than UIO_MAXIOV datagrams at once
+#define LOAD_UDP_MAX_BATCH 1024
+// a seqpacket record is received in one piece, so this is the largest request
+#define LOAD_MAX_RECORD_LEN 65536
+
+/**
+ * @brief everything needed to run a load test against the echo server
+ */
+struct load_config {
+  // an AF_INET or AF_UNIX address
+  struct sockaddr_storage server_addr;
+  socklen_t server_addr_len;
+  // SOCK_STREAM, or SOCK_SEQPACKET to send every request as one record over
+  // a unix domain socket
+  int socket_type;
+  const char* message;
+  size_t message_len;
+  int num_connections;
+  int num_threads;
+  double duration_s;
+  // total requests per second over all connections, 0 for as fast as possible
+  double rate;
+  // requests kept in flight per connection in closed-loop mode
+  int pipeline_depth;
+  // send length-prefixed frames (see protocol.h) instead of raw messages
+  bool framed;
+  // the server discards instead of echoing, requests are done once sent
+  bool sink;
+  // send every request as a UDP datagram instead of over a TCP connection
+  bool udp;
+  // datagrams sent per sendmmsg() and received per recvmmsg() with udp
+  int batch;
+  // with udp, send many datagrams per buffer with UDP_SEGMENT and receive
+  // coalesced echoes with UDP_GRO
+  bool gso;
+  // shake hands over TLS on every connection and leave the records to the
+  // kernel, NULL for plain connections
+  struct tls_context* tls;
+  // talk to the server through its shared memory region by this name instead
+  // of sockets, one connection per thread
+  const char* shm_name;
+  // where to write the full latency distribution, NULL to skip it
+  const char* histogram_path;
+  // sample TCP_INFO of every TCP connection this often, 0 to never
+  int tcp_info_interval_ms;
+};
+
+/**
+ * @brief runs a load test and prints the aggregate results
+ *
+ * every thread drives its share of the connections from its own epoll loop.
+ * closed-loop connections keep pipeline_depth requests in flight and send a new
+ * one whenever an echo completes, open-loop connections send whenever the rate
+ * schedule says so. the round trip of every request is recorded in a latency
+ * histogram. with udp every connection is a connected UDP socket and lost and
+ * reordered echoes are counted as well. with shm_name every thread claims a
+ * lane of the server's shared memory region and drives it as its only
+ * connection. with tcp_info_interval_ms the threads also sample TCP_INFO of
+ * their connections.
+ *
+ * @param config the load test to run
+ * @return int nonzero if the load test could not be run
+ */
+int run_load(const struct load_config* config);
+
+#endif  // CLIENT_LOAD_H_
@@ -0,0 +1,279 @@
+/**
+ * @file histogram.c
+ * @author oclyke
+ * @brief log-linear (HDR style) histogram of latencies
+ *
+ * This follows the bucket layout of HdrHistogram with a fixed precision of
+ * 2048 sub-buckets (a little better than three significant digits) and a
+ * unit of 1, so values are usually nanoseconds.
+ *
+ * References:
+ * - http://hdrhistogram.org
+ * - https://github.com/HdrHistogram/HdrHistogram_c
+ */
+
+#include "histogram.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HISTOGRAM_SUB_BUCKET_MAGNITUDE 11
+#define HISTOGRAM_TICKS_PER_HALF_DISTANCE 5
+
+static int counts_index(const struct histogram* histogram, uint64_t value);
+static int bucket_index_of(const struct histogram* histogram, int index);
+static uint64_t value_at_index(const struct histogram* histogram, int index);
+static uint64_t highest_equivalent_value(
+    const struct histogram* histogram, int index);
+static int index_at_percentile(
+    const struct histogram* histogram, double percentile,
+    uint64_t* cumulative_count_out);
+
+int histogram_init(
+    struct histogram* histogram, uint64_t highest_trackable_value) {
+  int ret = 0;
+
+  memset(histogram, 0, sizeof(*histogram));
+  int sub_bucket_count = 1 << HISTOGRAM_SUB_BUCKET_MAGNITUDE;
+  histogram->highest_trackable_value = highest_trackable_value;
+  histogram->sub_bucket_half_count_magnitude =
+      HISTOGRAM_SUB_BUCKET_MAGNITUDE - 1;
+  histogram->sub_bucket_half_count = sub_bucket_count / 2;
+  histogram->sub_bucket_mask = sub_bucket_count - 1;
+
+  // find how many power of two buckets it takes to reach the highest value
+  uint64_t smallest_untrackable_value = sub_bucket_count;
+  int bucket_count = 1;
+  while (smallest_untrackable_value <= highest_trackable_value) {
+    if (smallest_untrackable_value > (UINT64_MAX / 2)) {
+      bucket_count++;
+      break;
+    }
+    smallest_untrackable_value <<= 1;
+    bucket_count++;
+  }
+  histogram->counts_len = (bucket_count + 1) * histogram->sub_bucket_half_count;
+
+  histogram->counts = calloc(histogram->counts_len, sizeof(uint64_t));
+  if (NULL == histogram->counts) {
+    ret = 1;
+    goto out;
+  }
+  histogram_reset(histogram);
+
+out:
+  return ret;
+}
+
+void histogram_destroy(struct histogram* histogram) {
+  free(histogram->counts);
+  histogram->counts = NULL;
+}
+
+void histogram_reset(struct histogram* histogram) {
+  memset(histogram->counts, 0, histogram->counts_len * sizeof(uint64_t));
+  histogram->total_count = 0;
+  histogram->min = UINT64_MAX;
+  histogram->max = 0;
+}
+
+void histogram_record(struct histogram* histogram, uint64_t value) {
+  if (value > histogram->highest_trackable_value) {
+    value = histogram->highest_trackable_value;
+  }
+  histogram->counts[counts_index(histogram, value)]++;
+  histogram->total_count++;
+  if (value < histogram->min) {
+    histogram->min = value;
+  }
+  if (value > histogram->max) {
+    histogram->max = value;
+  }
+}
+
+void histogram_merge(struct histogram* dst, const struct histogram* src) {
+  for (int idx = 0; idx < src->counts_len; idx++) {
+    dst->counts[idx] += src->counts[idx];
+  }
+  dst->total_count += src->total_count;
+  if (src->min < dst->min) {
+    dst->min = src->min;
+  }
+  if (src->max > dst->max) {
+    dst->max = src->max;
+  }
+}
+
+uint64_t histogram_value_at_percentile(
+    const struct histogram* histogram, double percentile) {
+  if (0 == histogram->total_count) {
+    return 0;
+  }
+  uint64_t value =
+      highest_equivalent_value(histogram, index_at_percentile(
+                                              histogram, percentile, NULL));
+  return (value > histogram->max) ? histogram->max : value;
+}
+
+void histogram_print_percentiles(
+    const struct histogram* histogram, FILE* out, const char* label,
+    double unit_divisor, const char* unit_name) {
+  static const double percentiles[] = {50.0, 90.0, 99.0, 99.9, 99.99};
+  static const char* names[] = {"p50", "p90", "p99", "p99.9", "p99.99"};
+
+  fprintf(
+      out, "%s (%s, %lu samples):\n", label, unit_name,
+      (unsigned long)histogram->total_count);
+  for (size_t idx = 0; idx < sizeof(percentiles) / sizeof(percentiles[0]);
+       idx++) {
+    fprintf(
+        out, "  %-7s %12.3f\n", names[idx],
+        histogram_value_at_percentile(histogram, percentiles[idx]) /
+            unit_divisor);
+  }
+  fprintf(out, "  %-7s %12.3f\n", "max", histogram->max / unit_divisor);
+}
+
+int histogram_write_distribution(
+    const struct histogram* histogram, FILE* out, double unit_divisor) {
+  int ret = 0;
+
+  if (fprintf(
+          out, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount",
+          "1/(1-Percentile)") < 0) {
+    ret = 1;
+    goto out;
+  }
+
+  // walk the percentiles in steps that halve every time the distance to 100%
+  // halves, which gives the usual dense tail of an HdrHistogram plot
+  double mean = 0.0;
+  double stddev = 0.0;
+  if (histogram->total_count > 0) {
+    double percentile = 0.0;
+    for (;;) {
+      uint64_t cumulative_count = 0;
+      int index = index_at_percentile(histogram, percentile, &cumulative_count);
+      uint64_t value = highest_equivalent_value(histogram, index);
+      if (value > histogram->max) {
+        value = histogram->max;
+      }
+      double fraction = (double)cumulative_count / histogram->total_count;
+      if (fraction < 1.0) {
+        fprintf(
+            out, "%12.3f %2.12f %10lu %14.2f\n", value / unit_divisor,
+            fraction, (unsigned long)cumulative_count, 1.0 / (1.0 - fraction));
+      } else {
+        fprintf(
+            out, "%12.3f %2.12f %10lu\n", value / unit_divisor, fraction,
+            (unsigned long)cumulative_count);
+        break;
+      }
+
+      double half_distance =
+          pow(2, floor(log2(100.0 / (100.0 - percentile))) + 1);
+      percentile +=
+          100.0 / (HISTOGRAM_TICKS_PER_HALF_DISTANCE * half_distance);
+      if (percentile > 100.0) {
+        percentile = 100.0;
+      }
+    }
+
+    for (int idx = 0; idx < histogram->counts_len; idx++) {
+      mean += histogram->counts[idx] * (double)value_at_index(histogram, idx);
+    }
+    mean /= histogram->total_count;
+    for (int idx = 0; idx < histogram->counts_len; idx++) {
+      double deviation = value_at_index(histogram, idx) - mean;
+      stddev += histogram->counts[idx] * deviation * deviation;
+    }
+    stddev = sqrt(stddev / histogram->total_count);
+  }
+
+  int bucket_count =
+      histogram->counts_len / histogram->sub_bucket_half_count - 1;
+  if (fprintf(
+          out,
+          "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n"
+          "#[Max     = %12.3f, Total count    = %12lu]\n"
+          "#[Buckets = %12d, SubBuckets     = %12d]\n",
+          mean / unit_divisor, stddev / unit_divisor,
+          histogram->max / unit_divisor, (unsigned long)histogram->total_count,
+          bucket_count, 2 * histogram->sub_bucket_half_count) < 0) {
+    ret = 1;
+  }
+
+out:
+  return ret;
+}
+
+static int counts_index(const struct histogram* histogram, uint64_t value) {
+  int pow2ceiling = 64 - __builtin_clzll(value | histogram->sub_bucket_mask);
+  int bucket_index =
+      pow2ceiling - (histogram->sub_bucket_half_count_magnitude + 1);
+  int sub_bucket_index = value >> bucket_index;
+  return ((bucket_index + 1) << histogram->sub_bucket_half_count_magnitude) +
+         (sub_bucket_index - histogram->sub_bucket_half_count);
+}
+
+static int bucket_index_of(const struct histogram* histogram, int index) {
+  int bucket_index = (index >> histogram->sub_bucket_half_count_magnitude) - 1;
+  return (bucket_index < 0) ? 0 : bucket_index;
+}
+
+static uint64_t value_at_index(const struct histogram* histogram, int index) {
+  int bucket_index = (index >> histogram->sub_bucket_half_count_magnitude) - 1;
+  int sub_bucket_index = (index & (histogram->sub_bucket_half_count - 1)) +
+                         histogram->sub_bucket_half_count;
+  if (bucket_index < 0) {
+    sub_bucket_index -= histogram->sub_bucket_half_count;
+    bucket_index = 0;
+  }
+  return (uint64_t)sub_bucket_index << bucket_index;
+}
+
+static uint64_t highest_equivalent_value(
+    const struct histogram* histogram, int index) {
+  return value_at_index(histogram, index) +
+         ((uint64_t)1 << bucket_index_of(histogram, index)) - 1;
+}
+
+/**
+ * @brief finds the counter that holds the given percentile
+ *
+ * @param histogram a histogram with at least one recorded value
+ * @param percentile the percentile, between 0 and 100
+ * @param cumulative_count_out optional, the number of values up to and
+ * including the returned counter
+ * @return int the counter index
+ */
+static int index_at_percentile(
+    const struct histogram* histogram, double percentile,
+    uint64_t* cumulative_count_out) {
+  if (percentile > 100.0) {
+    percentile = 100.0;
+  }
+  uint64_t count_at_percentile =
+      (uint64_t)ceil((percentile / 100.0) * histogram->total_count);
+  if (count_at_percentile < 1) {
+    count_at_percentile = 1;
+  }
+
+  uint64_t cumulative_count = 0;
+  int idx = 0;
+  for (; idx < histogram->counts_len; idx++) {
+    cumulative_count += histogram->counts[idx];
+    if (cumulative_count >= count_at_percentile) {
+      break;
+    }
+  }
+  if (idx == histogram->counts_len) {
+    idx--;
+  }
+
+  if (NULL != cumulative_count_out) {
+    *cumulative_count_out = cumulative_count;
+  }
+  return idx;
+}
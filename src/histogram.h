@@ -0,0 +1,112 @@
+/**
+ * @file histogram.h
+ * @author oclyke
+ * @brief log-linear (HDR style) histogram of latencies
+ */
+
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * @brief counts values with a fixed relative precision over a wide range
+ *
+ * values are split into power of two buckets, each of which is divided into
+ * the same number of linear sub-buckets. every recorded value therefore keeps
+ * about three significant digits whether it is 100 ns or 100 s, while the
+ * whole histogram stays a flat array of counters that is cheap to record into
+ * and to merge.
+ */
+struct histogram {
+  uint64_t highest_trackable_value;
+  int sub_bucket_half_count_magnitude;
+  int sub_bucket_half_count;
+  uint64_t sub_bucket_mask;
+  int counts_len;
+  uint64_t* counts;
+  uint64_t total_count;
+  uint64_t min;
+  uint64_t max;
+};
+
+/**
+ * @brief allocates the counters of a histogram
+ *
+ * @param histogram the histogram to set up
+ * @param highest_trackable_value larger values are recorded as this value
+ * @return int nonzero if the counters could not be allocated
+ */
+int histogram_init(struct histogram* histogram, uint64_t highest_trackable_value);
+
+/**
+ * @brief frees the counters of a histogram
+ *
+ * @param histogram the histogram
+ */
+void histogram_destroy(struct histogram* histogram);
+
+/**
+ * @brief forgets every recorded value
+ *
+ * @param histogram the histogram
+ */
+void histogram_reset(struct histogram* histogram);
+
+/**
+ * @brief records one occurrence of a value
+ *
+ * @param histogram the histogram
+ * @param value the value
+ */
+void histogram_record(struct histogram* histogram, uint64_t value);
+
+/**
+ * @brief adds every value recorded in one histogram to another
+ *
+ * both histograms must have been set up with the same highest trackable value.
+ *
+ * @param dst the histogram to add to
+ * @param src the histogram to add
+ */
+void histogram_merge(struct histogram* dst, const struct histogram* src);
+
+/**
+ * @brief finds the value below which a percentage of recorded values fall
+ *
+ * @param histogram the histogram
+ * @param percentile the percentile, between 0 and 100
+ * @return uint64_t the highest value equivalent to the percentile
+ */
+uint64_t histogram_value_at_percentile(
+    const struct histogram* histogram, double percentile);
+
+/**
+ * @brief prints p50, p90, p99, p99.9, p99.99 and the maximum
+ *
+ * @param histogram the histogram
+ * @param out where to print
+ * @param label printed before the percentiles
+ * @param unit_divisor recorded values are divided by this before printing
+ * @param unit_name the name of the printed unit
+ */
+void histogram_print_percentiles(
+    const struct histogram* histogram, FILE* out, const char* label,
+    double unit_divisor, const char* unit_name);
+
+/**
+ * @brief writes the full percentile distribution
+ *
+ * the output uses the .hgrm text layout of HdrHistogram, so it can be loaded
+ * into the usual HdrHistogram plotting tools.
+ *
+ * @param histogram the histogram
+ * @param out where to write
+ * @param unit_divisor recorded values are divided by this before writing
+ * @return int nonzero if writing failed
+ */
+int histogram_write_distribution(
+    const struct histogram* histogram, FILE* out, double unit_divisor);
+
+#endif  // HISTOGRAM_H_
@@ -0,0 +1,306 @@
+/**
+ * @file metrics.c
+ * @author oclyke
+ * @brief per-worker counters of the server and the endpoint that serves them
+ *
+ * The endpoint runs on a thread of its own and handles one scrape at a time
+ * with blocking calls and short timeouts, so the workers never see it. A
+ * scrape walks the metrics of every worker and writes one sample per metric,
+ * summed over the workers.
+ *
+ * The only values that are not counted by the workers are read at scrape
+ * time: the accept queue of a TCP listener is in its TCP_INFO (tcpi_unacked
+ * holds the connections waiting to be accepted on a listening socket).
+ */
+
+#define _GNU_SOURCE
+
+#include "metrics.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define METRICS_LISTEN_BACKLOG 16
+#define METRICS_REQUEST_LEN 1024
+// a scraper that stalls holds up the next one for at most this long
+#define METRICS_TIMEOUT_S 1
+
+/**
+ * @brief where to find one metric in struct worker_metrics
+ */
+struct metric_field {
+  const char* name;
+  const char* help;
+  size_t offset;
+  // gauges are _Atomic int64_t, counters _Atomic uint64_t
+  bool gauge;
+};
+
+static const struct metric_field metric_fields[] = {
+    {"echo_accepts_total", "Connections accepted.",
+     offsetof(struct worker_metrics, accepts), false},
+    {"echo_closes_total", "Connections closed.",
+     offsetof(struct worker_metrics, closes), false},
+    {"echo_active_connections", "Connections currently open.",
+     offsetof(struct worker_metrics, active_connections), true},
+    {"echo_received_bytes_total", "Bytes received from clients.",
+     offsetof(struct worker_metrics, bytes_received), false},
+    {"echo_sent_bytes_total", "Bytes sent back to clients.",
+     offsetof(struct worker_metrics, bytes_sent), false},
+    {"echo_recv_calls_total", "Syscalls that receive from a client.",
+     offsetof(struct worker_metrics, recv_calls), false},
+    {"echo_send_calls_total", "Syscalls that send to a client.",
+     offsetof(struct worker_metrics, send_calls), false},
+    {"echo_recv_eagain_total", "Receives that found the socket empty.",
+     offsetof(struct worker_metrics, recv_eagains), false},
+    {"echo_send_eagain_total", "Sends that found the socket full.",
+     offsetof(struct worker_metrics, send_eagains), false},
+    {"echo_errors_total",
+     "Failed accepts, receives, sends and handshakes.",
+     offsetof(struct worker_metrics, errors), false},
+    {"echo_queued_bytes", "Bytes received and waiting to be echoed.",
+     offsetof(struct worker_metrics, queued_bytes), true},
+    {"echo_paused_connections",
+     "Connections not read from until their output drains.",
+     offsetof(struct worker_metrics, paused_connections), true},
+    {"echo_pauses_total", "Times a connection was paused by backpressure.",
+     offsetof(struct worker_metrics, pauses), false},
+};
+
+static void* run_metrics_server(void* arg);
+static void serve_scrape(struct metrics_server* server, int sockfd);
+static int write_metrics(struct metrics_server* server, FILE* out);
+static int send_all(int sockfd, const char* data, size_t len);
+
+int metrics_server_start(
+    struct metrics_server* server, int port_number,
+    const struct worker_metrics* workers, int num_workers, int stop_fd) {
+  int ret = 0;
+
+  server->workers = workers;
+  server->num_workers = num_workers;
+  server->stop_fd = stop_fd;
+  server->sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (server->sockfd < 0) {
+    fprintf(stderr, "ERROR opening metrics socket\n");
+    ret = 1;
+    goto out;
+  }
+
+  int reuse = 1;
+  setsockopt(server->sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  struct sockaddr_in addr;
+  bzero((char*)&addr, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = htons(port_number);
+  if ((0 != bind(server->sockfd, (struct sockaddr*)&addr, sizeof(addr))) ||
+      (0 != listen(server->sockfd, METRICS_LISTEN_BACKLOG))) {
+    fprintf(
+        stderr, "ERROR: failed to listen for metrics on port %d\n",
+        port_number);
+    close(server->sockfd);
+    ret = 1;
+    goto out;
+  }
+
+  if (0 != pthread_create(&server->thread, NULL, run_metrics_server, server)) {
+    fprintf(stderr, "ERROR: failed to start the metrics thread\n");
+    close(server->sockfd);
+    ret = 1;
+    goto out;
+  }
+
+out:
+  return ret;
+}
+
+void metrics_server_stop(struct metrics_server* server) {
+  pthread_join(server->thread, NULL);
+  close(server->sockfd);
+}
+
+/**
+ * @brief entry point of the metrics thread
+ *
+ * @param arg the struct metrics_server to run
+ * @return void* always NULL
+ */
+static void* run_metrics_server(void* arg) {
+  struct metrics_server* server = arg;
+
+  struct pollfd fds[2] = {
+      {.fd = server->sockfd, .events = POLLIN},
+      {.fd = server->stop_fd, .events = POLLIN},
+  };
+  for (;;) {
+    if (poll(fds, 2, -1) < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      fprintf(stderr, "ERROR waiting for scrapes\n");
+      break;
+    }
+    if (fds[1].revents & POLLIN) {
+      break;
+    }
+
+    // the scraper may have given up since poll() saw it, the listening socket
+    // is non-blocking so that this does not hang
+    int client_sockfd = accept4(server->sockfd, NULL, NULL, SOCK_CLOEXEC);
+    if (client_sockfd < 0) {
+      continue;
+    }
+    serve_scrape(server, client_sockfd);
+    close(client_sockfd);
+  }
+  return NULL;
+}
+
+/**
+ * @brief reads one HTTP request and answers it
+ *
+ * only the request line matters: GET /metrics (or just /) gets the metrics,
+ * anything else a 404.
+ *
+ * @param server the endpoint
+ * @param sockfd the blocking socket of the scraper
+ */
+static void serve_scrape(struct metrics_server* server, int sockfd) {
+  struct timeval timeout = {.tv_sec = METRICS_TIMEOUT_S};
+  setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  char request[METRICS_REQUEST_LEN];
+  size_t request_len = 0;
+  request[0] = 0;
+  while ((request_len < (sizeof(request) - 1)) &&
+         (NULL == strstr(request, "\r\n\r\n"))) {
+    ssize_t chars_received = recv(
+        sockfd, request + request_len, sizeof(request) - 1 - request_len, 0);
+    if (chars_received <= 0) {
+      break;
+    }
+    request_len += chars_received;
+    request[request_len] = 0;
+  }
+
+  if ((0 != strncmp(request, "GET /metrics ", 13)) &&
+      (0 != strncmp(request, "GET / ", 6))) {
+    const char* not_found =
+        "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: "
+        "close\r\n\r\n";
+    send_all(sockfd, not_found, strlen(not_found));
+    return;
+  }
+
+  char* body = NULL;
+  size_t body_len = 0;
+  FILE* out = open_memstream(&body, &body_len);
+  if (NULL == out) {
+    return;
+  }
+  int failed = write_metrics(server, out);
+  if ((0 == fclose(out)) && (0 == failed)) {
+    char header[256];
+    int header_len = snprintf(
+        header, sizeof(header),
+        "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+        body_len);
+    if (0 == send_all(sockfd, header, header_len)) {
+      send_all(sockfd, body, body_len);
+    }
+  }
+  free(body);
+}
+
+/**
+ * @brief writes every metric, summed over the workers
+ *
+ * @param server the endpoint
+ * @param out where to write
+ * @return int nonzero if writing failed
+ */
+static int write_metrics(struct metrics_server* server, FILE* out) {
+  size_t num_fields = sizeof(metric_fields) / sizeof(metric_fields[0]);
+  for (size_t idx = 0; idx < num_fields; idx++) {
+    const struct metric_field* field = &metric_fields[idx];
+    int64_t total = 0;
+    for (int worker = 0; worker < server->num_workers; worker++) {
+      const char* metrics = (const char*)&server->workers[worker];
+      if (field->gauge) {
+        total += atomic_load_explicit(
+            (const _Atomic int64_t*)(metrics + field->offset),
+            memory_order_relaxed);
+      } else {
+        total += (int64_t)atomic_load_explicit(
+            (const _Atomic uint64_t*)(metrics + field->offset),
+            memory_order_relaxed);
+      }
+    }
+    fprintf(
+        out, "# HELP %s %s\n# TYPE %s %s\n%s %lld\n", field->name,
+        field->help, field->name, field->gauge ? "gauge" : "counter",
+        field->name, (long long)total);
+  }
+
+  int64_t accept_queue = 0;
+  for (int worker = 0; worker < server->num_workers; worker++) {
+    int listen_sockfd = server->workers[worker].listen_sockfd;
+    struct tcp_info info;
+    socklen_t info_len = sizeof(info);
+    if ((listen_sockfd >= 0) &&
+        (0 == getsockopt(
+                  listen_sockfd, IPPROTO_TCP, TCP_INFO, &info, &info_len))) {
+      accept_queue += info.tcpi_unacked;
+    }
+  }
+  fprintf(
+      out,
+      "# HELP echo_accept_queue_length Connections waiting to be "
+      "accepted.\n# TYPE echo_accept_queue_length gauge\n"
+      "echo_accept_queue_length %lld\n",
+      (long long)accept_queue);
+
+  return ferror(out) ? 1 : 0;
+}
+
+/**
+ * @brief sends exactly len characters
+ *
+ * @param sockfd a blocking socket
+ * @param data the characters
+ * @param len the number of characters
+ * @return int nonzero if the connection failed or timed out
+ */
+static int send_all(int sockfd, const char* data, size_t len) {
+  int ret = 0;
+
+  while (len > 0) {
+    ssize_t chars_sent = send(sockfd, data, len, MSG_NOSIGNAL);
+    if (chars_sent < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      ret = 1;
+      goto out;
+    }
+    data += chars_sent;
+    len -= chars_sent;
+  }
+
+out:
+  return ret;
+}
@@ -0,0 +1,111 @@
+/**
+ * @file metrics.h
+ * @author oclyke
+ * @brief per-worker counters of the server and the endpoint that serves them
+ *
+ * Every worker owns one struct worker_metrics and is the only thread that
+ * ever writes to it. An update is therefore a relaxed load and a relaxed
+ * store, which compiles to a plain add in memory: no locked instruction and
+ * no cache line bouncing between workers. The metrics thread reads the same
+ * counters with relaxed loads whenever it is scraped and sums them up, so a
+ * scrape may see one worker a few events ahead of another but never a torn
+ * value.
+ *
+ * The endpoint speaks just enough HTTP/1.0 to answer GET /metrics in the
+ * Prometheus text exposition format, one request per connection.
+ *
+ * References:
+ * - https://prometheus.io/docs/instrumenting/exposition_formats/
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+/**
+ * @brief what one worker has done so far
+ *
+ * counters only grow, gauges go up and down and may be negative in between.
+ */
+struct worker_metrics {
+  _Atomic uint64_t accepts;
+  _Atomic uint64_t closes;
+  _Atomic int64_t active_connections;
+  _Atomic uint64_t bytes_received;
+  _Atomic uint64_t bytes_sent;
+  // syscalls that receive or send, including splice() and mapped receives
+  _Atomic uint64_t recv_calls;
+  _Atomic uint64_t send_calls;
+  _Atomic uint64_t recv_eagains;
+  _Atomic uint64_t send_eagains;
+  // failed accepts, receives, sends and handshakes
+  _Atomic uint64_t errors;
+  // output received but not yet echoed, over all connections
+  _Atomic int64_t queued_bytes;
+  _Atomic int64_t paused_connections;
+  _Atomic uint64_t pauses;
+  // set before the worker starts and not changed afterwards. the accept
+  // queue of a TCP listener is read from it at scrape time, -1 for none
+  int listen_sockfd;
+};
+
+/**
+ * @brief the endpoint and the thread that serves it
+ */
+struct metrics_server {
+  int sockfd;
+  int stop_fd;
+  const struct worker_metrics* workers;
+  int num_workers;
+  pthread_t thread;
+};
+
+/**
+ * @brief adds to a counter of the calling worker
+ *
+ * @param counter a counter only this thread writes to
+ * @param value the amount to add
+ */
+static inline void metrics_add(_Atomic uint64_t* counter, uint64_t value) {
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+      memory_order_relaxed);
+}
+
+/**
+ * @brief moves a gauge of the calling worker
+ *
+ * @param gauge a gauge only this thread writes to
+ * @param delta the change, negative to go down
+ */
+static inline void metrics_gauge_add(_Atomic int64_t* gauge, int64_t delta) {
+  atomic_store_explicit(
+      gauge, atomic_load_explicit(gauge, memory_order_relaxed) + delta,
+      memory_order_relaxed);
+}
+
+/**
+ * @brief opens the endpoint and starts the thread that serves it
+ *
+ * @param server the endpoint
+ * @param port_number the TCP port to listen on, on every address
+ * @param workers the metrics of every worker
+ * @param num_workers the number of workers
+ * @param stop_fd an eventfd that stops the thread once it is readable
+ * @return int nonzero if the endpoint could not be started
+ */
+int metrics_server_start(
+    struct metrics_server* server, int port_number,
+    const struct worker_metrics* workers, int num_workers, int stop_fd);
+
+/**
+ * @brief waits for the thread to see the stop eventfd and closes the endpoint
+ *
+ * @param server a started endpoint
+ */
+void metrics_server_stop(struct metrics_server* server);
+
+#endif  // METRICS_H_
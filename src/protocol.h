@@ -0,0 +1,66 @@
+/**
+ * @file protocol.h
+ * @author oclyke
+ * @brief length-prefixed framing shared by the client and server
+ *
+ * In framed mode every request and every response is a frame: a fixed header
+ * followed by the payload. Both header fields are unsigned 32 bit integers in
+ * network byte order.
+ *
+ *   0        4        8
+ *   +--------+--------+----------------+
+ *   | length | req id | payload ...    |
+ *   +--------+--------+----------------+
+ *
+ * length counts payload bytes only. the request id is chosen by the client
+ * and copied into the response unchanged, so responses can be matched to
+ * requests without counting bytes. the echo server answers every frame with
+ * the identical frame.
+ */
+
+#ifndef PROTOCOL_H_
+#define PROTOCOL_H_
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+
+#define FRAME_HEADER_LEN 8
+#define FRAME_MAX_PAYLOAD_LEN (1024 * 1024)
+
+struct frame_header {
+  uint32_t length;
+  uint32_t request_id;
+};
+
+/**
+ * @brief writes a frame header into a buffer
+ *
+ * @param buffer at least FRAME_HEADER_LEN bytes, no alignment needed
+ * @param header the header to write
+ */
+static inline void frame_header_encode(
+    char* buffer, const struct frame_header* header) {
+  uint32_t length = htonl(header->length);
+  uint32_t request_id = htonl(header->request_id);
+  memcpy(buffer, &length, sizeof(length));
+  memcpy(buffer + sizeof(length), &request_id, sizeof(request_id));
+}
+
+/**
+ * @brief reads a frame header out of a buffer
+ *
+ * @param buffer at least FRAME_HEADER_LEN bytes, no alignment needed
+ * @param header_out the decoded header
+ */
+static inline void frame_header_decode(
+    const char* buffer, struct frame_header* header_out) {
+  uint32_t length;
+  uint32_t request_id;
+  memcpy(&length, buffer, sizeof(length));
+  memcpy(&request_id, buffer + sizeof(length), sizeof(request_id));
+  header_out->length = ntohl(length);
+  header_out->request_id = ntohl(request_id);
+}
+
+#endif  // PROTOCOL_H_
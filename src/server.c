@@ -12,6 +12,26 @@
  * - argument parsing from argc and argv
  * - constructing a listening socket
  * - accepting client connections
+ * - multiplexing many non-blocking connections with epoll
+ * - spreading connections across cores with SO_REUSEPORT workers
+ * - an optional io_uring backend (see server_uring.c)
+ * - an optional length-prefixed framing (see protocol.h)
+ * - per-worker buffer pools (see buffer_pool.c)
+ * - an optional kernel-only echo path built on splice()
+ * - optional MSG_ZEROCOPY sends for large echoes (see zerocopy.c)
+ * - an experimental TCP_ZEROCOPY_RECEIVE path and a sink mode to measure it
+ * - an optional datagram echo mode with batched syscalls (see server_udp.c)
+ * - unix domain sockets, as a byte stream or as records (SOCK_SEQPACKET)
+ * - a shared memory transport for clients on the same machine (see
+ *   server_shm.c)
+ * - TLS with the records encrypted by the kernel (see tls.c)
+ * - per-worker counters served to Prometheus (see metrics.c)
+ * - connection events logged through per-thread rings (see async_log.c)
+ * - per-stage latency histograms of every echo (see tsc.h)
+ * - kernel receive timestamps that show how long requests sat in the socket
+ *   (see timestamping.c)
+ * - TCP_INFO of every connection sampled into histograms (see tcp_stats.c)
+ * - shutting down cleanly on SIGINT or SIGTERM
  *
  * References:
  * -
@@ -19,26 +39,332 @@
  * - pubs.opengroup.org/onlinepubs/009696799/functions/<FUNCNAME.html>
  */
 
+// accept4(), SOCK_NONBLOCK, splice() and the cpu affinity calls are GNU
+// extensions
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "async_log.h"
+#include "buffer_pool.h"
+#include "histogram.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "server_shm.h"
+#include "server_udp.h"
+#include "server_uring.h"
+#include "tcp_stats.h"
+#include "timestamping.h"
+#include "tls.h"
+#include "tsc.h"
+#include "zerocopy.h"
+
+#define ECHO_BUFFER_LEN 512
+#define HIGH_WATER_LEN (64 * 1024)
+#define LOW_WATER_LEN (16 * 1024)
+#define ZEROCOPY_THRESHOLD_LEN (16 * 1024)
+#define ZEROCOPY_RECEIVE_LEN (512 * 1024)
+#define MAX_EPOLL_EVENTS 256
+#define UDP_BATCH_LEN 32
+// connections that may sit in the SYN queue with a request of their own
+#define FASTOPEN_QUEUE_LEN 256
+// longer stages are recorded as this many ticks, about 10 s at 4 GHz
+#define STAGE_HISTOGRAM_MAX_TICKS (40ull * 1000 * 1000 * 1000)
+#define RECEIVE_QUEUE_HISTOGRAM_MAX_NS (10ull * 1000 * 1000 * 1000)
+#define NSEC_PER_USEC 1000.0
+// how long the listening socket is left alone when accepting runs out of
+// memory or descriptors
+#define ACCEPT_BACKOFF_MS 100
+
+/**
+ * @brief state kept for each connected client
+ *
+ * the buffer holds bytes that were received but not yet sent back:
+ *
+ *   0          sent_len         ready_len          buffer_len   buffer_cap
+ *   | echoed   | waiting to echo | partial frame    | free       |
+ *
+ * without framing every received byte is ready right away. with framing only
+ * whole frames are, and they are echoed straight out of the buffer they were
+ * received into. output the socket does not take right away stays queued in
+ * the buffer and the connection waits for EPOLLOUT while it keeps reading, so
+ * the buffer grows as needed. once the queued output reaches the high water
+ * mark the connection stops reading until the client has taken enough of it
+ * to drop below the low water mark, so a client that does not read its echoes
+ * costs a bounded amount of memory and never holds up anyone else.
+ *
+ * an idle connection holds no buffer at all. when data arrives it is read into
+ * the worker's scratch buffer and echoed from there, and only bytes that could
+ * not be echoed right away (unsent output or the start of a frame) are copied
+ * into a buffer from the worker's pool. that buffer goes back as soon as the
+ * connection has nothing left to echo.
+ *
+ * in splice mode the buffer is never used. received bytes are moved into a
+ * pipe and from the pipe back into the socket without ever being copied into
+ * user space, and the bytes sitting in the pipe are the queued output.
+ *
+ * with zerocopy sends the kernel keeps reading from the buffer after send()
+ * returns, so the buffer is pinned until the completion arrives. whenever a
+ * pinned buffer would be changed or given back it is retired instead: the
+ * bytes still needed move to a new buffer and the old one waits in the retired
+ * list until the kernel is done with it. closing the connection does not end
+ * that, TCP still sends the queued output from those pages, so a connection
+ * closed with retired buffers becomes an orphan: its socket stays open and
+ * in epoll for nothing but its error queue until the last completion.
+ *
+ * with zerocopy receive the socket's receive queue is mapped into a window
+ * instead of being copied. mapped bytes are echoed straight from the window
+ * while nothing else is queued, and only what the socket does not take is
+ * copied into a buffer.
+ *
+ * on a seqpacket socket every recv() returns one record and every send()
+ * makes one, so records are echoed one at a time and never merged. a record
+ * the client does not take right away is the whole queue: the connection
+ * stops reading until it has been sent.
+ *
+ * with TLS the connection starts out with a handshake in progress, driven by
+ * readiness like everything else. once it is done the kernel has the keys,
+ * the session is freed and from there on the connection is no different
+ * from a plain one.
+ */
+struct connection {
+  int sockfd;
+  int port;
+  uint32_t events;
+  struct connection* prev;
+  struct connection* next;
+  char* buffer;
+  size_t buffer_cap;
+  size_t buffer_len;
+  size_t ready_len;
+  size_t sent_len;
+  bool paused;
+  int pipe_fds[2];
+  size_t pipe_len;
+  bool pipe_full;
+  bool zerocopy;
+  bool zerocopy_pinned;
+  uint32_t zerocopy_pinned_id;
+  uint32_t zerocopy_next_id;
+  struct zerocopy_buffer* zerocopy_retired;
+  struct zerocopy_buffer* zerocopy_retired_tail;
+  char* receive_window;
+  struct tls_session* tls;
+  // closed, only waiting for its zerocopy completions
+  bool orphaned;
+  // the part of the worker's queued bytes gauge that is this connection's
+  size_t metrics_queued;
+  // when the oldest echo that is still being sent was ready, 0 for none
+  uint64_t ready_ticks;
+  // retransmitted segments as of the last TCP_INFO sample
+  uint32_t total_retrans;
+};
+
+/**
+ * @brief the kind of event loop that drives a worker
+ */
+enum backend {
+  BACKEND_EPOLL,
+  BACKEND_URING,
+};
+
+/**
+ * @brief the stages an echo goes through in the epoll backend
+ */
+enum stage {
+  // from the event loop getting to the readable event to the end of recv()
+  STAGE_RECEIVE,
+  // from the end of recv() until the response is ready to send
+  STAGE_PROCESS,
+  // from the response being ready until the last of it was sent
+  STAGE_SEND,
+  NUM_STAGES,
+};
+
+static const char* stage_names[NUM_STAGES] = {
+    "readable to received",
+    "received to response ready",
+    "response ready to sent",
+};
+
+/**
+ * @brief options shared by every worker
+ */
+struct server_options {
+  enum backend backend;
+  bool framed;
+  bool splice;
+  bool zerocopy;
+  size_t zerocopy_threshold;
+  bool zerocopy_receive;
+  bool sink;
+  // timestamp received segments to see how long they wait to be read
+  bool timestamps;
+  // sample TCP_INFO of every connection this often, 0 to never
+  int tcp_info_interval_ms;
+  bool udp;
+  int batch;
+  bool gso;
+  // listen on a unix domain socket at this path instead of a TCP port
+  const char* unix_path;
+  bool seqpacket;
+  // serve the lanes of a shared memory region by this name instead of sockets
+  const char* shm_name;
+  const char* tls_cert;
+  const char* tls_key;
+  // set when connections start with a TLS handshake
+  struct tls_context* tls;
+  size_t buffer_len;
+  size_t high_water;
+  size_t low_water;
+};
+
+/**
+ * @brief one listening socket and the event loop that serves it
+ *
+ * with SO_REUSEPORT every worker binds its own listener to the same port and
+ * the kernel spreads incoming connections across them, so workers never share
+ * an accept queue or any connection state.
+ */
+struct worker {
+  int index;
+  const struct server_options* options;
+  int server_sockfd;
+  int stop_fd;
+  int epollfd;
+  pthread_t thread;
+  // written by this worker only, read by the metrics thread
+  struct worker_metrics* metrics;
+  int ret;
+  struct connection* connections;
+  // closed connections whose zerocopy buffers the kernel still sends from
+  struct connection* orphans;
+  // given up for a moment to turn away clients when out of descriptors
+  int reserve_fd;
+  // fires once the backoff after a failed accept is over, -1 if not created
+  int accept_timerfd;
+  struct buffer_pool pool;
+  char* scratch;
+  size_t scratch_len;
+  uint64_t pauses;
+  uint64_t bytes_echoed;
+  uint64_t zerocopy_sends;
+  uint64_t zerocopy_copied;
+  uint64_t bytes_mapped;
+  uint64_t bytes_copied;
+  uint64_t tls_sessions;
+  uint64_t cpu_ns;
+  // how long echoes spend in each stage, in ticks of tsc_now()
+  struct histogram stage_latency[NUM_STAGES];
+  struct tsc_calibration clock;
+  // when the event loop got to the event being handled
+  uint64_t event_ticks;
+  // from the kernel timestamping a segment to recv() handing it over, in
+  // nanoseconds of CLOCK_REALTIME
+  struct histogram receive_queue;
+  // fires every tcp_info_interval_ms, -1 without sampling
+  int tcp_info_timerfd;
+  struct tcp_stats tcp_stats;
+  struct udp_stats udp_stats;
+  struct shm_lane* shm_lane;
+  struct shm_stats shm_stats;
+};
+
+// marks the stop eventfd and the timers in epoll, the listening socket is
+// marked with NULL
+static char stop_event_marker;
+static char tcp_info_event_marker;
+static char accept_event_marker;
+
 static int show_usage(char* progname);
 static int start_server(
-    char* hostname, int port_number, int listen_backlog,
+    char* hostname, int port_number, int listen_backlog, bool reuse_port,
+    bool udp, int* listening_sockfd_out);
+static int start_unix_server(
+    const char* path, bool seqpacket, int listen_backlog,
     int* listening_sockfd_out);
 static int stop_server(int server_socketfd);
+static void* run_worker(void* arg);
+static int run_event_loop(struct worker* worker);
+static int watch_listener(struct worker* worker);
+static int accept_connections(struct worker* worker);
+static void discard_connection(struct connection* conn);
+static int reject_client(struct worker* worker);
+static int pause_accepting(struct worker* worker);
+static int resume_accepting(struct worker* worker);
+static int continue_handshake(struct worker* worker, struct connection* conn);
+static int handle_readable(struct worker* worker, struct connection* conn);
+static int handle_writable(struct worker* worker, struct connection* conn);
+static int seqpacket_readable(struct worker* worker, struct connection* conn);
+static int parse_frames(struct connection* conn);
+static int compact_buffer(struct worker* worker, struct connection* conn);
+static int handle_zerocopy_completions(
+    struct worker* worker, struct connection* conn);
+static int receive_mapped(struct worker* worker, struct connection* conn);
+static int consume_received(
+    struct worker* worker, struct connection* conn, const char* data,
+    size_t len);
+static ssize_t receive_timestamped(
+    struct worker* worker, struct connection* conn, char* buffer,
+    size_t len);
+static int open_pipe(struct worker* worker, struct connection* conn);
+static int splice_readable(struct worker* worker, struct connection* conn);
+static int splice_writable(struct worker* worker, struct connection* conn);
+static size_t queued_len(const struct connection* conn);
+static int update_events(struct worker* worker, struct connection* conn);
+static int start_tcp_info_timer(struct worker* worker);
+static void sample_tcp_info(struct worker* worker);
+static int reserve_buffer(
+    struct worker* worker, struct connection* conn, size_t min_size);
+static void release_buffer(struct worker* worker, struct connection* conn);
+static void drop_buffer(struct worker* worker, struct connection* conn);
+static void free_retired_buffers(
+    struct worker* worker, struct connection* conn, bool all,
+    uint32_t completed);
+static int detach_scratch(struct worker* worker, struct connection* conn);
+static void close_connection(struct worker* worker, struct connection* conn);
+static void orphan_connection(struct worker* worker, struct connection* conn);
+static void free_orphan(
+    struct worker* worker, struct connection* conn, bool discard);
+static void print_worker_stats(struct worker* worker);
 
 int main(int argc, char* argv[]) {
   // set some initial values
   int ret = 0;
   char* hostname = "localhost";
   int port_number = -1;
+  int num_workers = 1;
+  int metrics_port = 0;
+  struct server_options options = {
+      .backend = BACKEND_EPOLL,
+      .framed = false,
+      .buffer_len = ECHO_BUFFER_LEN,
+      .high_water = HIGH_WATER_LEN,
+      .low_water = LOW_WATER_LEN,
+      .zerocopy_threshold = ZEROCOPY_THRESHOLD_LEN,
+      .batch = UDP_BATCH_LEN,
+  };
 
   // parse arguments
   // - the supplied arguments always begins with the name of the program
@@ -61,91 +387,460 @@ int main(int argc, char* argv[]) {
     if (strcmp(arg, "--hostname") == 0) {
       idx++;
       hostname = argv[idx];
+    } else if (strcmp(arg, "--workers") == 0) {
+      idx++;
+      num_workers = atoi(argv[idx]);
+    } else if (strcmp(arg, "--backend") == 0) {
+      idx++;
+      if ((idx < argc) && (strcmp(argv[idx], "epoll") == 0)) {
+        options.backend = BACKEND_EPOLL;
+      } else if ((idx < argc) && (strcmp(argv[idx], "uring") == 0)) {
+        options.backend = BACKEND_URING;
+      } else {
+        fprintf(stderr, "ERROR: unknown backend\n");
+        show_usage(progname);
+        return 1;
+      }
+    } else if (strcmp(arg, "--framed") == 0) {
+      options.framed = true;
+    } else if (strcmp(arg, "--splice") == 0) {
+      options.splice = true;
+    } else if (strcmp(arg, "--zerocopy") == 0) {
+      options.zerocopy = true;
+    } else if (strcmp(arg, "--zerocopy-threshold") == 0) {
+      idx++;
+      options.zerocopy_threshold = atoi(argv[idx]);
+    } else if (strcmp(arg, "--zerocopy-receive") == 0) {
+      options.zerocopy_receive = true;
+    } else if (strcmp(arg, "--sink") == 0) {
+      options.sink = true;
+    } else if (strcmp(arg, "--timestamps") == 0) {
+      options.timestamps = true;
+    } else if (strcmp(arg, "--tcp-info") == 0) {
+      idx++;
+      options.tcp_info_interval_ms = atoi(argv[idx]);
+    } else if (strcmp(arg, "--udp") == 0) {
+      options.udp = true;
+    } else if (strcmp(arg, "--batch") == 0) {
+      idx++;
+      options.batch = atoi(argv[idx]);
+    } else if (strcmp(arg, "--gso") == 0) {
+      options.gso = true;
+    } else if (strcmp(arg, "--unix") == 0) {
+      idx++;
+      options.unix_path = argv[idx];
+    } else if (strcmp(arg, "--seqpacket") == 0) {
+      options.seqpacket = true;
+    } else if (strcmp(arg, "--shm") == 0) {
+      idx++;
+      options.shm_name = argv[idx];
+    } else if (strcmp(arg, "--tls-cert") == 0) {
+      idx++;
+      options.tls_cert = argv[idx];
+    } else if (strcmp(arg, "--tls-key") == 0) {
+      idx++;
+      options.tls_key = argv[idx];
+    } else if (strcmp(arg, "--metrics-port") == 0) {
+      idx++;
+      metrics_port = atoi(argv[idx]);
+    } else if (strcmp(arg, "--buffer-size") == 0) {
+      idx++;
+      options.buffer_len = atoi(argv[idx]);
+    } else if (strcmp(arg, "--high-water") == 0) {
+      idx++;
+      options.high_water = atoi(argv[idx]);
+    } else if (strcmp(arg, "--low-water") == 0) {
+      idx++;
+      options.low_water = atoi(argv[idx]);
     } else {
       port_number = atoi(arg);
     }
   }
 
   // validate arguments
-  if (port_number <= 0) {
+  if ((port_number <= 0) && (NULL == options.unix_path) &&
+      (NULL == options.shm_name)) {
     fprintf(stderr, "ERROR: invalid port number: %d\n", port_number);
     show_usage(progname);
     return 1;
   }
+  if (num_workers <= 0) {
+    fprintf(stderr, "ERROR: invalid number of workers: %d\n", num_workers);
+    show_usage(progname);
+    return 1;
+  }
+  if (((int)options.buffer_len <= 0) ||
+      (options.buffer_len > BUFFER_POOL_MAX_SIZE)) {
+    fprintf(stderr, "ERROR: invalid buffer size\n");
+    show_usage(progname);
+    return 1;
+  }
+  // a queue just below the high water mark plus the largest frame has to fit
+  // into the largest pool buffer
+  if (((int)options.high_water <= 0) ||
+      (options.high_water > (BUFFER_POOL_MAX_SIZE / 4)) ||
+      ((int)options.low_water < 0) ||
+      (options.low_water >= options.high_water)) {
+    fprintf(stderr, "ERROR: invalid water marks\n");
+    show_usage(progname);
+    return 1;
+  }
+  if (options.framed && (BACKEND_EPOLL != options.backend)) {
+    fprintf(stderr, "ERROR: --framed is only supported by the epoll backend\n");
+    show_usage(progname);
+    return 1;
+  }
+  if (options.splice &&
+      ((BACKEND_EPOLL != options.backend) || options.framed)) {
+    fprintf(
+        stderr,
+        "ERROR: --splice is only supported by the epoll backend without "
+        "--framed\n");
+    show_usage(progname);
+    return 1;
+  }
+  if (options.zerocopy &&
+      ((BACKEND_EPOLL != options.backend) || options.splice)) {
+    fprintf(
+        stderr,
+        "ERROR: --zerocopy is only supported by the epoll backend without "
+        "--splice\n");
+    show_usage(progname);
+    return 1;
+  }
+  if (options.zerocopy_receive &&
+      ((BACKEND_EPOLL != options.backend) || options.splice ||
+       options.framed)) {
+    fprintf(
+        stderr,
+        "ERROR: --zerocopy-receive is only supported by the epoll backend "
+        "without --splice or --framed\n");
+    show_usage(progname);
+    return 1;
+  }
+  if (options.sink && ((BACKEND_EPOLL != options.backend) || options.splice)) {
+    fprintf(
+        stderr,
+        "ERROR: --sink is only supported by the epoll backend without "
+        "--splice\n");
+    show_usage(progname);
+    return 1;
+  }
+  if (options.timestamps &&
+      ((BACKEND_EPOLL != options.backend) || options.splice ||
+       options.zerocopy_receive || options.udp ||
+       (NULL != options.unix_path) || (NULL != options.shm_name) ||
+       (NULL != options.tls_cert))) {
+    fprintf(
+        stderr,
+        "ERROR: --timestamps needs the epoll backend over TCP, not with "
+        "--splice, --zerocopy-receive or TLS\n");
+    show_usage(progname);
+    return 1;
+  }
+  if ((options.tcp_info_interval_ms < 0) ||
+      ((options.tcp_info_interval_ms > 0) &&
+       ((BACKEND_EPOLL != options.backend) || options.udp ||
+        (NULL != options.unix_path) || (NULL != options.shm_name)))) {
+    fprintf(
+        stderr,
+        "ERROR: --tcp-info needs a positive interval, the epoll backend and "
+        "TCP\n");
+    show_usage(progname);
+    return 1;
+  }
+  if ((int)options.zerocopy_threshold <= 0) {
+    fprintf(stderr, "ERROR: invalid zerocopy threshold\n");
+    show_usage(progname);
+    return 1;
+  }
+  if (options.udp &&
+      ((BACKEND_EPOLL != options.backend) || options.framed ||
+       options.splice || options.zerocopy || options.zerocopy_receive)) {
+    fprintf(
+        stderr,
+        "ERROR: --udp does not go with --backend, --framed, --splice, "
+        "--zerocopy or --zerocopy-receive\n");
+    show_usage(progname);
+    return 1;
+  }
+  if (options.gso && !options.udp) {
+    fprintf(stderr, "ERROR: --gso needs --udp\n");
+    show_usage(progname);
+    return 1;
+  }
+  if ((options.batch <= 0) || (options.batch > UDP_MAX_BATCH)) {
+    fprintf(stderr, "ERROR: invalid batch size\n");
+    show_usage(progname);
+    return 1;
+  }
+  if ((NULL != options.unix_path) &&
+      (options.udp || options.zerocopy || options.zerocopy_receive)) {
+    fprintf(
+        stderr,
+        "ERROR: --unix does not go with --udp, --zerocopy or "
+        "--zerocopy-receive\n");
+    show_usage(progname);
+    return 1;
+  }
+  if (options.seqpacket &&
+      ((NULL == options.unix_path) || (BACKEND_EPOLL != options.backend) ||
+       options.framed || options.splice)) {
+    fprintf(
+        stderr,
+        "ERROR: --seqpacket needs --unix and the epoll backend, not with "
+        "--framed or --splice\n");
+    show_usage(progname);
+    return 1;
+  }
+  if ((NULL != options.shm_name) &&
+      ((BACKEND_EPOLL != options.backend) || options.framed ||
+       options.splice || options.zerocopy || options.zerocopy_receive ||
+       options.sink || options.udp || (NULL != options.unix_path))) {
+    fprintf(
+        stderr,
+        "ERROR: --shm does not go with --backend, --framed, --splice, "
+        "--zerocopy, --zerocopy-receive, --sink, --udp or --unix\n");
+    show_usage(progname);
+    return 1;
+  }
+  if ((NULL == options.tls_cert) != (NULL == options.tls_key)) {
+    fprintf(stderr, "ERROR: --tls-cert and --tls-key go together\n");
+    show_usage(progname);
+    return 1;
+  }
+  if ((NULL != options.tls_cert) &&
+      ((BACKEND_EPOLL != options.backend) || options.udp || options.zerocopy ||
+       options.zerocopy_receive || (NULL != options.unix_path) ||
+       (NULL != options.shm_name))) {
+    fprintf(
+        stderr,
+        "ERROR: TLS needs the epoll backend and TCP, not with --zerocopy or "
+        "--zerocopy-receive\n");
+    show_usage(progname);
+    return 1;
+  }
+  if ((metrics_port < 0) ||
+      ((metrics_port > 0) &&
+       ((BACKEND_EPOLL != options.backend) || options.udp ||
+        (NULL != options.shm_name)))) {
+    fprintf(
+        stderr,
+        "ERROR: --metrics-port needs the epoll backend over TCP or a unix "
+        "socket\n");
+    show_usage(progname);
+    return 1;
+  }
+  if ((NULL != options.shm_name) && (num_workers > SHM_MAX_LANES)) {
+    fprintf(
+        stderr, "ERROR: --shm supports at most %d workers\n", SHM_MAX_LANES);
+    show_usage(progname);
+    return 1;
+  }
 
   // show the user the values of their arguments
-  printf("Starting server at %s:%d\n", hostname, port_number);
+  const char* loop_name =
+      (BACKEND_URING == options.backend) ? "io_uring" : "epoll";
+  if (options.udp) {
+    loop_name = "udp";
+  } else if (NULL != options.shm_name) {
+    loop_name = "shared memory";
+  }
+  char address[128];
+  if (NULL != options.shm_name) {
+    snprintf(address, sizeof(address), "%s (shared memory)", options.shm_name);
+  } else if (NULL != options.unix_path) {
+    snprintf(
+        address, sizeof(address), "%s (unix %s)", options.unix_path,
+        options.seqpacket ? "seqpacket" : "stream");
+  } else {
+    snprintf(address, sizeof(address), "%s:%d", hostname, port_number);
+  }
+  printf(
+      "Starting server at %s with %d %s worker(s)%s%s%s%s%s%s%s%s\n",
+      address, num_workers, loop_name,
+      options.framed ? ", framed" : "", options.splice ? ", splice" : "",
+      options.zerocopy ? ", zerocopy" : "",
+      options.zerocopy_receive ? ", zerocopy receive" : "",
+      options.sink ? ", sink" : "", options.gso ? ", gso" : "",
+      (NULL != options.tls_cert) ? ", tls" : "",
+      options.timestamps ? ", timestamps" : "");
 
-  // start the server
-  // stop_server should be called upon exit after start_server was successfully
-  int server_sockfd;
-  ret = start_server(hostname, port_number, 5, &server_sockfd);
-  if (0 != ret) {
-    fprintf(stderr, "ERROR: failed to start server\n");
+  // every worker starts its sessions from the same context
+  if ((NULL != options.tls_cert) &&
+      (0 != tls_context_create_server(
+                options.tls_cert, options.tls_key, &options.tls))) {
     return 1;
   }
 
-  // sit there and accept connections
-  // for simplicity this will accept one connection at a time, but a
-  // production server would likely accept and manage many simultaneous
-  // connections
-  for (;;) {
-    struct sockaddr_in client_addr;
-    int client_addr_len = sizeof(client_addr);
-    int client_sockfd;
+  // the workers log connection events into rings of their own, a background
+  // thread writes them out so that the event loops never wait on stdio
+  if (0 != async_log_start()) {
+    ret = 1;
+    goto free_tls;
+  }
 
-    // accept the next client
-    // depending on conditions one of two things happens:
-    // - when there is a pending request (up to the listen backlog amount,
-    // handled
-    //   by the OS) the next pending connection is returned immediately
-    // - if there are no pending requests then accept() will block until one is
-    // ready
-    client_sockfd =
-        accept(server_sockfd, (struct sockaddr*)&client_addr, &client_addr_len);
-    if (client_sockfd < 0) {
-      fprintf(stderr, "ERROR: failed to accept the client\n");
+  // the counters are kept whether or not anyone scrapes them, so the event
+  // loop never has to check
+  struct worker* workers = calloc(num_workers, sizeof(*workers));
+  struct worker_metrics* metrics = calloc(num_workers, sizeof(*metrics));
+  if ((NULL == workers) || (NULL == metrics)) {
+    fprintf(stderr, "ERROR: failed to allocate workers\n");
+    free(workers);
+    free(metrics);
+    ret = 1;
+    goto free_tls;
+  }
+
+  // SIGINT and SIGTERM are blocked in every thread (the mask is inherited by
+  // the workers) and picked up by sigwait() on the main thread, which then
+  // wakes every worker through the stop eventfd
+  sigset_t stop_signals;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+  int stop_fd = eventfd(0, EFD_NONBLOCK);
+  if (stop_fd < 0) {
+    fprintf(stderr, "ERROR: failed to create the stop eventfd\n");
+    free(workers);
+    free(metrics);
+    ret = 1;
+    goto free_tls;
+  }
+
+  // a shared memory server has no sockets at all, every worker serves one
+  // lane of the region instead
+  struct shm_region* shm_region = NULL;
+  size_t shm_region_len = 0;
+  if (NULL != options.shm_name) {
+    ret = shm_region_create(
+        options.shm_name, num_workers, &shm_region, &shm_region_len);
+    if (0 != ret) {
+      close(stop_fd);
+      free(workers);
+      free(metrics);
+      ret = 1;
+      goto free_tls;
+    }
+  }
+
+  // start the server
+  // every worker gets its own listening socket. SO_REUSEPORT is only needed
+  // when more than one socket shares the port. a unix domain socket cannot
+  // be shared that way, so all workers accept from the same one instead
+  // stop_server should be called upon exit for each started worker
+  int num_started = 0;
+  for (; num_started < num_workers; num_started++) {
+    struct worker* worker = &workers[num_started];
+    worker->index = num_started;
+    worker->options = &options;
+    worker->stop_fd = stop_fd;
+    worker->metrics = &metrics[num_started];
+    worker->metrics->listen_sockfd = -1;
+    if (NULL != shm_region) {
+      worker->shm_lane = &shm_region->lanes[num_started];
+      worker->server_sockfd = -1;
+      continue;
+    }
+    if ((NULL != options.unix_path) && (num_started > 0)) {
+      worker->server_sockfd = workers[0].server_sockfd;
+      continue;
+    }
+    if (NULL != options.unix_path) {
+      ret = start_unix_server(
+          options.unix_path, options.seqpacket, SOMAXCONN,
+          &worker->server_sockfd);
+    } else {
+      ret = start_server(
+          hostname, port_number, SOMAXCONN, (num_workers > 1), options.udp,
+          &worker->server_sockfd);
+    }
+    if (0 != ret) {
+      fprintf(stderr, "ERROR: failed to start server\n");
       ret = 1;
       goto cleanup;
     }
-    printf(
-        "connected to client: %d (%d)\n", client_sockfd, client_addr.sin_port);
-
-    // now that a client is connected perform simple echoing
-    const size_t echo_buffer_len = 512;
-    char echo_buffer[echo_buffer_len];
-    while (true) {
-      // read characters from the client
-      int chars_received = recv(client_sockfd, echo_buffer, echo_buffer_len, 0);
-      if (0 == chars_received) {
-        printf("connection to client closed.\nwaiting for next connection.\n");
-        break;
-      } else if (chars_received < 0) {
-        fprintf(
-            stderr,
-            "ERROR: failed to receive characters from the client. (%d)\n",
-            chars_received);
-        ret = 1;
-        goto cleanup;
-      }
+    if ((NULL == options.unix_path) && !options.udp) {
+      worker->metrics->listen_sockfd = worker->server_sockfd;
+    }
+  }
 
-      // send those characters right back to the client
-      int chars_sent = send(client_sockfd, echo_buffer, chars_received, 0);
-      if (chars_sent < 0) {
-        fprintf(stderr, "ERROR: failed send characters back to client.\n");
-        ret = 1;
-        goto cleanup;
-      }
+  // the metrics thread sums up the workers' counters whenever it is scraped
+  // and stops along with the workers
+  struct metrics_server metrics_server;
+  if ((metrics_port > 0) &&
+      (0 != metrics_server_start(
+                &metrics_server, metrics_port, metrics, num_workers,
+                stop_fd))) {
+    ret = 1;
+    goto cleanup;
+  }
+
+  // each worker gets a thread of its own
+  // the event loops return when they are asked to stop or if something goes
+  // wrong with their listening socket or with epoll itself, errors on
+  // individual clients just close that client
+  int num_running = 0;
+  for (; num_running < num_workers; num_running++) {
+    struct worker* worker = &workers[num_running];
+    if (0 != pthread_create(&worker->thread, NULL, run_worker, worker)) {
+      fprintf(stderr, "ERROR: failed to start worker %d\n", num_running);
+      ret = 1;
+      break;
+    }
+  }
+
+  // wait for a reason to stop, then stop every worker
+  if (num_running == num_workers) {
+    int signal_number;
+    sigwait(&stop_signals, &signal_number);
+    printf("stopping server.\n");
+  }
+  eventfd_write(stop_fd, 1);
+  for (int idx = 0; (NULL != shm_region) && (idx < num_workers); idx++) {
+    shm_doorbell_wake(&shm_region->lanes[idx].server_bell);
+  }
+
+  if (metrics_port > 0) {
+    metrics_server_stop(&metrics_server);
+  }
+  for (int idx = 0; idx < num_running; idx++) {
+    pthread_join(workers[idx].thread, NULL);
+    if (0 != workers[idx].ret) {
+      ret = 1;
     }
   }
 
-  // indicate success by default
-  // if something goes to cleanup explicitly then ret may be nonzero
-  ret = 0;
+  // whatever the workers logged comes out before their stats
+  async_log_stop();
+  for (int idx = 0; idx < num_running; idx++) {
+    print_worker_stats(&workers[idx]);
+  }
 
 cleanup:
-  stop_server(server_sockfd);
+  for (int idx = 0; (NULL == shm_region) && (idx < num_started); idx++) {
+    if ((NULL == options.unix_path) || (0 == idx)) {
+      stop_server(workers[idx].server_sockfd);
+    }
+  }
+  if ((NULL != options.unix_path) && (num_started > 0)) {
+    unlink(options.unix_path);
+  }
+  if (NULL != shm_region) {
+    shm_region_close(shm_region, shm_region_len);
+    shm_unlink(options.shm_name);
+  }
+  close(stop_fd);
+  free(workers);
+  free(metrics);
 
+free_tls:
+  async_log_stop();
+  if (NULL != options.tls) {
+    tls_context_destroy(options.tls);
+  }
   return ret;
 }
 
@@ -155,7 +850,55 @@ static int show_usage(char* progname) {
   printf(
       "Usage: %s [options] <listening port number>\n"
       "Options:\n"
-      "--hostname <hostname>: the hostname to use, defualts to \"localhost\"\n",
+      "--hostname <hostname>: the hostname to use, defualts to \"localhost\"\n"
+      "--workers <count>: number of listeners and event loop threads sharing "
+      "the port, defaults to 1\n"
+      "--backend <epoll|uring>: the event loop used by each worker, defaults "
+      "to epoll\n"
+      "--framed: echo length-prefixed frames (see protocol.h) instead of raw "
+      "bytes\n"
+      "--splice: echo through a pipe with splice() so the data never enters "
+      "user space (epoll backend, not with --framed)\n"
+      "--zerocopy: send large echoes with MSG_ZEROCOPY (epoll backend, not "
+      "with --splice)\n"
+      "--zerocopy-threshold <bytes>: smaller echoes are copied as usual, "
+      "defaults to 16384\n"
+      "--zerocopy-receive: map received pages with TCP_ZEROCOPY_RECEIVE "
+      "instead of copying them, experimental (epoll backend, not with "
+      "--splice or --framed)\n"
+      "--sink: discard everything received instead of echoing it (epoll "
+      "backend, not with --splice)\n"
+      "--timestamps: have the kernel timestamp received segments and report "
+      "how long they waited in the socket before being read (epoll backend "
+      "over TCP, not with --splice, --zerocopy-receive or TLS)\n"
+      "--tcp-info <ms>: sample TCP_INFO of every connection this often and "
+      "report the round trip times, congestion windows, delivery rates and "
+      "retransmits (epoll backend over TCP)\n"
+      "--udp: echo UDP datagrams instead of TCP streams, not with --backend, "
+      "--framed, --splice or --zerocopy\n"
+      "--batch <count>: datagrams received and sent per syscall with --udp, "
+      "at most 1024, defaults to 32\n"
+      "--gso: with --udp, receive datagrams coalesced with UDP_GRO and echo "
+      "them with UDP_SEGMENT\n"
+      "--unix <path>: listen on a unix domain socket instead of a TCP port, "
+      "not with --udp or --zerocopy\n"
+      "--seqpacket: with --unix, echo SOCK_SEQPACKET records one by one, "
+      "each at most --buffer-size bytes (epoll backend, not with --framed or "
+      "--splice)\n"
+      "--shm <name>: serve clients on this machine through the shared memory "
+      "object <name>, one client per worker, instead of a port\n"
+      "--tls-cert <file>, --tls-key <file>: start every connection with a TLS "
+      "handshake using this PEM certificate and key, then leave the records "
+      "to kernel TLS (epoll backend, not with --zerocopy)\n"
+      "--metrics-port <port>: serve the workers' counters in the Prometheus "
+      "text format at http://<host>:<port>/metrics (epoll backend, not with "
+      "--udp or --shm)\n"
+      "--buffer-size <bytes>: receive buffer of each connection (epoll "
+      "backend), at most 2 MiB, defaults to 512\n"
+      "--high-water <bytes>: stop reading from a client once this much of its "
+      "output is queued, at most 512 KiB, defaults to 65536\n"
+      "--low-water <bytes>: resume reading once the queued output drops to "
+      "this, defaults to 16384\n",
       progname);
 
 out:
@@ -170,26 +913,55 @@ out:
  * @param port_number the port at which the listening socket will be opened.
  * this is the port number that clients will specify to establish a connection
  * @param listen_backlog the back
+ * @param reuse_port set SO_REUSEPORT so that several listening sockets can be
+ * bound to the same port
+ * @param udp open a bound UDP socket instead of a listening TCP socket. a TCP
+ * socket accepts TCP Fast Open, so a returning client can put its first
+ * request in the SYN
  * @param listening_sockfd_out this is an output that gives access to the file
  * descriptor of the opened socket.
  * @return int
  */
 static int start_server(
-    char* hostname, int port_number, int listen_backlog,
-    int* listening_sockfd_out) {
+    char* hostname, int port_number, int listen_backlog, bool reuse_port,
+    bool udp, int* listening_sockfd_out) {
   // https://blog.stephencleary.com/2009/05/using-socket-as-server-listening-socket.html
   int ret = 0;
 
   // construct the listening socket
   // the server will establish a *listening* socket - this socket is only used
   // to listen for incoming connections
-  int server_sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  // the socket is non-blocking so that accept() can be drained from the event
+  // loop until it reports EAGAIN without ever stalling the other clients
+  // a UDP socket is never listening, the bound socket itself receives (and
+  // answers) every datagram
+  int server_sockfd =
+      socket(AF_INET, (udp ? SOCK_DGRAM : SOCK_STREAM) | SOCK_NONBLOCK, 0);
   if (server_sockfd < 0) {
     fprintf(stderr, "ERROR opening listening socket\n");
     ret = 1;
     goto out;
   }
 
+  // allow quick restarts while old connections linger in TIME_WAIT
+  int reuse = 1;
+  ret = setsockopt(
+      server_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if (ret < 0) {
+    fprintf(stderr, "ERROR setting SO_REUSEADDR on listening socket\n");
+    goto out;
+  }
+
+  // let the kernel load balance connections between several listeners
+  if (reuse_port) {
+    ret = setsockopt(
+        server_sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    if (ret < 0) {
+      fprintf(stderr, "ERROR setting SO_REUSEPORT on listening socket\n");
+      goto out;
+    }
+  }
+
   // bind the listening socket
   // binding on a listening socket is usually only done on the port with
   // the IP address set to "any" (??? is this to allow any IP address to
@@ -205,11 +977,31 @@ static int start_server(
     goto out;
   }
 
+  // accept data in the SYN from clients that hold a cookie from an earlier
+  // connection, which saves a connection-per-request client a round trip.
+  // the kernel only honours it with the server bit (2) of
+  // net.ipv4.tcp_fastopen set. a SYN may be replayed by the network, which is
+  // harmless here since an echo has no side effects. it only saves a round
+  // trip, so without it the server simply serves every client the usual way
+  if (!udp) {
+    int queue_len = FASTOPEN_QUEUE_LEN;
+    if (0 != setsockopt(
+                 server_sockfd, IPPROTO_TCP, TCP_FASTOPEN, &queue_len,
+                 sizeof(queue_len))) {
+      fprintf(
+          stderr,
+          "ERROR setting TCP_FASTOPEN on listening socket, serving without "
+          "it\n");
+    }
+  }
+
   // start listening on the socket
   // this makes the port available for clients to try to establish a connection
   // "the listening socket actually begins listening at this point. it is not
   // yet accepting connections but the OS may accept connections on its behalf."
-  ret = listen(server_sockfd, listen_backlog);
+  if (!udp) {
+    ret = listen(server_sockfd, listen_backlog);
+  }
   if (0 != ret) {
     fprintf(stderr, "ERROR listening on the socket\n");
     goto out;
@@ -223,6 +1015,62 @@ out:
   return ret;
 }
 
+/**
+ * @brief starts a server on a unix domain socket
+ *
+ * a file left behind at the path by an earlier run is removed first.
+ *
+ * @param path where to create the socket
+ * @param seqpacket make it a SOCK_SEQPACKET socket instead of SOCK_STREAM
+ * @param listen_backlog the backlog of the listening socket
+ * @param listening_sockfd_out the file descriptor of the opened socket
+ * @return int nonzero if the socket could not be opened
+ */
+static int start_unix_server(
+    const char* path, bool seqpacket, int listen_backlog,
+    int* listening_sockfd_out) {
+  int ret = 0;
+
+  struct sockaddr_un serv_addr;
+  bzero((char*)&serv_addr, sizeof(serv_addr));
+  serv_addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(serv_addr.sun_path)) {
+    fprintf(stderr, "ERROR: unix socket path is too long\n");
+    ret = 1;
+    goto out;
+  }
+  strcpy(serv_addr.sun_path, path);
+
+  int server_sockfd = socket(
+      AF_UNIX, (seqpacket ? SOCK_SEQPACKET : SOCK_STREAM) | SOCK_NONBLOCK, 0);
+  if (server_sockfd < 0) {
+    fprintf(stderr, "ERROR opening listening socket\n");
+    ret = 1;
+    goto out;
+  }
+
+  unlink(path);
+  ret = bind(server_sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr));
+  if (ret < 0) {
+    fprintf(stderr, "ERROR on binding listening socket\n");
+    close(server_sockfd);
+    goto out;
+  }
+
+  ret = listen(server_sockfd, listen_backlog);
+  if (0 != ret) {
+    fprintf(stderr, "ERROR listening on the socket\n");
+    close(server_sockfd);
+    unlink(path);
+    goto out;
+  }
+
+  *listening_sockfd_out = server_sockfd;
+
+out:
+  return ret;
+}
+
 /**
  * @brief Stop
  *
@@ -237,3 +1085,1745 @@ static int stop_server(int server_sockfd) {
 out:
   return ret;
 }
+
+/**
+ * @brief entry point of a worker thread
+ *
+ * pins the worker to a core (best effort) and runs its event loop. the result
+ * of the event loop is left in the worker for main() to collect.
+ *
+ * @param arg the struct worker to run
+ * @return void* always NULL
+ */
+static void* run_worker(void* arg) {
+  struct worker* worker = arg;
+
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_cpus > 1) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->index % num_cpus, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+
+  if (NULL != worker->shm_lane) {
+    worker->ret =
+        run_shm_loop(worker->shm_lane, worker->stop_fd, &worker->shm_stats);
+  } else if (worker->options->udp) {
+    struct udp_options udp_options = {
+        .batch = worker->options->batch,
+        .sink = worker->options->sink,
+        .gso = worker->options->gso,
+    };
+    worker->ret = run_udp_loop(
+        worker->server_sockfd, worker->stop_fd, &udp_options,
+        &worker->udp_stats);
+  } else if (BACKEND_URING == worker->options->backend) {
+    worker->ret = run_uring_loop(
+        worker->server_sockfd, worker->stop_fd, worker->options->high_water,
+        worker->options->low_water);
+  } else {
+    worker->ret = run_event_loop(worker);
+  }
+
+  struct timespec cpu_time;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_time);
+  worker->cpu_ns = (uint64_t)cpu_time.tv_sec * 1000000000 + cpu_time.tv_nsec;
+
+  // a worker that failed takes the whole server down with it
+  if (0 != worker->ret) {
+    kill(getpid(), SIGTERM);
+  }
+  return NULL;
+}
+
+/**
+ * @brief runs the epoll event loop
+ *
+ * the listening socket, the stop eventfd and every client socket are
+ * registered with a single epoll instance. the listening socket is identified
+ * by a NULL data pointer and the stop eventfd by the stop marker, every other
+ * registration points at its struct connection.
+ *
+ * @param worker the worker whose non-blocking listening socket to serve
+ * @return int nonzero if the loop had to stop
+ */
+static int run_event_loop(struct worker* worker) {
+  int ret = 0;
+  struct epoll_event events[MAX_EPOLL_EVENTS];
+
+  buffer_pool_init(&worker->pool);
+  for (int stage = 0; stage < NUM_STAGES; stage++) {
+    if (0 != histogram_init(
+                 &worker->stage_latency[stage], STAGE_HISTOGRAM_MAX_TICKS)) {
+      fprintf(stderr, "ERROR: failed to allocate latency histograms\n");
+      ret = 1;
+      goto out;
+    }
+  }
+  if (worker->options->timestamps &&
+      (0 != histogram_init(
+                &worker->receive_queue, RECEIVE_QUEUE_HISTOGRAM_MAX_NS))) {
+    fprintf(stderr, "ERROR: failed to allocate latency histograms\n");
+    ret = 1;
+    goto out;
+  }
+  worker->tcp_info_timerfd = -1;
+  worker->reserve_fd = -1;
+  worker->accept_timerfd = -1;
+  if ((worker->options->tcp_info_interval_ms > 0) &&
+      (0 != tcp_stats_init(&worker->tcp_stats))) {
+    fprintf(stderr, "ERROR: failed to allocate TCP_INFO histograms\n");
+    ret = 1;
+    goto out;
+  }
+  tsc_calibration_start(&worker->clock);
+  worker->connections = NULL;
+  worker->scratch_len = worker->options->buffer_len;
+  worker->scratch = malloc(worker->scratch_len);
+  if (NULL == worker->scratch) {
+    fprintf(stderr, "ERROR: failed to allocate the scratch buffer\n");
+    ret = 1;
+    goto out;
+  }
+  worker->epollfd = epoll_create1(0);
+  if (worker->epollfd < 0) {
+    fprintf(stderr, "ERROR creating epoll instance\n");
+    ret = 1;
+    goto out;
+  }
+
+  ret = watch_listener(worker);
+  if (0 != ret) {
+    fprintf(stderr, "ERROR adding listening socket to epoll\n");
+    ret = 1;
+    goto cleanup;
+  }
+
+  worker->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  worker->accept_timerfd =
+      timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  struct epoll_event accept_event = {
+      .events = EPOLLIN,
+      .data.ptr = &accept_event_marker,
+  };
+  if ((worker->reserve_fd < 0) || (worker->accept_timerfd < 0) ||
+      (0 != epoll_ctl(
+                worker->epollfd, EPOLL_CTL_ADD, worker->accept_timerfd,
+                &accept_event))) {
+    fprintf(stderr, "ERROR setting up the accept backoff\n");
+    ret = 1;
+    goto cleanup;
+  }
+
+  struct epoll_event stop_event = {
+      .events = EPOLLIN,
+      .data.ptr = &stop_event_marker,
+  };
+  ret = epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, worker->stop_fd, &stop_event);
+  if (0 != ret) {
+    fprintf(stderr, "ERROR adding stop eventfd to epoll\n");
+    ret = 1;
+    goto cleanup;
+  }
+  if (worker->options->tcp_info_interval_ms > 0) {
+    ret = start_tcp_info_timer(worker);
+    if (0 != ret) {
+      goto cleanup;
+    }
+  }
+
+  for (;;) {
+    int ready = epoll_wait(worker->epollfd, events, MAX_EPOLL_EVENTS, -1);
+    if (ready < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      fprintf(stderr, "ERROR waiting for epoll events\n");
+      ret = 1;
+      goto cleanup;
+    }
+    for (int idx = 0; idx < ready; idx++) {
+      struct connection* conn = events[idx].data.ptr;
+      uint32_t flags = events[idx].events;
+      // taken per event, so that handling the events before it in the batch
+      // does not count towards its receive stage
+      worker->event_ticks = tsc_now();
+
+      if ((void*)&stop_event_marker == (void*)conn) {
+        goto cleanup;
+      }
+      if ((void*)&tcp_info_event_marker == (void*)conn) {
+        sample_tcp_info(worker);
+        continue;
+      }
+      if ((void*)&accept_event_marker == (void*)conn) {
+        ret = resume_accepting(worker);
+        if (0 != ret) {
+          goto cleanup;
+        }
+        continue;
+      }
+      if (NULL == conn) {
+        ret = accept_connections(worker);
+        if (0 != ret) {
+          goto cleanup;
+        }
+        continue;
+      }
+
+      // an orphan is only in epoll for its zerocopy completions. if they can
+      // not be read, or the peer hung up, reset it so nothing is sent anymore
+      if (conn->orphaned) {
+        if ((handle_zerocopy_completions(worker, conn) < 0) ||
+            (events[idx].events & EPOLLHUP)) {
+          free_orphan(worker, conn, true);
+        } else if (NULL == conn->zerocopy_retired) {
+          free_orphan(worker, conn, false);
+        }
+        continue;
+      }
+
+      if (NULL != conn->tls) {
+        if (0 != continue_handshake(worker, conn)) {
+          close_connection(worker, conn);
+        }
+        continue;
+      }
+
+      // zerocopy completions arrive on the error queue, which raises EPOLLERR
+      // as well
+      if ((flags & EPOLLERR) && conn->zerocopy) {
+        int completions = handle_zerocopy_completions(worker, conn);
+        if (completions < 0) {
+          close_connection(worker, conn);
+          continue;
+        }
+        if ((completions > 0) && !(flags & EPOLLHUP)) {
+          flags &= ~EPOLLERR;
+        }
+      }
+
+      // errors and hangups are discovered by the following recv() or send()
+      // so they are handled as ordinary readiness
+      if (flags & (EPOLLERR | EPOLLHUP)) {
+        flags |= (queued_len(conn) > 0) ? EPOLLOUT : EPOLLIN;
+      }
+
+      if (flags & EPOLLOUT) {
+        if (0 != handle_writable(worker, conn)) {
+          close_connection(worker, conn);
+          continue;
+        }
+      }
+      if (flags & EPOLLIN) {
+        if (0 != handle_readable(worker, conn)) {
+          close_connection(worker, conn);
+          continue;
+        }
+      }
+    }
+  }
+
+cleanup:
+  while (NULL != worker->connections) {
+    close_connection(worker, worker->connections);
+  }
+  while (NULL != worker->orphans) {
+    free_orphan(worker, worker->orphans, true);
+  }
+  if (worker->tcp_info_timerfd >= 0) {
+    close(worker->tcp_info_timerfd);
+  }
+  if (worker->accept_timerfd >= 0) {
+    close(worker->accept_timerfd);
+  }
+  if (worker->reserve_fd >= 0) {
+    close(worker->reserve_fd);
+  }
+  close(worker->epollfd);
+
+out:
+  free(worker->scratch);
+  worker->scratch = NULL;
+  return ret;
+}
+
+/**
+ * @brief adds the listening socket to the worker's epoll instance
+ *
+ * @param worker the worker that owns the listening socket
+ * @return int nonzero if epoll_ctl() failed
+ */
+static int watch_listener(struct worker* worker) {
+  // a listening socket shared by every worker only wakes one of them
+  struct epoll_event listen_event = {.events = EPOLLIN, .data.ptr = NULL};
+  if (NULL != worker->options->unix_path) {
+    listen_event.events |= EPOLLEXCLUSIVE;
+  }
+  return epoll_ctl(
+      worker->epollfd, EPOLL_CTL_ADD, worker->server_sockfd, &listen_event);
+}
+
+/**
+ * @brief accepts every pending client on the listening socket
+ *
+ * @param worker the worker that owns the listening socket
+ * @return int nonzero if the listening socket failed
+ */
+static int accept_connections(struct worker* worker) {
+  int ret = 0;
+
+  for (;;) {
+    // large enough for the peer of a unix listener too
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+
+    // accept the next client
+    // the listening socket is non-blocking so once the backlog is empty this
+    // returns EAGAIN and control goes back to the event loop
+    int client_sockfd = accept4(
+        worker->server_sockfd, (struct sockaddr*)&client_addr,
+        &client_addr_len, SOCK_NONBLOCK);
+    if (client_sockfd < 0) {
+      if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+        break;
+      }
+      // these are problems with one client rather than with the listening
+      // socket
+      if ((ECONNABORTED == errno) || (EINTR == errno)) {
+        LOG_ERROR("ERROR: failed to accept the client (%lld)\n", errno);
+        metrics_add(&worker->metrics->errors, 1);
+        break;
+      }
+      // the client stays in the backlog, so with a level-triggered listener
+      // just giving up would have epoll report it again right away
+      int error = errno;
+      if ((EMFILE == error) || (ENFILE == error) || (ENOBUFS == error) ||
+          (ENOMEM == error)) {
+        LOG_ERROR("ERROR: failed to accept the client (%lld)\n", error);
+        metrics_add(&worker->metrics->errors, 1);
+        if ((EMFILE == error) || (ENFILE == error)) {
+          // accept() fails for want of a descriptor before it even looks at
+          // the backlog, so it has to be asked again with one to spare
+          int rejected = reject_client(worker);
+          if (rejected > 0) {
+            continue;
+          }
+          if (0 == rejected) {
+            break;
+          }
+        }
+        ret = pause_accepting(worker);
+        goto out;
+      }
+      fprintf(stderr, "ERROR: failed to accept the client\n");
+      ret = 1;
+      goto out;
+    }
+
+    struct connection* conn = calloc(1, sizeof(*conn));
+    if (NULL == conn) {
+      LOG_ERROR("ERROR: failed to allocate connection state\n");
+      close(client_sockfd);
+      continue;
+    }
+    conn->sockfd = client_sockfd;
+    // an unnamed unix peer has no more than its family, and no port
+    if (AF_INET == client_addr.ss_family) {
+      conn->port = ((struct sockaddr_in*)&client_addr)->sin_port;
+    }
+    conn->events = EPOLLIN;
+    conn->pipe_fds[0] = -1;
+    conn->pipe_fds[1] = -1;
+    if (worker->options->splice && (0 != open_pipe(worker, conn))) {
+      discard_connection(conn);
+      continue;
+    }
+    if (worker->options->zerocopy) {
+      conn->zerocopy = (0 == zerocopy_enable(client_sockfd));
+      if (!conn->zerocopy) {
+        LOG_ERROR("ERROR: failed to enable zerocopy, copying instead\n");
+      }
+    }
+    if (worker->options->timestamps &&
+        (0 != timestamping_enable(client_sockfd, false))) {
+      LOG_ERROR("ERROR: failed to enable receive timestamps\n");
+    }
+    if (NULL != worker->options->tls) {
+      conn->tls = tls_session_create(worker->options->tls, client_sockfd);
+      if (NULL == conn->tls) {
+        LOG_ERROR("ERROR: failed to start a TLS session\n");
+        discard_connection(conn);
+        continue;
+      }
+    }
+    if (worker->options->zerocopy_receive) {
+      conn->receive_window =
+          zerocopy_receive_map(client_sockfd, ZEROCOPY_RECEIVE_LEN);
+      if (NULL == conn->receive_window) {
+        LOG_ERROR("ERROR: failed to map the receive queue, copying instead\n");
+      }
+    }
+
+    struct epoll_event event = {.events = conn->events, .data.ptr = conn};
+    if (0 != epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, client_sockfd, &event)) {
+      LOG_ERROR("ERROR: failed to add the client to epoll\n");
+      discard_connection(conn);
+      continue;
+    }
+
+    conn->next = worker->connections;
+    if (NULL != conn->next) {
+      conn->next->prev = conn;
+    }
+    worker->connections = conn;
+    metrics_add(&worker->metrics->accepts, 1);
+    metrics_gauge_add(&worker->metrics->active_connections, 1);
+
+    LOG_INFO("connected to client: %lld (%lld)\n", conn->sockfd, conn->port);
+  }
+
+out:
+  return ret;
+}
+
+/**
+ * @brief releases a connection that failed before it was added to epoll
+ *
+ * @param conn the connection, with its socket and whatever else was set up
+ * so far
+ */
+static void discard_connection(struct connection* conn) {
+  close(conn->sockfd);
+  if (conn->pipe_fds[0] >= 0) {
+    close(conn->pipe_fds[0]);
+    close(conn->pipe_fds[1]);
+  }
+  tls_session_destroy(conn->tls);
+  if (NULL != conn->receive_window) {
+    munmap(conn->receive_window, ZEROCOPY_RECEIVE_LEN);
+  }
+  free(conn);
+}
+
+/**
+ * @brief turns away the next pending client when out of descriptors
+ *
+ * the reserve descriptor makes room for accepting the client just to close
+ * it, which takes it out of the backlog. the client sees its connection
+ * closed instead of hanging in the backlog.
+ *
+ * @param worker the worker that ran out of descriptors
+ * @return int 1 if a client was turned away, 0 if the backlog turned out to
+ * be empty, negative if the reserve descriptor is gone or did not help
+ */
+static int reject_client(struct worker* worker) {
+  if (worker->reserve_fd < 0) {
+    return -1;
+  }
+  close(worker->reserve_fd);
+  int client_sockfd = accept4(worker->server_sockfd, NULL, NULL, SOCK_CLOEXEC);
+  int rejected = -1;
+  if (client_sockfd >= 0) {
+    close(client_sockfd);
+    rejected = 1;
+  } else if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+    rejected = 0;
+  } else if (ECONNABORTED == errno) {
+    rejected = 1;
+  }
+  // another thread may take the descriptor first, then the next shortage
+  // backs off instead
+  worker->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  return rejected;
+}
+
+/**
+ * @brief stops watching the listening socket for ACCEPT_BACKOFF_MS
+ *
+ * used when a pending client can not be accepted, nor turned away, until
+ * memory or descriptors are freed.
+ *
+ * @param worker the worker that failed to accept
+ * @return int nonzero if the listening socket could not be paused
+ */
+static int pause_accepting(struct worker* worker) {
+  int ret = 0;
+
+  struct itimerspec backoff = {
+      .it_value.tv_sec = ACCEPT_BACKOFF_MS / 1000,
+      .it_value.tv_nsec = (ACCEPT_BACKOFF_MS % 1000) * 1000000L,
+  };
+  if ((0 != epoll_ctl(
+                worker->epollfd, EPOLL_CTL_DEL, worker->server_sockfd, NULL)) ||
+      (0 != timerfd_settime(worker->accept_timerfd, 0, &backoff, NULL))) {
+    fprintf(stderr, "ERROR pausing the listening socket\n");
+    ret = 1;
+  }
+
+  return ret;
+}
+
+/**
+ * @brief watches the listening socket again once the backoff is over
+ *
+ * @param worker the worker whose backoff timer fired
+ * @return int nonzero if the listening socket could not be added back
+ */
+static int resume_accepting(struct worker* worker) {
+  int ret = 0;
+
+  uint64_t expirations;
+  if (read(worker->accept_timerfd, &expirations, sizeof(expirations)) < 0) {
+    goto out;
+  }
+  if (0 != watch_listener(worker)) {
+    fprintf(stderr, "ERROR adding listening socket to epoll\n");
+    ret = 1;
+  }
+
+out:
+  return ret;
+}
+
+/**
+ * @brief takes the TLS handshake of a connection one step further
+ *
+ * once the handshake is done the kernel owns the session, so the session is
+ * freed and the connection goes on as a plain one. the client may already
+ * have sent requests, and since epoll is level-triggered they show up as the
+ * next readable event.
+ *
+ * @param worker the worker that owns the connection
+ * @param conn the connection that is in the middle of its handshake
+ * @return int nonzero if the handshake failed
+ */
+static int continue_handshake(struct worker* worker, struct connection* conn) {
+  int ret = 0;
+
+  uint32_t events = EPOLLIN;
+  switch (tls_session_handshake(conn->tls)) {
+    case TLS_DONE:
+      tls_session_destroy(conn->tls);
+      conn->tls = NULL;
+      worker->tls_sessions++;
+      break;
+    case TLS_WANT_READ:
+      break;
+    case TLS_WANT_WRITE:
+      events = EPOLLOUT;
+      break;
+    case TLS_FAILED:
+      metrics_add(&worker->metrics->errors, 1);
+      ret = 1;
+      goto out;
+  }
+
+  if (events != conn->events) {
+    struct epoll_event event = {.events = events, .data.ptr = conn};
+    if (0 !=
+        epoll_ctl(worker->epollfd, EPOLL_CTL_MOD, conn->sockfd, &event)) {
+      LOG_ERROR("ERROR: failed to update the client in epoll\n");
+      ret = 1;
+      goto out;
+    }
+    conn->events = events;
+  }
+
+out:
+  return ret;
+}
+
+/**
+ * @brief receives from a client and echoes whatever is complete
+ *
+ * the socket is read until it runs dry or the buffer is full, so that every
+ * request a pipelining client has sent so far is answered by one send.
+ * whatever cannot be sent right away is queued in the buffer.
+ *
+ * @param worker the worker that owns the connection
+ * @param conn the connection that became readable
+ * @return int nonzero if the connection should be closed
+ */
+static int handle_readable(struct worker* worker, struct connection* conn) {
+  int ret = 0;
+
+  if (worker->options->splice) {
+    ret = splice_readable(worker, conn);
+    goto out;
+  }
+  if (worker->options->seqpacket) {
+    ret = seqpacket_readable(worker, conn);
+    goto out;
+  }
+
+  // mapping received pages only pays off while nothing else is queued,
+  // otherwise the bytes would have to be copied behind the queue anyway
+  if ((NULL != conn->receive_window) && (0 == conn->buffer_len)) {
+    ret = receive_mapped(worker, conn);
+    if (0 != ret) {
+      goto out;
+    }
+  }
+
+  ret = compact_buffer(worker, conn);
+  if (0 != ret) {
+    goto out;
+  }
+
+  // a frame is only echoed once all of it is in, so make sure the buffer can
+  // hold the queued output and the whole frame that has started to arrive.
+  // frames that are too large are left for parse_frames() to refuse
+  size_t min_size = worker->options->buffer_len;
+  if (worker->options->framed &&
+      ((conn->buffer_len - conn->ready_len) >= FRAME_HEADER_LEN)) {
+    struct frame_header header;
+    frame_header_decode(conn->buffer + conn->ready_len, &header);
+    size_t frame_end = conn->ready_len + FRAME_HEADER_LEN + header.length;
+    if ((header.length <= FRAME_MAX_PAYLOAD_LEN) && (frame_end > min_size)) {
+      min_size = frame_end;
+    }
+  }
+
+  // below the high water mark a full buffer grows so that reading can go on
+  if ((NULL != conn->buffer) && (conn->buffer_len == conn->buffer_cap) &&
+      ((2 * conn->buffer_cap) <= BUFFER_POOL_MAX_SIZE) &&
+      ((2 * conn->buffer_cap) > min_size)) {
+    min_size = 2 * conn->buffer_cap;
+  }
+  ret = reserve_buffer(worker, conn, min_size);
+  if (0 != ret) {
+    goto out;
+  }
+
+  // read characters from the client
+  // a short read means the socket has nothing more for now
+  size_t received_before = conn->buffer_len;
+  size_t ready_before = conn->ready_len;
+  while (conn->buffer_len < conn->buffer_cap) {
+    size_t space = conn->buffer_cap - conn->buffer_len;
+    ssize_t chars_received;
+    if (worker->options->timestamps) {
+      chars_received = receive_timestamped(
+          worker, conn, conn->buffer + conn->buffer_len, space);
+    } else {
+      chars_received =
+          recv(conn->sockfd, conn->buffer + conn->buffer_len, space, 0);
+    }
+    metrics_add(&worker->metrics->recv_calls, 1);
+    if (0 == chars_received) {
+      LOG_INFO("connection to client closed.\n");
+      ret = 1;
+      goto out;
+    } else if (chars_received < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+        metrics_add(&worker->metrics->recv_eagains, 1);
+        break;
+      }
+      LOG_ERROR(
+          "ERROR: failed to receive characters from the client. (%lld)\n",
+          errno);
+      metrics_add(&worker->metrics->errors, 1);
+      ret = 1;
+      goto out;
+    }
+    metrics_add(&worker->metrics->bytes_received, chars_received);
+    conn->buffer_len += chars_received;
+    if ((size_t)chars_received < space) {
+      break;
+    }
+  }
+
+  // only reads that brought something in are timed
+  uint64_t received_ticks = 0;
+  if (conn->buffer_len > received_before) {
+    received_ticks = tsc_now();
+    histogram_record(
+        &worker->stage_latency[STAGE_RECEIVE],
+        received_ticks - worker->event_ticks);
+  }
+
+  // find out how much can be echoed
+  if (worker->options->framed) {
+    ret = parse_frames(conn);
+    if (0 != ret) {
+      goto out;
+    }
+  } else {
+    conn->ready_len = conn->buffer_len;
+  }
+
+  // output that is still queued keeps the time its oldest part was ready
+  if ((0 != received_ticks) && (conn->ready_len > ready_before)) {
+    uint64_t ready_ticks = tsc_now();
+    histogram_record(
+        &worker->stage_latency[STAGE_PROCESS], ready_ticks - received_ticks);
+    if (0 == conn->ready_ticks) {
+      conn->ready_ticks = ready_ticks;
+    }
+  }
+
+  // a sink drops whatever it would have echoed
+  if (worker->options->sink) {
+    worker->bytes_echoed += conn->ready_len - conn->sent_len;
+    conn->sent_len = conn->ready_len;
+  }
+
+  // send those characters right back to the client
+  ret = handle_writable(worker, conn);
+  if (0 != ret) {
+    goto out;
+  }
+
+  // whatever is left over has to outlive the scratch buffer
+  ret = detach_scratch(worker, conn);
+
+out:
+  return ret;
+}
+
+/**
+ * @brief marks every whole frame in the buffer as ready to echo
+ *
+ * frames are parsed in place, nothing is copied out of the buffer.
+ *
+ * @param conn the connection
+ * @return int nonzero if the client sent a frame that is too large
+ */
+static int parse_frames(struct connection* conn) {
+  int ret = 0;
+
+  while ((conn->buffer_len - conn->ready_len) >= FRAME_HEADER_LEN) {
+    struct frame_header header;
+    frame_header_decode(conn->buffer + conn->ready_len, &header);
+    if (header.length > FRAME_MAX_PAYLOAD_LEN) {
+      LOG_ERROR(
+          "ERROR: frame of %llu bytes from client is too large\n",
+          header.length);
+      ret = 1;
+      goto out;
+    }
+
+    size_t frame_len = FRAME_HEADER_LEN + header.length;
+    if ((conn->buffer_len - conn->ready_len) < frame_len) {
+      break;
+    }
+    conn->ready_len += frame_len;
+  }
+
+out:
+  return ret;
+}
+
+/**
+ * @brief sends as much of the pending echo as the socket will take
+ *
+ * once everything that was ready has been sent, a partial frame left behind
+ * it is moved to the front of the buffer and the connection reads again.
+ *
+ * @param worker the worker that owns the connection
+ * @param conn the connection with pending output
+ * @return int nonzero if the connection should be closed
+ */
+static int handle_writable(struct worker* worker, struct connection* conn) {
+  int ret = 0;
+
+  if (worker->options->splice) {
+    ret = splice_writable(worker, conn);
+    goto out;
+  }
+
+  // large echoes go out with MSG_ZEROCOPY, unless they sit in the scratch
+  // buffer which is about to be reused. when the kernel runs out of memory to
+  // pin pages with the echo is copied instead
+  bool copy_only = (worker->scratch == conn->buffer);
+  while (conn->sent_len < conn->ready_len) {
+    size_t send_len = conn->ready_len - conn->sent_len;
+    int send_flags = MSG_NOSIGNAL;
+    if (conn->zerocopy && !copy_only &&
+        (send_len >= worker->options->zerocopy_threshold)) {
+      send_flags |= MSG_ZEROCOPY;
+    }
+    ssize_t chars_sent = send(
+        conn->sockfd, conn->buffer + conn->sent_len, send_len, send_flags);
+    metrics_add(&worker->metrics->send_calls, 1);
+    if (chars_sent < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      if ((ENOBUFS == errno) && (send_flags & MSG_ZEROCOPY)) {
+        copy_only = true;
+        continue;
+      }
+      if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+        metrics_add(&worker->metrics->send_eagains, 1);
+        break;
+      }
+      LOG_ERROR("ERROR: failed send characters back to client.\n");
+      metrics_add(&worker->metrics->errors, 1);
+      ret = 1;
+      goto out;
+    }
+    if (send_flags & MSG_ZEROCOPY) {
+      conn->zerocopy_pinned = true;
+      conn->zerocopy_pinned_id = conn->zerocopy_next_id++;
+      worker->zerocopy_sends++;
+    }
+    conn->sent_len += chars_sent;
+    worker->bytes_echoed += chars_sent;
+    metrics_add(&worker->metrics->bytes_sent, chars_sent);
+  }
+
+  if (conn->sent_len == conn->ready_len) {
+    if (0 != conn->ready_ticks) {
+      histogram_record(
+          &worker->stage_latency[STAGE_SEND], tsc_now() - conn->ready_ticks);
+      conn->ready_ticks = 0;
+    }
+
+    ret = compact_buffer(worker, conn);
+    if (0 != ret) {
+      goto out;
+    }
+
+    // an idle connection does not need its buffer
+    if (0 == conn->buffer_len) {
+      release_buffer(worker, conn);
+    }
+  }
+
+  ret = update_events(worker, conn);
+
+out:
+  return ret;
+}
+
+/**
+ * @brief drops the echoed bytes from the front of the buffer
+ *
+ * a buffer pinned by a zerocopy send is not touched, the remaining bytes move
+ * to a new buffer instead.
+ *
+ * @param worker the worker that owns the connection
+ * @param conn the connection
+ * @return int nonzero if no new buffer could be had
+ */
+static int compact_buffer(struct worker* worker, struct connection* conn) {
+  int ret = 0;
+
+  if (0 == conn->sent_len) {
+    goto out;
+  }
+
+  size_t keep_len = conn->buffer_len - conn->sent_len;
+  if (conn->zerocopy_pinned && (keep_len > 0)) {
+    size_t buffer_cap;
+    char* buffer =
+        buffer_pool_get(&worker->pool, conn->buffer_cap, &buffer_cap);
+    if (NULL == buffer) {
+      LOG_ERROR("ERROR: failed to get a %llu byte buffer\n", keep_len);
+      ret = 1;
+      goto out;
+    }
+    memcpy(buffer, conn->buffer + conn->sent_len, keep_len);
+    drop_buffer(worker, conn);
+    conn->buffer = buffer;
+    conn->buffer_cap = buffer_cap;
+  } else if (keep_len > 0) {
+    memmove(conn->buffer, conn->buffer + conn->sent_len, keep_len);
+  }
+  conn->buffer_len = keep_len;
+  conn->ready_len -= conn->sent_len;
+  conn->sent_len = 0;
+
+out:
+  return ret;
+}
+
+/**
+ * @brief receives by mapping pages of the receive queue
+ *
+ * whole pages are mapped into the connection's receive window, the bytes
+ * before the next page boundary are copied into the scratch buffer. this goes
+ * on until the socket runs dry or some output has to be queued, and the
+ * regular recv() path picks up from there (which is also where the end of the
+ * stream is noticed).
+ *
+ * @param worker the worker that owns the connection
+ * @param conn the connection that became readable, with nothing queued
+ * @return int nonzero if the connection should be closed
+ */
+static int receive_mapped(struct worker* worker, struct connection* conn) {
+  int ret = 0;
+
+  while (0 == conn->buffer_len) {
+    size_t mapped_len = 0;
+    size_t copy_len = 0;
+    metrics_add(&worker->metrics->recv_calls, 1);
+    if (0 != zerocopy_receive(
+                 conn->sockfd, conn->receive_window, ZEROCOPY_RECEIVE_LEN,
+                 &mapped_len, &copy_len)) {
+      LOG_ERROR(
+          "ERROR: zerocopy receive failed (%lld), copying instead\n", errno);
+      metrics_add(&worker->metrics->errors, 1);
+      munmap(conn->receive_window, ZEROCOPY_RECEIVE_LEN);
+      conn->receive_window = NULL;
+      goto out;
+    }
+    if ((0 == mapped_len) && (0 == copy_len)) {
+      goto out;
+    }
+
+    if (mapped_len > 0) {
+      worker->bytes_mapped += mapped_len;
+      metrics_add(&worker->metrics->bytes_received, mapped_len);
+      ret = consume_received(worker, conn, conn->receive_window, mapped_len);
+      if (0 != ret) {
+        goto out;
+      }
+    }
+
+    if ((copy_len > 0) && (0 == conn->buffer_len)) {
+      if (copy_len > worker->scratch_len) {
+        copy_len = worker->scratch_len;
+      }
+      ssize_t chars_received = recv(conn->sockfd, worker->scratch, copy_len, 0);
+      metrics_add(&worker->metrics->recv_calls, 1);
+      if (chars_received <= 0) {
+        goto out;
+      }
+      worker->bytes_copied += chars_received;
+      metrics_add(&worker->metrics->bytes_received, chars_received);
+      ret = consume_received(worker, conn, worker->scratch, chars_received);
+      if (0 != ret) {
+        goto out;
+      }
+    }
+  }
+
+out:
+  return ret;
+}
+
+/**
+ * @brief echoes (or sinks) bytes that were received outside the buffer
+ *
+ * the bytes are sent right away, whatever the socket does not take is copied
+ * into a buffer from the pool and queued.
+ *
+ * @param worker the worker that owns the connection
+ * @param conn the connection, with nothing queued
+ * @param data the received bytes
+ * @param len the number of received bytes
+ * @return int nonzero if the connection should be closed
+ */
+static int consume_received(
+    struct worker* worker, struct connection* conn, const char* data,
+    size_t len) {
+  int ret = 0;
+
+  if (worker->options->sink) {
+    worker->bytes_echoed += len;
+    goto out;
+  }
+
+  while (len > 0) {
+    ssize_t chars_sent = send(conn->sockfd, data, len, MSG_NOSIGNAL);
+    metrics_add(&worker->metrics->send_calls, 1);
+    if (chars_sent < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+        metrics_add(&worker->metrics->send_eagains, 1);
+        break;
+      }
+      LOG_ERROR("ERROR: failed send characters back to client.\n");
+      metrics_add(&worker->metrics->errors, 1);
+      ret = 1;
+      goto out;
+    }
+    data += chars_sent;
+    len -= chars_sent;
+    worker->bytes_echoed += chars_sent;
+    metrics_add(&worker->metrics->bytes_sent, chars_sent);
+  }
+
+  if (len > 0) {
+    size_t min_size = worker->options->buffer_len;
+    if (len > min_size) {
+      min_size = len;
+    }
+    size_t buffer_cap;
+    char* buffer = buffer_pool_get(&worker->pool, min_size, &buffer_cap);
+    if (NULL == buffer) {
+      LOG_ERROR("ERROR: failed to get a %llu byte buffer\n", min_size);
+      ret = 1;
+      goto out;
+    }
+    release_buffer(worker, conn);
+    memcpy(buffer, data, len);
+    conn->buffer = buffer;
+    conn->buffer_cap = buffer_cap;
+    conn->buffer_len = len;
+    conn->ready_len = len;
+    conn->sent_len = 0;
+  }
+
+out:
+  return ret;
+}
+
+/**
+ * @brief receives like recv() and records how long the newest of the
+ * received bytes waited in the socket
+ *
+ * the kernel stamps a segment as it comes in from the device, the wait runs
+ * from there to now. both are CLOCK_REALTIME, so a clock step in between can
+ * make the wait look negative, it is recorded as 0 then.
+ *
+ * @param worker the worker that owns the connection
+ * @param conn the connection, with receive timestamps enabled
+ * @param buffer where to put the bytes
+ * @param len the space in the buffer
+ * @return ssize_t what recv() would have returned
+ */
+static ssize_t receive_timestamped(
+    struct worker* worker, struct connection* conn, char* buffer,
+    size_t len) {
+  uint64_t rx_ns = 0;
+  ssize_t chars_received =
+      timestamping_recv(conn->sockfd, buffer, len, 0, &rx_ns);
+  if (0 != rx_ns) {
+    uint64_t now_ns = timestamping_now_ns();
+    histogram_record(
+        &worker->receive_queue, (now_ns > rx_ns) ? (now_ns - rx_ns) : 0);
+  }
+  return chars_received;
+}
+
+/**
+ * @brief reads zerocopy completions and frees the buffers they release
+ *
+ * @param worker the worker that owns the connection
+ * @param conn the connection whose socket has a pending error
+ * @return int the number of completions read, negative if the error queue
+ * could not be read
+ */
+static int handle_zerocopy_completions(
+    struct worker* worker, struct connection* conn) {
+  uint32_t completed;
+  int ret = zerocopy_read_completions(
+      conn->sockfd, &completed, &worker->zerocopy_copied);
+  if (ret <= 0) {
+    goto out;
+  }
+
+  free_retired_buffers(worker, conn, false, completed);
+  if (conn->zerocopy_pinned &&
+      zerocopy_done(conn->zerocopy_pinned_id, completed)) {
+    conn->zerocopy_pinned = false;
+  }
+
+out:
+  return ret;
+}
+
+/**
+ * @brief creates the pipe a connection echoes through in splice mode
+ *
+ * the pipe is sized to the high water mark so that a full pipe and a full
+ * queue mean the same thing.
+ *
+ * @param worker the worker that owns the connection
+ * @param conn the connection
+ * @return int nonzero if the pipe could not be created
+ */
+static int open_pipe(struct worker* worker, struct connection* conn) {
+  int ret = 0;
+
+  ret = pipe2(conn->pipe_fds, O_NONBLOCK | O_CLOEXEC);
+  if (0 != ret) {
+    LOG_ERROR("ERROR: failed to create a pipe (%lld)\n", errno);
+    conn->pipe_fds[0] = -1;
+    conn->pipe_fds[1] = -1;
+    ret = 1;
+    goto out;
+  }
+
+  // a pipe that cannot grow still works, the water marks just apply sooner
+  fcntl(conn->pipe_fds[1], F_SETPIPE_SZ, (int)worker->options->high_water);
+
+out:
+  return ret;
+}
+
+/**
+ * @brief receives records from a seqpacket client and echoes each of them
+ *
+ * every record is read into the scratch buffer and sent back as one record.
+ * reading stops as soon as a record cannot be sent, and that record moves
+ * into a pool buffer until the client takes it.
+ *
+ * @param worker the worker that owns the connection
+ * @param conn the connection that became readable
+ * @return int nonzero if the connection should be closed
+ */
+static int seqpacket_readable(struct worker* worker, struct connection* conn) {
+  int ret = 0;
+
+  while (0 == queued_len(conn)) {
+    ret = reserve_buffer(worker, conn, worker->options->buffer_len);
+    if (0 != ret) {
+      goto out;
+    }
+
+    // MSG_TRUNC reports the full length of a record that did not fit
+    ssize_t record_len =
+        recv(conn->sockfd, conn->buffer, conn->buffer_cap, MSG_TRUNC);
+    metrics_add(&worker->metrics->recv_calls, 1);
+    if (0 == record_len) {
+      LOG_INFO("connection to client closed.\n");
+      ret = 1;
+      goto out;
+    } else if (record_len < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+        metrics_add(&worker->metrics->recv_eagains, 1);
+        release_buffer(worker, conn);
+        break;
+      }
+      LOG_ERROR(
+          "ERROR: failed to receive a record from the client. (%lld)\n", errno);
+      metrics_add(&worker->metrics->errors, 1);
+      ret = 1;
+      goto out;
+    }
+    metrics_add(&worker->metrics->bytes_received, record_len);
+    if ((size_t)record_len > conn->buffer_cap) {
+      LOG_ERROR(
+          "ERROR: a %lld byte record does not fit into the buffer\n",
+          record_len);
+      ret = 1;
+      goto out;
+    }
+    conn->buffer_len = record_len;
+    conn->ready_len = record_len;
+    conn->sent_len = 0;
+
+    if (worker->options->sink) {
+      worker->bytes_echoed += record_len;
+      conn->sent_len = record_len;
+    }
+
+    ret = handle_writable(worker, conn);
+    if (0 != ret) {
+      goto out;
+    }
+  }
+
+  ret = detach_scratch(worker, conn);
+
+out:
+  return ret;
+}
+
+/**
+ * @brief moves received bytes into the pipe and on to the client
+ *
+ * splice() reports EAGAIN both when the socket is empty and when the pipe is
+ * full. the pipe can fill up before it holds the high water mark because
+ * every received segment takes a pipe slot of its own, so when bytes are
+ * still waiting in the socket the connection stops reading until some of the
+ * pipe has been sent.
+ *
+ * @param worker the worker that owns the connection
+ * @param conn the connection that became readable
+ * @return int nonzero if the connection should be closed
+ */
+static int splice_readable(struct worker* worker, struct connection* conn) {
+  int ret = 0;
+
+  for (;;) {
+    ssize_t chars_received = splice(
+        conn->sockfd, NULL, conn->pipe_fds[1], NULL,
+        worker->options->high_water, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    metrics_add(&worker->metrics->recv_calls, 1);
+    if (0 == chars_received) {
+      LOG_INFO("connection to client closed.\n");
+      ret = 1;
+      goto out;
+    } else if (chars_received < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+        metrics_add(&worker->metrics->recv_eagains, 1);
+        int pending = 0;
+        if ((conn->pipe_len > 0) &&
+            (0 == ioctl(conn->sockfd, FIONREAD, &pending)) && (pending > 0)) {
+          conn->pipe_full = true;
+        }
+        break;
+      }
+      LOG_ERROR(
+          "ERROR: failed to splice characters from the client. (%lld)\n",
+          errno);
+      metrics_add(&worker->metrics->errors, 1);
+      ret = 1;
+      goto out;
+    }
+    conn->pipe_len += chars_received;
+    metrics_add(&worker->metrics->bytes_received, chars_received);
+  }
+
+  ret = splice_writable(worker, conn);
+
+out:
+  return ret;
+}
+
+/**
+ * @brief moves bytes from the pipe back to the client
+ *
+ * @param worker the worker that owns the connection
+ * @param conn the connection
+ * @return int nonzero if the connection should be closed
+ */
+static int splice_writable(struct worker* worker, struct connection* conn) {
+  int ret = 0;
+
+  while (conn->pipe_len > 0) {
+    ssize_t chars_sent = splice(
+        conn->pipe_fds[0], NULL, conn->sockfd, NULL, conn->pipe_len,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    metrics_add(&worker->metrics->send_calls, 1);
+    if (chars_sent < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+        metrics_add(&worker->metrics->send_eagains, 1);
+        break;
+      }
+      LOG_ERROR("ERROR: failed splice characters back to client.\n");
+      metrics_add(&worker->metrics->errors, 1);
+      ret = 1;
+      goto out;
+    }
+    conn->pipe_len -= chars_sent;
+    conn->pipe_full = false;
+    worker->bytes_echoed += chars_sent;
+    metrics_add(&worker->metrics->bytes_sent, chars_sent);
+  }
+
+  ret = update_events(worker, conn);
+
+out:
+  return ret;
+}
+
+/**
+ * @brief counts the bytes a connection has yet to echo
+ *
+ * @param conn the connection
+ * @return size_t the queued bytes, in the buffer or in the pipe
+ */
+static size_t queued_len(const struct connection* conn) {
+  return conn->pipe_len + (conn->ready_len - conn->sent_len);
+}
+
+/**
+ * @brief applies the water marks and tells epoll what the connection waits for
+ *
+ * a connection waits for room in the socket while it has queued output and
+ * for input unless its queue has gone over the high water mark. epoll is only
+ * told when the interest changes so the common fully-sent echo costs no extra
+ * syscall.
+ *
+ * @param worker the worker that owns the connection
+ * @param conn the connection
+ * @return int nonzero if epoll could not be updated
+ */
+static int update_events(struct worker* worker, struct connection* conn) {
+  int ret = 0;
+
+  size_t queued = queued_len(conn);
+  if (queued != conn->metrics_queued) {
+    metrics_gauge_add(
+        &worker->metrics->queued_bytes,
+        (int64_t)queued - (int64_t)conn->metrics_queued);
+    conn->metrics_queued = queued;
+  }
+
+  bool record_queued = worker->options->seqpacket && (queued > 0);
+  if (!conn->paused && ((queued >= worker->options->high_water) ||
+                        conn->pipe_full || record_queued)) {
+    conn->paused = true;
+    worker->pauses++;
+    metrics_add(&worker->metrics->pauses, 1);
+    metrics_gauge_add(&worker->metrics->paused_connections, 1);
+  } else if (
+      conn->paused && (queued <= worker->options->low_water) &&
+      !conn->pipe_full && !record_queued) {
+    conn->paused = false;
+    metrics_gauge_add(&worker->metrics->paused_connections, -1);
+  }
+
+  uint32_t events =
+      (conn->paused ? 0 : EPOLLIN) | ((queued > 0) ? EPOLLOUT : 0);
+  if (events != conn->events) {
+    struct epoll_event event = {.events = events, .data.ptr = conn};
+    if (0 !=
+        epoll_ctl(worker->epollfd, EPOLL_CTL_MOD, conn->sockfd, &event)) {
+      LOG_ERROR("ERROR: failed to update the client in epoll\n");
+      ret = 1;
+      goto out;
+    }
+    conn->events = events;
+  }
+
+out:
+  return ret;
+}
+
+/**
+ * @brief arms a timer that has the worker sample TCP_INFO periodically
+ *
+ * the timer is just another descriptor in epoll, so sampling happens between
+ * events and never races with the connections it looks at.
+ *
+ * @param worker the worker
+ * @return int nonzero if the timer could not be set up
+ */
+static int start_tcp_info_timer(struct worker* worker) {
+  int ret = 0;
+
+  int interval_ms = worker->options->tcp_info_interval_ms;
+  worker->tcp_info_timerfd =
+      timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (worker->tcp_info_timerfd < 0) {
+    fprintf(stderr, "ERROR creating the TCP_INFO timer\n");
+    ret = 1;
+    goto out;
+  }
+  struct itimerspec period = {
+      .it_interval.tv_sec = interval_ms / 1000,
+      .it_interval.tv_nsec = (interval_ms % 1000) * 1000000L,
+  };
+  period.it_value = period.it_interval;
+  struct epoll_event timer_event = {
+      .events = EPOLLIN,
+      .data.ptr = &tcp_info_event_marker,
+  };
+  if ((0 != timerfd_settime(worker->tcp_info_timerfd, 0, &period, NULL)) ||
+      (0 != epoll_ctl(
+                worker->epollfd, EPOLL_CTL_ADD, worker->tcp_info_timerfd,
+                &timer_event))) {
+    fprintf(stderr, "ERROR starting the TCP_INFO timer\n");
+    ret = 1;
+    goto out;
+  }
+
+out:
+  return ret;
+}
+
+/**
+ * @brief samples TCP_INFO of every open connection
+ *
+ * this costs one getsockopt() per connection, which is why it only happens
+ * once per timer period however busy the connections are. periods that were
+ * missed while the worker was busy are not made up for.
+ *
+ * @param worker the worker whose timer fired
+ */
+static void sample_tcp_info(struct worker* worker) {
+  uint64_t expirations;
+  if (read(worker->tcp_info_timerfd, &expirations, sizeof(expirations)) < 0) {
+    return;
+  }
+  for (struct connection* conn = worker->connections; NULL != conn;
+       conn = conn->next) {
+    tcp_stats_sample(&worker->tcp_stats, conn->sockfd, &conn->total_retrans);
+  }
+}
+
+/**
+ * @brief closes a client and releases its state
+ *
+ * with TCP_INFO sampling the connection is sampled one last time, so that
+ * connections shorter than the sampling period are seen too.
+ *
+ * @param worker the worker that owns the connection
+ * @param conn the connection to close
+ */
+static void close_connection(struct worker* worker, struct connection* conn) {
+  if (worker->options->tcp_info_interval_ms > 0) {
+    tcp_stats_sample(&worker->tcp_stats, conn->sockfd, &conn->total_retrans);
+  }
+  metrics_add(&worker->metrics->closes, 1);
+  metrics_gauge_add(&worker->metrics->active_connections, -1);
+  metrics_gauge_add(
+      &worker->metrics->queued_bytes, -(int64_t)conn->metrics_queued);
+  if (conn->paused) {
+    metrics_gauge_add(&worker->metrics->paused_connections, -1);
+  }
+  release_buffer(worker, conn);
+  if (NULL != conn->receive_window) {
+    munmap(conn->receive_window, ZEROCOPY_RECEIVE_LEN);
+  }
+  if (conn->pipe_fds[0] >= 0) {
+    close(conn->pipe_fds[0]);
+    close(conn->pipe_fds[1]);
+  }
+  tls_session_destroy(conn->tls);
+
+  if (NULL != conn->prev) {
+    conn->prev->next = conn->next;
+  } else {
+    worker->connections = conn->next;
+  }
+  if (NULL != conn->next) {
+    conn->next->prev = conn->prev;
+  }
+
+  // the kernel may still be sending from retired buffers
+  if (NULL != conn->zerocopy_retired) {
+    orphan_connection(worker, conn);
+    return;
+  }
+  epoll_ctl(worker->epollfd, EPOLL_CTL_DEL, conn->sockfd, NULL);
+  close(conn->sockfd);
+  free(conn);
+}
+
+/**
+ * @brief keeps the socket of a closed connection until the kernel is done
+ * with its zerocopy buffers
+ *
+ * output that was handed to the kernel is still sent after close(), straight
+ * from the pinned pages, so they may not be reused before their completions
+ * arrive, and those can only be read while the socket is open. the socket
+ * stays in epoll without any events, errors are always reported, and is
+ * closed once its last retired buffer is back in the pool. the FIN goes out
+ * then too.
+ *
+ * @param worker the worker that owned the connection
+ * @param conn the connection, already off the list of connections
+ */
+static void orphan_connection(struct worker* worker, struct connection* conn) {
+  conn->orphaned = true;
+  conn->prev = NULL;
+  conn->next = worker->orphans;
+  if (NULL != conn->next) {
+    conn->next->prev = conn;
+  }
+  worker->orphans = conn;
+
+  struct epoll_event event = {.events = 0, .data.ptr = conn};
+  if (0 != epoll_ctl(worker->epollfd, EPOLL_CTL_MOD, conn->sockfd, &event)) {
+    LOG_ERROR("ERROR: failed to update the client in epoll\n");
+    free_orphan(worker, conn, true);
+  }
+}
+
+/**
+ * @brief closes an orphaned socket and frees what is left of its connection
+ *
+ * @param worker the worker that owns the orphan
+ * @param conn the orphan
+ * @param discard reset the connection, which drops its queued output, so
+ * that the retired buffers can go back to the pool before their completions
+ * have arrived
+ */
+static void free_orphan(
+    struct worker* worker, struct connection* conn, bool discard) {
+  epoll_ctl(worker->epollfd, EPOLL_CTL_DEL, conn->sockfd, NULL);
+  if (discard) {
+    struct linger linger = {.l_onoff = 1, .l_linger = 0};
+    setsockopt(conn->sockfd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+  }
+  close(conn->sockfd);
+  free_retired_buffers(worker, conn, true, 0);
+
+  if (NULL != conn->prev) {
+    conn->prev->next = conn->next;
+  } else {
+    worker->orphans = conn->next;
+  }
+  if (NULL != conn->next) {
+    conn->next->prev = conn->prev;
+  }
+  free(conn);
+}
+
+/**
+ * @brief makes sure a connection has a buffer of at least the given size
+ *
+ * a connection without a buffer borrows the worker's scratch buffer if it is
+ * large enough, otherwise the buffer is taken from the worker's pool. when a
+ * larger buffer is needed the bytes held so far move over and the old buffer
+ * goes back to where it came from.
+ *
+ * @param worker the worker that owns the connection
+ * @param conn the connection
+ * @param min_size the smallest acceptable buffer size
+ * @return int nonzero if no buffer could be had
+ */
+static int reserve_buffer(
+    struct worker* worker, struct connection* conn, size_t min_size) {
+  int ret = 0;
+
+  if ((NULL != conn->buffer) && (conn->buffer_cap >= min_size)) {
+    goto out;
+  }
+  if ((NULL == conn->buffer) && !conn->zerocopy &&
+      (worker->scratch_len >= min_size)) {
+    conn->buffer = worker->scratch;
+    conn->buffer_cap = worker->scratch_len;
+    goto out;
+  }
+
+  size_t buffer_cap;
+  char* buffer = buffer_pool_get(&worker->pool, min_size, &buffer_cap);
+  if (NULL == buffer) {
+    LOG_ERROR("ERROR: failed to get a %llu byte buffer\n", min_size);
+    ret = 1;
+    goto out;
+  }
+  if (NULL != conn->buffer) {
+    memcpy(buffer, conn->buffer, conn->buffer_len);
+    drop_buffer(worker, conn);
+  }
+  conn->buffer = buffer;
+  conn->buffer_cap = buffer_cap;
+
+out:
+  return ret;
+}
+
+/**
+ * @brief gives the buffer of a connection back to the pool
+ *
+ * @param worker the worker that owns the connection
+ * @param conn the connection, which must not hold any bytes worth keeping
+ */
+static void release_buffer(struct worker* worker, struct connection* conn) {
+  drop_buffer(worker, conn);
+  conn->buffer = NULL;
+  conn->buffer_cap = 0;
+  conn->buffer_len = 0;
+}
+
+/**
+ * @brief gives up the buffer of a connection without touching its lengths
+ *
+ * the scratch buffer stays with the worker, a buffer pinned by a zerocopy
+ * send is retired and every other buffer goes back to the pool.
+ *
+ * @param worker the worker that owns the connection
+ * @param conn the connection
+ */
+static void drop_buffer(struct worker* worker, struct connection* conn) {
+  if ((NULL == conn->buffer) || (worker->scratch == conn->buffer)) {
+    goto out;
+  }
+  if (!conn->zerocopy_pinned) {
+    buffer_pool_put(&worker->pool, conn->buffer, conn->buffer_cap);
+    goto out;
+  }
+
+  // losing track of a pinned buffer leaks it, which beats handing out memory
+  // the kernel is still sending from
+  struct zerocopy_buffer* retired = malloc(sizeof(*retired));
+  if (NULL == retired) {
+    LOG_ERROR("ERROR: failed to retire a zerocopy buffer\n");
+    goto out;
+  }
+  retired->next = NULL;
+  retired->buffer = conn->buffer;
+  retired->size = conn->buffer_cap;
+  retired->id = conn->zerocopy_pinned_id;
+  if (NULL == conn->zerocopy_retired) {
+    conn->zerocopy_retired = retired;
+  } else {
+    conn->zerocopy_retired_tail->next = retired;
+  }
+  conn->zerocopy_retired_tail = retired;
+
+out:
+  conn->buffer = NULL;
+  conn->zerocopy_pinned = false;
+}
+
+/**
+ * @brief returns retired buffers to the pool
+ *
+ * retired buffers are kept in the order they were sent from, which is the
+ * order TCP completes them in.
+ *
+ * @param worker the worker that owns the connection
+ * @param conn the connection
+ * @param all free every retired buffer regardless of completions
+ * @param completed the highest completed send id
+ */
+static void free_retired_buffers(
+    struct worker* worker, struct connection* conn, bool all,
+    uint32_t completed) {
+  while ((NULL != conn->zerocopy_retired) &&
+         (all || zerocopy_done(conn->zerocopy_retired->id, completed))) {
+    struct zerocopy_buffer* retired = conn->zerocopy_retired;
+    conn->zerocopy_retired = retired->next;
+    buffer_pool_put(&worker->pool, retired->buffer, retired->size);
+    free(retired);
+  }
+  if (NULL == conn->zerocopy_retired) {
+    conn->zerocopy_retired_tail = NULL;
+  }
+}
+
+/**
+ * @brief moves the bytes a connection still needs out of the scratch buffer
+ *
+ * echoed bytes are dropped on the way, so the pool buffer starts with the
+ * first byte waiting to be echoed.
+ *
+ * @param worker the worker that owns the connection
+ * @param conn the connection
+ * @return int nonzero if no buffer could be had
+ */
+static int detach_scratch(struct worker* worker, struct connection* conn) {
+  int ret = 0;
+
+  if (worker->scratch != conn->buffer) {
+    goto out;
+  }
+
+  size_t keep_len = conn->buffer_len - conn->sent_len;
+  size_t buffer_cap;
+  char* buffer =
+      buffer_pool_get(&worker->pool, worker->options->buffer_len, &buffer_cap);
+  if (NULL == buffer) {
+    LOG_ERROR("ERROR: failed to get a %llu byte buffer\n", keep_len);
+    conn->buffer = NULL;
+    ret = 1;
+    goto out;
+  }
+  memcpy(buffer, conn->buffer + conn->sent_len, keep_len);
+  conn->buffer = buffer;
+  conn->buffer_cap = buffer_cap;
+  conn->buffer_len = keep_len;
+  conn->ready_len -= conn->sent_len;
+  conn->sent_len = 0;
+
+out:
+  return ret;
+}
+
+/**
+ * @brief prints how much cpu a worker used, what its buffer pool holds and
+ * how long its echoes spent in each stage
+ *
+ * the cpu time per echoed gigabyte makes the copying and the splice paths
+ * comparable.
+ *
+ * @param worker a worker whose event loop has returned
+ */
+static void print_worker_stats(struct worker* worker) {
+  if (worker->options->udp) {
+    const struct udp_stats* stats = &worker->udp_stats;
+    printf(
+        "worker %d: %s %lu datagrams (%lu bytes) with %.3f s of cpu, %.1f "
+        "datagrams per buffer, %.1f buffers per recvmmsg(), %lu sendmmsg() "
+        "calls, %lu dropped\n",
+        worker->index, worker->options->sink ? "sank" : "echoed",
+        (unsigned long)stats->datagrams, (unsigned long)stats->bytes,
+        worker->cpu_ns / 1000000000.0,
+        (stats->buffers > 0) ? (double)stats->datagrams / stats->buffers : 0.0,
+        (stats->receive_calls > 0)
+            ? (double)stats->buffers / stats->receive_calls
+            : 0.0,
+        (unsigned long)stats->send_calls, (unsigned long)stats->dropped);
+    return;
+  }
+  if (NULL != worker->options->shm_name) {
+    const struct shm_stats* stats = &worker->shm_stats;
+    printf(
+        "worker %d: echoed %lu bytes to %lu client(s) with %.3f s of cpu, "
+        "%lu waits ended by spinning, %lu sleeps, %lu client wakeups\n",
+        worker->index, (unsigned long)stats->bytes,
+        (unsigned long)stats->clients, worker->cpu_ns / 1000000000.0,
+        (unsigned long)stats->spins, (unsigned long)stats->sleeps,
+        (unsigned long)stats->wakeups);
+    return;
+  }
+  if (BACKEND_EPOLL != worker->options->backend) {
+    printf(
+        "worker %d: %.3f s of cpu\n", worker->index,
+        worker->cpu_ns / 1000000000.0);
+    return;
+  }
+  double echoed_gb = worker->bytes_echoed / 1e9;
+  printf(
+      "worker %d: %s %lu bytes with %.3f s of cpu (%.3f cpu s/GB)\n",
+      worker->index, worker->options->sink ? "sank" : "echoed",
+      (unsigned long)worker->bytes_echoed,
+      worker->cpu_ns / 1000000000.0,
+      (echoed_gb > 0) ? (worker->cpu_ns / 1000000000.0) / echoed_gb : 0.0);
+  printf(
+      "worker %d: buffer pool reserved %lu bytes in %lu allocations, %lu "
+      "bytes in %lu buffers still in use, %lu backpressure pauses, %lu "
+      "zerocopy sends (%lu copied)\n",
+      worker->index, (unsigned long)worker->pool.bytes_reserved,
+      (unsigned long)worker->pool.slab_allocations,
+      (unsigned long)worker->pool.bytes_in_use,
+      (unsigned long)worker->pool.buffers_in_use,
+      (unsigned long)worker->pauses, (unsigned long)worker->zerocopy_sends,
+      (unsigned long)worker->zerocopy_copied);
+  if (NULL != worker->options->tls) {
+    printf(
+        "worker %d: %lu TLS sessions handed to the kernel\n", worker->index,
+        (unsigned long)worker->tls_sessions);
+  }
+  if (worker->options->zerocopy_receive) {
+    printf(
+        "worker %d: zerocopy receive mapped %lu bytes and copied %lu bytes "
+        "around page boundaries\n",
+        worker->index, (unsigned long)worker->bytes_mapped,
+        (unsigned long)worker->bytes_copied);
+  }
+  double ticks_per_usec = tsc_ticks_per_usec(&worker->clock);
+  for (int stage = 0; stage < NUM_STAGES; stage++) {
+    if ((worker->stage_latency[stage].total_count > 0) &&
+        (ticks_per_usec > 0)) {
+      char label[64];
+      snprintf(
+          label, sizeof(label), "worker %d: %s", worker->index,
+          stage_names[stage]);
+      histogram_print_percentiles(
+          &worker->stage_latency[stage], stdout, label, ticks_per_usec, "us");
+    }
+    histogram_destroy(&worker->stage_latency[stage]);
+  }
+  if (worker->receive_queue.total_count > 0) {
+    char label[64];
+    snprintf(
+        label, sizeof(label), "worker %d: waited in the receive queue",
+        worker->index);
+    histogram_print_percentiles(
+        &worker->receive_queue, stdout, label, NSEC_PER_USEC, "us");
+  }
+  histogram_destroy(&worker->receive_queue);
+  char label[64];
+  snprintf(label, sizeof(label), "worker %d: tcp_info", worker->index);
+  tcp_stats_print(&worker->tcp_stats, stdout, label);
+  tcp_stats_destroy(&worker->tcp_stats);
+  buffer_pool_destroy(&worker->pool);
+}
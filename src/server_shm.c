@@ -0,0 +1,171 @@
+/**
+ * @file server_shm.c
+ * @author oclyke
+ * @brief shared memory echo loop of the server
+ *
+ * Even over a unix domain socket every echo costs a syscall on each side and
+ * a copy through the kernel. A client on the same machine can skip all of
+ * that by talking to a worker through a lane of the server's shared memory
+ * region (see shm_ring.h): requests and echoes move through a pair of rings,
+ * and the only syscalls left are the futex calls of a side that ran out of
+ * work and went to sleep.
+ *
+ * The loop copies whatever is readable in the request ring into the response
+ * ring, as long as there is room, and rings the client's doorbell. With
+ * nothing to copy it spins and then sleeps on its own doorbell, with a
+ * timeout so that it notices a client that died without detaching. A stop
+ * request is picked up from the stop eventfd, which is only looked at every
+ * few milliseconds so that it costs nothing per echo.
+ */
+
+#define _GNU_SOURCE
+
+#include "server_shm.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "async_log.h"
+
+#define NSEC_PER_MSEC 1000000ull
+// longest sleep, and how often a client is checked for being alive
+#define SHM_IDLE_NS (100 * NSEC_PER_MSEC)
+// how often the stop eventfd is looked at
+#define SHM_STOP_CHECK_NS (10 * NSEC_PER_MSEC)
+// echoes between looking at the clock while the client keeps the loop busy
+#define SHM_ECHOES_PER_CHECK 1024
+
+static size_t shm_echo(struct shm_lane* lane, struct shm_stats* stats);
+static bool shm_server_ready(void* arg);
+static bool shm_client_gone(struct shm_lane* lane);
+static uint64_t now_ns(void);
+
+int run_shm_loop(
+    struct shm_lane* lane, int stop_fd, struct shm_stats* stats_out) {
+  int ret = 0;
+
+  struct shm_waiter waiter;
+  shm_waiter_init(&waiter);
+  uint64_t next_check_ns = 0;
+  uint32_t echoes = 0;
+  uint32_t last_state = SHM_LANE_FREE;
+  struct pollfd stop_poll = {.fd = stop_fd, .events = POLLIN};
+
+  for (;;) {
+    uint32_t state = atomic_load_explicit(&lane->state, memory_order_acquire);
+    if ((SHM_LANE_ATTACHED == state) && (SHM_LANE_ATTACHED != last_state)) {
+      stats_out->clients++;
+    }
+    last_state = state;
+    if (SHM_LANE_DETACHED == state) {
+      shm_lane_reset(lane);
+      continue;
+    }
+
+    bool busy = (shm_echo(lane, stats_out) > 0);
+    if (busy && (++echoes < SHM_ECHOES_PER_CHECK)) {
+      continue;
+    }
+    echoes = 0;
+
+    uint64_t now = now_ns();
+    if (now >= next_check_ns) {
+      next_check_ns = now + SHM_STOP_CHECK_NS;
+      if ((poll(&stop_poll, 1, 0) < 0) && (EINTR != errno)) {
+        fprintf(stderr, "ERROR waiting for the stop eventfd\n");
+        ret = 1;
+        goto out;
+      }
+      if (stop_poll.revents & POLLIN) {
+        goto out;
+      }
+      if ((SHM_LANE_ATTACHED == state) && shm_client_gone(lane)) {
+        LOG_ERROR("shared memory client went away without detaching\n");
+        shm_lane_reset(lane);
+        continue;
+      }
+    }
+
+    if (!busy) {
+      shm_wait(
+          &waiter, &lane->server_bell, shm_server_ready, lane, SHM_IDLE_NS);
+      stats_out->spins = waiter.spins;
+      stats_out->sleeps = waiter.sleeps;
+    }
+  }
+
+out:
+  return ret;
+}
+
+/**
+ * @brief copies requests into the response ring for as long as both allow
+ *
+ * @param lane the lane
+ * @param stats counters to update
+ * @return size_t the number of bytes echoed
+ */
+static size_t shm_echo(struct shm_lane* lane, struct shm_stats* stats) {
+  size_t echoed = 0;
+
+  for (;;) {
+    const char* data;
+    size_t len = shm_ring_peek(&lane->requests, &data);
+    if (0 == len) {
+      break;
+    }
+    size_t written = shm_ring_write(&lane->responses, data, len);
+    shm_ring_consume(&lane->requests, written);
+    echoed += written;
+    if (written < len) {
+      break;
+    }
+  }
+
+  // the client waits either for echoes or for room to write more requests,
+  // this gives it both
+  if (echoed > 0) {
+    stats->bytes += echoed;
+    if (shm_doorbell_ring(&lane->client_bell)) {
+      stats->wakeups++;
+    }
+  }
+  return echoed;
+}
+
+/**
+ * @brief tells whether the loop has anything to do
+ *
+ * @param arg the lane
+ * @return bool whether there are requests and room for their echoes, or a
+ * client that detached
+ */
+static bool shm_server_ready(void* arg) {
+  struct shm_lane* lane = arg;
+  if (SHM_LANE_DETACHED ==
+      atomic_load_explicit(&lane->state, memory_order_acquire)) {
+    return true;
+  }
+  return (shm_ring_used(&lane->requests) > 0) &&
+         (shm_ring_used(&lane->responses) < SHM_RING_LEN);
+}
+
+/**
+ * @brief finds out whether the process that attached to a lane is gone
+ *
+ * @param lane an attached lane
+ * @return bool whether the client no longer exists
+ */
+static bool shm_client_gone(struct shm_lane* lane) {
+  pid_t pid = atomic_load(&lane->client_pid);
+  return (0 != pid) && (0 != kill(pid, 0)) && (ESRCH == errno);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
@@ -0,0 +1,44 @@
+/**
+ * @file server_shm.h
+ * @author oclyke
+ * @brief shared memory echo loop of the server
+ */
+
+#ifndef SERVER_SHM_H_
+#define SERVER_SHM_H_
+
+#include <stdint.h>
+
+#include "shm_ring.h"
+
+/**
+ * @brief what a shared memory echo loop did
+ */
+struct shm_stats {
+  uint64_t bytes;
+  uint64_t clients;
+  // futex wakeups of a sleeping client
+  uint64_t wakeups;
+  // waits for requests that spinning ended and waits that went to sleep
+  uint64_t spins;
+  uint64_t sleeps;
+};
+
+/**
+ * @brief runs the shared memory echo loop of one lane
+ *
+ * every byte the client of the lane writes into the request ring is copied
+ * into the response ring. once the client detaches (or dies) the lane is
+ * reset and waits for the next one. the loop spins for a while before it
+ * sleeps, so a busy client gets its echoes without any syscall at all.
+ *
+ * @param lane the lane to serve
+ * @param stop_fd the loop returns once this eventfd becomes readable, ring
+ * the server doorbell of the lane after writing it
+ * @param stats_out counters, updated as the loop runs
+ * @return int nonzero if the loop had to stop
+ */
+int run_shm_loop(
+    struct shm_lane* lane, int stop_fd, struct shm_stats* stats_out);
+
+#endif  // SERVER_SHM_H_
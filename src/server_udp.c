@@ -0,0 +1,321 @@
+/**
+ * @file server_udp.c
+ * @author oclyke
+ * @brief datagram echo loop of the server
+ *
+ * A UDP socket has no connections to accept or keep track of, every datagram
+ * stands on its own and carries the address to answer to. That makes the
+ * per-datagram syscalls the main cost of a small request/response flow, so
+ * this loop moves datagrams in batches:
+ *
+ * - recvmmsg() fills up to a batch of buffers (and sender addresses) at once
+ * - sendmmsg() sends the whole batch back, each datagram to its own sender
+ * - a batch the socket does not fully take is finished once the socket is
+ *   writable again, and nothing new is read until then
+ *
+ * With gso the socket is set up with UDP_GRO, so consecutive datagrams of a
+ * flow arrive coalesced into one buffer together with their segment size.
+ * Such a buffer is echoed as it is with a UDP_SEGMENT control message, and
+ * the kernel (or the NIC) splits it back into datagrams of that size. User
+ * space never looks at the individual datagrams.
+ *
+ * References:
+ * - man 2 recvmmsg, man 2 sendmmsg
+ * - man 7 udp, https://lwn.net/Articles/752184/ (UDP GSO)
+ */
+
+#define _GNU_SOURCE
+
+#include "server_udp.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "async_log.h"
+
+// a buffer holds the largest datagram or the largest coalesced buffer
+#define UDP_SLOT_LEN 65536
+// room for the UDP_GRO control message, which is larger than UDP_SEGMENT's
+#define UDP_CONTROL_LEN CMSG_SPACE(sizeof(int))
+// batches handled before the stop eventfd is looked at again
+#define UDP_BATCHES_PER_POLL 16
+
+/**
+ * @brief buffers and headers for one batch of datagrams
+ *
+ * every datagram of the batch has its own buffer, iovec and sender address,
+ * all wired up once so that receiving and echoing only adjust lengths.
+ */
+struct udp_batch {
+  int size;
+  bool gso;
+  struct mmsghdr* msgs;
+  struct iovec* iovs;
+  struct sockaddr_in* addrs;
+  char* buffers;
+  char* controls;
+
+  // buffers received into the batch and how many of them were echoed
+  int len;
+  int sent;
+};
+
+static int udp_batch_init(struct udp_batch* batch, int size, bool gso);
+static void udp_batch_destroy(struct udp_batch* batch);
+static int udp_receive(
+    int sockfd, struct udp_batch* batch, struct udp_stats* stats);
+static void udp_send(
+    int sockfd, struct udp_batch* batch, struct udp_stats* stats);
+static uint16_t udp_segment_size(struct msghdr* msg);
+
+int run_udp_loop(
+    int sockfd, int stop_fd, const struct udp_options* options,
+    struct udp_stats* stats_out) {
+  int ret = 0;
+
+  struct udp_batch batch;
+  ret = udp_batch_init(&batch, options->batch, options->gso);
+  if (0 != ret) {
+    goto out;
+  }
+
+  if (options->gso) {
+    int on = 1;
+    ret = setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on));
+    if (0 != ret) {
+      fprintf(stderr, "ERROR: failed to enable UDP_GRO (%d)\n", errno);
+      ret = 1;
+      goto cleanup;
+    }
+  }
+
+  struct pollfd fds[2] = {
+      {.fd = sockfd, .events = POLLIN},
+      {.fd = stop_fd, .events = POLLIN},
+  };
+  for (;;) {
+    // a batch the socket did not take yet is finished before reading more
+    fds[0].events = (batch.sent < batch.len) ? POLLOUT : POLLIN;
+    if (poll(fds, 2, -1) < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      fprintf(stderr, "ERROR waiting for the datagram socket\n");
+      ret = 1;
+      goto cleanup;
+    }
+    if (fds[1].revents & POLLIN) {
+      goto cleanup;
+    }
+    if (0 == fds[0].revents) {
+      continue;
+    }
+
+    for (int idx = 0; idx < UDP_BATCHES_PER_POLL; idx++) {
+      if (batch.sent < batch.len) {
+        udp_send(sockfd, &batch, stats_out);
+        if (batch.sent < batch.len) {
+          break;
+        }
+      }
+
+      ret = udp_receive(sockfd, &batch, stats_out);
+      if (0 != ret) {
+        goto cleanup;
+      }
+      if (0 == batch.len) {
+        break;
+      }
+      if (options->sink) {
+        batch.sent = batch.len;
+      }
+    }
+  }
+
+cleanup:
+  udp_batch_destroy(&batch);
+
+out:
+  return ret;
+}
+
+/**
+ * @brief allocates a batch and points every header at its buffer
+ *
+ * @param batch the batch to set up
+ * @param size the number of buffers in the batch
+ * @param gso whether every buffer gets room for a control message
+ * @return int nonzero if memory ran out
+ */
+static int udp_batch_init(struct udp_batch* batch, int size, bool gso) {
+  int ret = 0;
+
+  memset(batch, 0, sizeof(*batch));
+  batch->size = size;
+  batch->gso = gso;
+  batch->msgs = calloc(size, sizeof(*batch->msgs));
+  batch->iovs = calloc(size, sizeof(*batch->iovs));
+  batch->addrs = calloc(size, sizeof(*batch->addrs));
+  batch->buffers = malloc((size_t)size * UDP_SLOT_LEN);
+  batch->controls = calloc(size, UDP_CONTROL_LEN);
+  if ((NULL == batch->msgs) || (NULL == batch->iovs) ||
+      (NULL == batch->addrs) || (NULL == batch->buffers) ||
+      (NULL == batch->controls)) {
+    fprintf(stderr, "ERROR: failed to allocate the datagram batch\n");
+    udp_batch_destroy(batch);
+    ret = 1;
+    goto out;
+  }
+
+  for (int idx = 0; idx < size; idx++) {
+    batch->iovs[idx].iov_base = batch->buffers + (size_t)idx * UDP_SLOT_LEN;
+    batch->msgs[idx].msg_hdr.msg_iov = &batch->iovs[idx];
+    batch->msgs[idx].msg_hdr.msg_iovlen = 1;
+    batch->msgs[idx].msg_hdr.msg_name = &batch->addrs[idx];
+  }
+
+out:
+  return ret;
+}
+
+static void udp_batch_destroy(struct udp_batch* batch) {
+  free(batch->msgs);
+  free(batch->iovs);
+  free(batch->addrs);
+  free(batch->buffers);
+  free(batch->controls);
+  memset(batch, 0, sizeof(*batch));
+}
+
+/**
+ * @brief receives as many datagrams as are waiting, up to a batch
+ *
+ * the iovec of each received buffer is trimmed to its length and a coalesced
+ * buffer gets a UDP_SEGMENT control message in place of the UDP_GRO one, so
+ * the batch can be handed to sendmmsg() as it is.
+ *
+ * @param sockfd the socket
+ * @param batch a batch with nothing left to echo, len is 0 if nothing waited
+ * @param stats counters to update
+ * @return int nonzero if the socket failed
+ */
+static int udp_receive(
+    int sockfd, struct udp_batch* batch, struct udp_stats* stats) {
+  int ret = 0;
+
+  batch->len = 0;
+  batch->sent = 0;
+  for (int idx = 0; idx < batch->size; idx++) {
+    struct msghdr* msg = &batch->msgs[idx].msg_hdr;
+    batch->iovs[idx].iov_len = UDP_SLOT_LEN;
+    msg->msg_namelen = sizeof(batch->addrs[idx]);
+    if (batch->gso) {
+      msg->msg_control = batch->controls + (size_t)idx * UDP_CONTROL_LEN;
+      msg->msg_controllen = UDP_CONTROL_LEN;
+    }
+  }
+
+  int received;
+  do {
+    received = recvmmsg(sockfd, batch->msgs, batch->size, MSG_DONTWAIT, NULL);
+  } while ((received < 0) && (EINTR == errno));
+  if (received < 0) {
+    if ((EAGAIN != errno) && (EWOULDBLOCK != errno)) {
+      fprintf(stderr, "ERROR: failed to receive datagrams (%d)\n", errno);
+      ret = 1;
+    }
+    goto out;
+  }
+
+  stats->receive_calls++;
+  for (int idx = 0; idx < received; idx++) {
+    struct msghdr* msg = &batch->msgs[idx].msg_hdr;
+    size_t len = batch->msgs[idx].msg_len;
+    batch->iovs[idx].iov_len = len;
+    stats->buffers++;
+    stats->bytes += len;
+
+    uint16_t segment_size = batch->gso ? udp_segment_size(msg) : 0;
+    if ((0 == segment_size) || (len <= segment_size)) {
+      stats->datagrams++;
+      msg->msg_control = NULL;
+      msg->msg_controllen = 0;
+      continue;
+    }
+    stats->datagrams += (len + segment_size - 1) / segment_size;
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg);
+    msg->msg_controllen = CMSG_SPACE(sizeof(segment_size));
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(segment_size));
+    memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+  }
+  batch->len = received;
+
+out:
+  return ret;
+}
+
+/**
+ * @brief echoes the rest of a batch for as long as the socket takes it
+ *
+ * a datagram the kernel refuses outright (say its sender is unreachable) is
+ * dropped so that it cannot hold up the others. so is one refused with
+ * ENOBUFS: that comes from a full qdisc or device queue rather than the
+ * socket buffer, so waiting for POLLOUT would return right away and spin.
+ *
+ * @param sockfd the socket
+ * @param batch the batch, sent tells how far it got
+ * @param stats counters to update
+ */
+static void udp_send(
+    int sockfd, struct udp_batch* batch, struct udp_stats* stats) {
+  while (batch->sent < batch->len) {
+    int sent = sendmmsg(
+        sockfd, batch->msgs + batch->sent, batch->len - batch->sent,
+        MSG_DONTWAIT);
+    if (sent < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+        break;
+      }
+      // a full device queue drops whole bursts, too many to log each
+      if (ENOBUFS != errno) {
+        LOG_ERROR("ERROR: failed to echo a datagram (%lld)\n", errno);
+      }
+      stats->dropped++;
+      batch->sent++;
+      continue;
+    }
+    stats->send_calls++;
+    batch->sent += sent;
+  }
+}
+
+/**
+ * @brief finds the segment size of a coalesced buffer
+ *
+ * @param msg a received message with a control buffer
+ * @return uint16_t the size of every datagram but the last, 0 if the buffer
+ * holds a single datagram
+ */
+static uint16_t udp_segment_size(struct msghdr* msg) {
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); NULL != cmsg;
+       cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if ((SOL_UDP == cmsg->cmsg_level) && (UDP_GRO == cmsg->cmsg_type)) {
+      int segment_size;
+      memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(segment_size));
+      return segment_size;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,61 @@
+/**
+ * @file server_udp.h
+ * @author oclyke
+ * @brief datagram echo loop of the server
+ */
+
+#ifndef SERVER_UDP_H_
+#define SERVER_UDP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// sendmmsg() never sends more than UIO_MAXIOV datagrams at once
+#define UDP_MAX_BATCH 1024
+
+/**
+ * @brief options of the datagram echo loop
+ */
+struct udp_options {
+  // datagrams moved per recvmmsg() and sendmmsg()
+  int batch;
+  // discard datagrams instead of echoing them
+  bool sink;
+  // receive coalesced datagrams with UDP_GRO and echo them with UDP_SEGMENT
+  bool gso;
+};
+
+/**
+ * @brief what a datagram echo loop did
+ */
+struct udp_stats {
+  uint64_t datagrams;
+  uint64_t bytes;
+  // received buffers, each holding several datagrams when they are coalesced
+  uint64_t buffers;
+  uint64_t receive_calls;
+  uint64_t send_calls;
+  // datagrams the kernel would not send
+  uint64_t dropped;
+};
+
+/**
+ * @brief runs the datagram echo loop
+ *
+ * datagrams are received in batches with recvmmsg() and every batch goes back
+ * to its senders with sendmmsg(), so a busy socket costs two syscalls per
+ * batch instead of two per datagram. with gso the kernel also coalesces
+ * datagrams of a flow into one buffer and splits the echoed buffer again, so
+ * the stack handles one buffer instead of one packet per datagram.
+ *
+ * @param sockfd a bound non-blocking UDP socket
+ * @param stop_fd the loop returns once this eventfd becomes readable
+ * @param options how to echo
+ * @param stats_out counters, updated as the loop runs
+ * @return int nonzero if the loop had to stop
+ */
+int run_udp_loop(
+    int sockfd, int stop_fd, const struct udp_options* options,
+    struct udp_stats* stats_out);
+
+#endif  // SERVER_UDP_H_
@@ -0,0 +1,927 @@
+/**
+ * @file server_uring.c
+ * @author oclyke
+ * @brief io_uring backend for the echo server
+ *
+ * The epoll loop needs one syscall for every accept(), recv() and send(). This
+ * backend asks the kernel for all of that work through io_uring instead:
+ *
+ * - one multishot accept keeps producing a completion per new client
+ * - one multishot recv per client picks its buffers from a ring of provided
+ *   buffers, so no memory is tied to a client until data actually arrives
+ * - the received buffer is sent straight back and only returned to the buffer
+ *   ring once the send completes
+ * - a client whose queued echoes reach the high water mark has its recv
+ *   cancelled until they drain to the low water mark, so a client that does
+ *   not read cannot take every provided buffer from the others
+ * - every submission made while handling a batch of completions goes to the
+ *   kernel in a single io_uring_enter(). a request that finds the submission
+ *   queue full, and the kernel unwilling to take more, is deferred until the
+ *   batch has been handled
+ *
+ * The rings are driven with the raw syscalls rather than liburing so that
+ * nothing beyond the kernel headers is needed to build.
+ *
+ * References:
+ * - https://kernel.dk/io_uring.pdf
+ * - man 7 io_uring, man 3 io_uring_setup_buf_ring
+ */
+
+#define _GNU_SOURCE
+
+#include "server_uring.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "async_log.h"
+
+#define URING_ENTRIES 4096
+#define URING_BUFFER_COUNT 4096
+#define URING_BUFFER_LEN 512
+#define URING_BUFFER_GROUP 0
+#define URING_NO_BUFFER 0xffff
+
+// the operation a completion belongs to is kept in the low bits of its
+// user_data, the rest is the (8 byte aligned) connection pointer
+#define URING_OP_ACCEPT 1
+#define URING_OP_RECV 2
+#define URING_OP_SEND 3
+#define URING_OP_STOP 4
+#define URING_OP_CANCEL 5
+#define URING_OP_MASK 7
+
+/**
+ * @brief state kept for each client of the io_uring loop
+ *
+ * received buffers wait in a singly linked queue (threaded through the
+ * per-buffer next array of the loop) until they have been sent back. only one
+ * send is in flight per client so that echoes can never be reordered. every
+ * client is on the loop's list of connections until it is freed, so that
+ * whatever is still open when the loop stops can be closed.
+ */
+struct uring_connection {
+  int sockfd;
+  struct uring_connection* prev;
+  struct uring_connection* next;
+  int inflight;
+  bool recv_armed;
+  bool send_armed;
+  bool closing;
+  bool starved;
+  // not reading until the queued echoes drain below the low water mark
+  bool paused;
+  size_t queued_len;
+  uint16_t send_head;
+  uint16_t send_tail;
+  uint32_t send_offset;
+  struct uring_connection* next_starved;
+  // a request for this client did not fit in the submission queue
+  bool deferred;
+  struct uring_connection* next_deferred;
+};
+
+struct uring {
+  int ringfd;
+  // requests submitted or queued that have not completed for the last time
+  unsigned inflight;
+  size_t high_water;
+  size_t low_water;
+
+  // submission queue
+  void* sq_ring;
+  size_t sq_ring_size;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sq_local_tail;
+  unsigned sq_submitted_tail;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+
+  // completion queue
+  void* cq_ring;
+  size_t cq_ring_size;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+
+  // provided buffers
+  struct io_uring_buf_ring* buf_ring;
+  size_t buf_ring_size;
+  uint16_t buf_tail;
+  char* buffers;
+  uint32_t buf_len[URING_BUFFER_COUNT];
+  uint16_t buf_next[URING_BUFFER_COUNT];
+
+  // clients whose multishot recv ran out of provided buffers
+  struct uring_connection* starved;
+
+  // clients and the accept with requests that did not fit in the submission
+  // queue
+  struct uring_connection* deferred;
+  bool accept_deferred;
+
+  // every client that has not been freed yet
+  struct uring_connection* connections;
+};
+
+static int uring_setup(struct uring* ring);
+static void uring_teardown(struct uring* ring);
+static int uring_cancel_all(struct uring* ring);
+static struct io_uring_sqe* uring_get_sqe(struct uring* ring);
+static int uring_submit(struct uring* ring, unsigned wait_nr);
+static void uring_recycle_buffer(struct uring* ring, uint16_t bid);
+static void uring_arm_accept(struct uring* ring, int server_sockfd);
+static int uring_arm_stop(struct uring* ring, int stop_fd);
+static void uring_arm_recv(struct uring* ring, struct uring_connection* conn);
+static void uring_arm_send(struct uring* ring, struct uring_connection* conn);
+static void uring_cancel_recv(
+    struct uring* ring, struct uring_connection* conn);
+static void uring_defer(struct uring* ring, struct uring_connection* conn);
+static void uring_retry_deferred(struct uring* ring, int server_sockfd);
+static int uring_handle_accept(
+    struct uring* ring, int server_sockfd, struct io_uring_cqe* cqe);
+static void uring_handle_recv(
+    struct uring* ring, struct uring_connection* conn,
+    struct io_uring_cqe* cqe);
+static void uring_handle_send(
+    struct uring* ring, struct uring_connection* conn,
+    struct io_uring_cqe* cqe);
+static void uring_release_connection(
+    struct uring* ring, struct uring_connection* conn);
+static void uring_free_connection(
+    struct uring* ring, struct uring_connection* conn);
+
+int run_uring_loop(
+    int server_sockfd, int stop_fd, size_t high_water, size_t low_water) {
+  int ret = 0;
+
+  struct uring* ring = calloc(1, sizeof(*ring));
+  if (NULL == ring) {
+    fprintf(stderr, "ERROR: failed to allocate io_uring state\n");
+    ret = 1;
+    goto out;
+  }
+  ring->high_water = high_water;
+  ring->low_water = low_water;
+
+  ret = uring_setup(ring);
+  if (0 != ret) {
+    goto cleanup;
+  }
+
+  ret = uring_arm_stop(ring, stop_fd);
+  if (0 != ret) {
+    goto cleanup;
+  }
+  uring_arm_accept(ring, server_sockfd);
+
+  for (;;) {
+    // submit everything queued while handling the last batch and wait for at
+    // least one more completion
+    ret = uring_submit(ring, 1);
+    if (0 != ret) {
+      goto cleanup;
+    }
+
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    uint16_t buf_tail = ring->buf_tail;
+    for (; head != tail; head++) {
+      struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+      uint64_t op = cqe->user_data & URING_OP_MASK;
+      struct uring_connection* conn =
+          (struct uring_connection*)(uintptr_t)(cqe->user_data &
+                                                ~(uint64_t)URING_OP_MASK);
+
+      if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        ring->inflight--;
+      }
+
+      switch (op) {
+        case URING_OP_ACCEPT:
+          ret = uring_handle_accept(ring, server_sockfd, cqe);
+          if (0 != ret) {
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            goto cleanup;
+          }
+          break;
+        case URING_OP_RECV:
+          uring_handle_recv(ring, conn, cqe);
+          break;
+        case URING_OP_SEND:
+          uring_handle_send(ring, conn, cqe);
+          break;
+        case URING_OP_STOP:
+          __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+          goto cleanup;
+        default:
+          break;
+      }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    // buffers came back so clients that ran dry can receive again
+    if ((buf_tail != ring->buf_tail) && (NULL != ring->starved)) {
+      struct uring_connection* conn = ring->starved;
+      ring->starved = NULL;
+      while (NULL != conn) {
+        struct uring_connection* next = conn->next_starved;
+        conn->starved = false;
+        conn->next_starved = NULL;
+        if (!conn->closing && !conn->recv_armed && !conn->paused) {
+          uring_arm_recv(ring, conn);
+        }
+        uring_release_connection(ring, conn);
+        conn = next;
+      }
+    }
+
+    // the completion queue has room again, so the kernel takes the requests
+    // that were refused while it was full
+    uring_retry_deferred(ring, server_sockfd);
+  }
+
+cleanup:
+  // a ring that can not be drained may still write into the provided
+  // buffers, they are left allocated then
+  if (0 != uring_cancel_all(ring)) {
+    ring->buffers = NULL;
+    ring->buf_ring = NULL;
+  }
+  for (struct uring_connection* conn = ring->connections; NULL != conn;
+       conn = conn->next) {
+    close(conn->sockfd);
+  }
+  uring_teardown(ring);
+  while (NULL != ring->connections) {
+    uring_free_connection(ring, ring->connections);
+  }
+  free(ring);
+
+out:
+  return ret;
+}
+
+/**
+ * @brief creates the ring, maps its queues and registers the provided buffers
+ *
+ * @param ring zeroed loop state to fill in
+ * @return int nonzero on failure
+ */
+static int uring_setup(struct uring* ring) {
+  int ret = 0;
+  struct io_uring_params params;
+
+  // deferred task running keeps completion work on this thread and out of
+  // interrupts, but needs a 6.1+ kernel, so fall back to a plain ring
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER |
+                 IORING_SETUP_DEFER_TASKRUN;
+  params.cq_entries = 4 * URING_ENTRIES;
+  ring->ringfd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if ((ring->ringfd < 0) && (EINVAL == errno)) {
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = 4 * URING_ENTRIES;
+    ring->ringfd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  }
+  if (ring->ringfd < 0) {
+    fprintf(stderr, "ERROR: failed to set up io_uring (%d)\n", errno);
+    ret = 1;
+    goto out;
+  }
+
+  // map the submission and completion rings
+  ring->sq_ring_size =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size) {
+      ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->cq_ring_size = 0;
+  }
+  ring->sq_ring = mmap(
+      NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->ringfd, IORING_OFF_SQ_RING);
+  if (MAP_FAILED == ring->sq_ring) {
+    ring->sq_ring = NULL;
+    fprintf(stderr, "ERROR: failed to map the submission queue\n");
+    ret = 1;
+    goto out;
+  }
+  if (0 == ring->cq_ring_size) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(
+        NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->ringfd, IORING_OFF_CQ_RING);
+    if (MAP_FAILED == ring->cq_ring) {
+      ring->cq_ring = NULL;
+      fprintf(stderr, "ERROR: failed to map the completion queue\n");
+      ret = 1;
+      goto out;
+    }
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(
+      NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      ring->ringfd, IORING_OFF_SQES);
+  if (MAP_FAILED == ring->sqes) {
+    ring->sqes = NULL;
+    fprintf(stderr, "ERROR: failed to map the submission entries\n");
+    ret = 1;
+    goto out;
+  }
+
+  char* sq = ring->sq_ring;
+  ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  ring->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+  ring->sq_entries = *(unsigned*)(sq + params.sq_off.ring_entries);
+  ring->sq_local_tail = *ring->sq_tail;
+  ring->sq_submitted_tail = ring->sq_local_tail;
+
+  // submission entries are always used in order, so the indirection array
+  // can be filled once up front
+  unsigned* sq_array = (unsigned*)(sq + params.sq_off.array);
+  for (unsigned idx = 0; idx < ring->sq_entries; idx++) {
+    sq_array[idx] = idx;
+  }
+
+  char* cq = ring->cq_ring;
+  ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  // set up the provided buffers that multishot recv selects from
+  ring->buf_ring_size = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+  ring->buf_ring = mmap(
+      NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == ring->buf_ring) {
+    ring->buf_ring = NULL;
+    fprintf(stderr, "ERROR: failed to allocate the buffer ring\n");
+    ret = 1;
+    goto out;
+  }
+  ring->buffers = aligned_alloc(64, URING_BUFFER_COUNT * URING_BUFFER_LEN);
+  if (NULL == ring->buffers) {
+    fprintf(stderr, "ERROR: failed to allocate the provided buffers\n");
+    ret = 1;
+    goto out;
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+  reg.ring_entries = URING_BUFFER_COUNT;
+  reg.bgid = URING_BUFFER_GROUP;
+  if (0 != syscall(
+               __NR_io_uring_register, ring->ringfd,
+               IORING_REGISTER_PBUF_RING, &reg, 1)) {
+    fprintf(stderr, "ERROR: failed to register the buffer ring (%d)\n", errno);
+    ret = 1;
+    goto out;
+  }
+
+  ring->buf_tail = 0;
+  for (unsigned bid = 0; bid < URING_BUFFER_COUNT; bid++) {
+    uring_recycle_buffer(ring, bid);
+  }
+
+out:
+  return ret;
+}
+
+/**
+ * @brief releases everything uring_setup() managed to create
+ *
+ * @param ring the loop state
+ */
+static void uring_teardown(struct uring* ring) {
+  if (ring->ringfd >= 0) {
+    close(ring->ringfd);
+  }
+  free(ring->buffers);
+  if (NULL != ring->buf_ring) {
+    munmap(ring->buf_ring, ring->buf_ring_size);
+  }
+  if (NULL != ring->sqes) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if ((NULL != ring->cq_ring) && (ring->cq_ring != ring->sq_ring)) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  if (NULL != ring->sq_ring) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  }
+}
+
+/**
+ * @brief cancels every request the kernel still holds and waits until each
+ * has completed for the last time
+ *
+ * multishot recvs hold references of their own to the client sockets, so
+ * closing a client does not end its recv, and neither does closing the ring
+ * right away: the kernel tears the ring down in the background. until then
+ * data that arrives is still written into the provided buffers.
+ *
+ * @param ring the loop state
+ * @return int nonzero if the ring failed before every request completed
+ */
+static int uring_cancel_all(struct uring* ring) {
+  int ret = 0;
+
+  bool cancelled = false;
+  while (ring->inflight > 0) {
+    if (!cancelled) {
+      // the queue may be full until completions are reaped below
+      struct io_uring_sqe* sqe = uring_get_sqe(ring);
+      if (NULL != sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+        sqe->user_data = URING_OP_CANCEL;
+        cancelled = true;
+      }
+    }
+    ret = uring_submit(ring, cancelled ? 1 : 0);
+    if (0 != ret) {
+      goto out;
+    }
+
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      if (!(ring->cqes[head & ring->cq_mask].flags & IORING_CQE_F_MORE)) {
+        ring->inflight--;
+      }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+
+out:
+  return ret;
+}
+
+/**
+ * @brief gets the next free submission entry
+ *
+ * when the submission queue is full whatever has been queued so far is
+ * submitted first. the kernel refuses that with EBUSY while completions it
+ * could not post are waiting for room in the completion queue, and only
+ * reaping completions makes room, which the caller is in the middle of. the
+ * caller then has to defer its request with uring_defer().
+ *
+ * @param ring the loop state
+ * @return struct io_uring_sqe* a zeroed submission entry, NULL if the queue
+ * stayed full
+ */
+static struct io_uring_sqe* uring_get_sqe(struct uring* ring) {
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if ((ring->sq_local_tail - head) >= ring->sq_entries) {
+    uring_submit(ring, 0);
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if ((ring->sq_local_tail - head) >= ring->sq_entries) {
+      return NULL;
+    }
+  }
+
+  struct io_uring_sqe* sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_local_tail++;
+  ring->inflight++;
+  return sqe;
+}
+
+/**
+ * @brief hands queued submissions to the kernel
+ *
+ * @param ring the loop state
+ * @param wait_nr number of completions to wait for
+ * @return int nonzero if io_uring_enter() failed
+ */
+static int uring_submit(struct uring* ring, unsigned wait_nr) {
+  int ret = 0;
+
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+  unsigned to_submit = ring->sq_local_tail - ring->sq_submitted_tail;
+  unsigned flags = (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0;
+
+  for (;;) {
+    int submitted = syscall(
+        __NR_io_uring_enter, ring->ringfd, to_submit, wait_nr, flags, NULL, 0);
+    if (submitted >= 0) {
+      ring->sq_submitted_tail += submitted;
+      break;
+    }
+    if ((EINTR == errno) || (EAGAIN == errno) || (EBUSY == errno)) {
+      // EBUSY means the completion queue needs draining before more work is
+      // accepted. the main loop does that right after, and the requests
+      // refused meanwhile are deferred until then
+      if ((EINTR != errno) || (0 == wait_nr)) {
+        break;
+      }
+      continue;
+    }
+    fprintf(stderr, "ERROR: io_uring_enter failed (%d)\n", errno);
+    ret = 1;
+    break;
+  }
+
+  return ret;
+}
+
+/**
+ * @brief gives a buffer back to the ring that multishot recv selects from
+ *
+ * @param ring the loop state
+ * @param bid the buffer id
+ */
+static void uring_recycle_buffer(struct uring* ring, uint16_t bid) {
+  struct io_uring_buf* buf =
+      &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFER_COUNT - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(ring->buffers + bid * URING_BUFFER_LEN);
+  buf->len = URING_BUFFER_LEN;
+  buf->bid = bid;
+  ring->buf_tail++;
+  __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_arm_accept(struct uring* ring, int server_sockfd) {
+  struct io_uring_sqe* sqe = uring_get_sqe(ring);
+  if (NULL == sqe) {
+    ring->accept_deferred = true;
+    return;
+  }
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = server_sockfd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = URING_OP_ACCEPT;
+}
+
+/**
+ * @brief has the loop stop once stop_fd becomes readable
+ *
+ * @param ring the loop state, with an empty submission queue
+ * @param stop_fd the eventfd signalled to stop
+ * @return int nonzero if there was no submission entry
+ */
+static int uring_arm_stop(struct uring* ring, int stop_fd) {
+  struct io_uring_sqe* sqe = uring_get_sqe(ring);
+  if (NULL == sqe) {
+    fprintf(stderr, "ERROR: no room in the io_uring submission queue\n");
+    return 1;
+  }
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = stop_fd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = URING_OP_STOP;
+  return 0;
+}
+
+static void uring_arm_recv(struct uring* ring, struct uring_connection* conn) {
+  struct io_uring_sqe* sqe = uring_get_sqe(ring);
+  if (NULL == sqe) {
+    uring_defer(ring, conn);
+    return;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->sockfd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = (uint64_t)(uintptr_t)conn | URING_OP_RECV;
+  conn->recv_armed = true;
+  conn->inflight++;
+}
+
+/**
+ * @brief asks the kernel to end a client's multishot recv
+ *
+ * the recv then completes with -ECANCELED. the cancellation's own completion
+ * carries no connection, so it does not matter if the client is gone by then.
+ *
+ * @param ring the loop state
+ * @param conn the client, with its recv armed
+ */
+static void uring_cancel_recv(
+    struct uring* ring, struct uring_connection* conn) {
+  struct io_uring_sqe* sqe = uring_get_sqe(ring);
+  if (NULL == sqe) {
+    uring_defer(ring, conn);
+    return;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = (uint64_t)(uintptr_t)conn | URING_OP_RECV;
+  sqe->user_data = URING_OP_CANCEL;
+}
+
+static void uring_arm_send(struct uring* ring, struct uring_connection* conn) {
+  uint16_t bid = conn->send_head;
+  struct io_uring_sqe* sqe = uring_get_sqe(ring);
+  if (NULL == sqe) {
+    uring_defer(ring, conn);
+    return;
+  }
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = conn->sockfd;
+  sqe->addr = (uint64_t)(uintptr_t)(ring->buffers + bid * URING_BUFFER_LEN +
+                                    conn->send_offset);
+  sqe->len = ring->buf_len[bid] - conn->send_offset;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = (uint64_t)(uintptr_t)conn | URING_OP_SEND;
+  conn->send_armed = true;
+  conn->inflight++;
+}
+
+/**
+ * @brief remembers a client whose request did not fit in the submission
+ * queue
+ *
+ * the client is not freed while it waits, and uring_retry_deferred() works
+ * out again from its state which requests it is missing.
+ *
+ * @param ring the loop state
+ * @param conn the client
+ */
+static void uring_defer(struct uring* ring, struct uring_connection* conn) {
+  if (!conn->deferred) {
+    conn->deferred = true;
+    conn->next_deferred = ring->deferred;
+    ring->deferred = conn;
+  }
+}
+
+/**
+ * @brief submits again the requests that were deferred
+ *
+ * those that still do not fit are deferred again.
+ *
+ * @param ring the loop state
+ * @param server_sockfd the listening socket
+ */
+static void uring_retry_deferred(struct uring* ring, int server_sockfd) {
+  if (ring->accept_deferred) {
+    ring->accept_deferred = false;
+    uring_arm_accept(ring, server_sockfd);
+  }
+
+  struct uring_connection* conn = ring->deferred;
+  ring->deferred = NULL;
+  while (NULL != conn) {
+    struct uring_connection* next = conn->next_deferred;
+    conn->deferred = false;
+    conn->next_deferred = NULL;
+    if (!conn->recv_armed && !conn->closing && !conn->starved &&
+        !conn->paused) {
+      uring_arm_recv(ring, conn);
+    }
+    // a cancellation that already went in only completes with -ENOENT
+    if (conn->recv_armed && conn->paused) {
+      uring_cancel_recv(ring, conn);
+    }
+    if (!conn->send_armed && (URING_NO_BUFFER != conn->send_head)) {
+      uring_arm_send(ring, conn);
+    }
+    uring_release_connection(ring, conn);
+    conn = next;
+  }
+}
+
+/**
+ * @brief handles a completion of the multishot accept
+ *
+ * @param ring the loop state
+ * @param server_sockfd the listening socket
+ * @param cqe the completion
+ * @return int nonzero if the listening socket failed
+ */
+static int uring_handle_accept(
+    struct uring* ring, int server_sockfd, struct io_uring_cqe* cqe) {
+  int ret = 0;
+
+  if (cqe->res >= 0) {
+    struct uring_connection* conn = calloc(1, sizeof(*conn));
+    if (NULL == conn) {
+      LOG_ERROR("ERROR: failed to allocate connection state\n");
+      close(cqe->res);
+    } else {
+      conn->sockfd = cqe->res;
+      conn->send_head = URING_NO_BUFFER;
+      conn->send_tail = URING_NO_BUFFER;
+      conn->next = ring->connections;
+      if (NULL != conn->next) {
+        conn->next->prev = conn;
+      }
+      ring->connections = conn;
+      uring_arm_recv(ring, conn);
+      LOG_INFO("connected to client: %lld\n", conn->sockfd);
+    }
+  } else if (-EINVAL == cqe->res) {
+    // this kernel does not support multishot accept
+    fprintf(stderr, "ERROR: io_uring multishot accept is not supported\n");
+    ret = 1;
+    goto out;
+  } else {
+    LOG_ERROR("ERROR: failed to accept the client (%lld)\n", -cqe->res);
+  }
+
+  // the kernel may end a multishot request at any time (e.g. on error), in
+  // which case it has to be armed again
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    uring_arm_accept(ring, server_sockfd);
+  }
+
+out:
+  return ret;
+}
+
+/**
+ * @brief handles a completion of a client's multishot recv
+ *
+ * @param ring the loop state
+ * @param conn the client
+ * @param cqe the completion
+ */
+static void uring_handle_recv(
+    struct uring* ring, struct uring_connection* conn,
+    struct io_uring_cqe* cqe) {
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    conn->recv_armed = false;
+    conn->inflight--;
+  }
+
+  if ((cqe->res > 0) && (cqe->flags & IORING_CQE_F_BUFFER)) {
+    uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (conn->closing) {
+      uring_recycle_buffer(ring, bid);
+    } else {
+      // queue the buffer to be echoed back
+      ring->buf_len[bid] = cqe->res;
+      ring->buf_next[bid] = URING_NO_BUFFER;
+      if (URING_NO_BUFFER == conn->send_tail) {
+        conn->send_head = bid;
+      } else {
+        ring->buf_next[conn->send_tail] = bid;
+      }
+      conn->send_tail = bid;
+      conn->queued_len += cqe->res;
+      if (!conn->send_armed) {
+        uring_arm_send(ring, conn);
+      }
+
+      // buffers that arrive before the cancellation takes effect are still
+      // queued, the queue overshoots the mark by at most that much
+      if (!conn->paused && (conn->queued_len >= ring->high_water)) {
+        conn->paused = true;
+        if (conn->recv_armed) {
+          uring_cancel_recv(ring, conn);
+        }
+      }
+    }
+  } else if (-ENOBUFS == cqe->res) {
+    // every provided buffer is waiting to be sent, try again once some have
+    // been recycled
+    if (!conn->starved) {
+      conn->starved = true;
+      conn->next_starved = ring->starved;
+      ring->starved = conn;
+    }
+  } else if (cqe->res == 0) {
+    LOG_INFO("connection to client closed.\n");
+    conn->closing = true;
+  } else if (-ECANCELED == cqe->res) {
+    // cancelled by backpressure, rearmed below if the queue has drained
+  } else if (cqe->res < 0) {
+    LOG_ERROR(
+        "ERROR: failed to receive characters from the client. (%lld)\n",
+        -cqe->res);
+    conn->closing = true;
+  }
+
+  if (!conn->recv_armed && !conn->closing && !conn->starved &&
+      !conn->paused) {
+    uring_arm_recv(ring, conn);
+  }
+  uring_release_connection(ring, conn);
+}
+
+/**
+ * @brief handles a completion of a client's send
+ *
+ * @param ring the loop state
+ * @param conn the client
+ * @param cqe the completion
+ */
+static void uring_handle_send(
+    struct uring* ring, struct uring_connection* conn,
+    struct io_uring_cqe* cqe) {
+  conn->send_armed = false;
+  conn->inflight--;
+
+  if (cqe->res < 0) {
+    LOG_ERROR("ERROR: failed send characters back to client.\n");
+    conn->closing = true;
+    // the pending multishot recv only completes once the socket is shut down
+    if (conn->recv_armed) {
+      shutdown(conn->sockfd, SHUT_RDWR);
+    }
+  } else {
+    conn->send_offset += cqe->res;
+    conn->queued_len -= cqe->res;
+    uint16_t bid = conn->send_head;
+    if (conn->send_offset == ring->buf_len[bid]) {
+      conn->send_head = ring->buf_next[bid];
+      if (URING_NO_BUFFER == conn->send_head) {
+        conn->send_tail = URING_NO_BUFFER;
+      }
+      conn->send_offset = 0;
+      uring_recycle_buffer(ring, bid);
+    }
+  }
+
+  // echoes that were already received are still sent after the client shuts
+  // down its side, but not after a send has failed
+  bool send_failed = (cqe->res < 0);
+  if (!send_failed && (URING_NO_BUFFER != conn->send_head)) {
+    uring_arm_send(ring, conn);
+  }
+  if (send_failed) {
+    while (URING_NO_BUFFER != conn->send_head) {
+      uint16_t bid = conn->send_head;
+      conn->send_head = ring->buf_next[bid];
+      uring_recycle_buffer(ring, bid);
+    }
+    conn->send_tail = URING_NO_BUFFER;
+    conn->queued_len = 0;
+  }
+
+  // a paused client reads again once its queue has drained. if the cancelled
+  // recv has not completed yet, its completion rearms it instead
+  if (conn->paused && (conn->queued_len <= ring->low_water)) {
+    conn->paused = false;
+    if (!conn->recv_armed && !conn->closing && !conn->starved) {
+      uring_arm_recv(ring, conn);
+    }
+  }
+  uring_release_connection(ring, conn);
+}
+
+/**
+ * @brief closes a client once it is closing and the kernel holds no more
+ * requests for it
+ *
+ * @param ring the loop state
+ * @param conn the client
+ */
+static void uring_release_connection(
+    struct uring* ring, struct uring_connection* conn) {
+  if (!conn->closing || (conn->inflight > 0) || conn->starved ||
+      conn->deferred) {
+    return;
+  }
+
+  while (URING_NO_BUFFER != conn->send_head) {
+    uint16_t bid = conn->send_head;
+    conn->send_head = ring->buf_next[bid];
+    uring_recycle_buffer(ring, bid);
+  }
+  close(conn->sockfd);
+  uring_free_connection(ring, conn);
+}
+
+/**
+ * @brief takes a client off the list of connections and frees it
+ *
+ * @param ring the loop state
+ * @param conn the client, its socket already closed
+ */
+static void uring_free_connection(
+    struct uring* ring, struct uring_connection* conn) {
+  if (NULL != conn->prev) {
+    conn->prev->next = conn->next;
+  } else {
+    ring->connections = conn->next;
+  }
+  if (NULL != conn->next) {
+    conn->next->prev = conn->prev;
+  }
+  free(conn);
+}
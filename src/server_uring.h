@@ -0,0 +1,29 @@
+/**
+ * @file server_uring.h
+ * @author oclyke
+ * @brief io_uring backend for the echo server
+ */
+
+#ifndef SERVER_URING_H_
+#define SERVER_URING_H_
+
+#include <stddef.h>
+
+/**
+ * @brief runs the io_uring event loop
+ *
+ * serves the same echo protocol as the epoll loop in server.c but with
+ * multishot accept, multishot recv into a ring of provided buffers and sends
+ * that are batched into one io_uring_enter() per loop iteration.
+ *
+ * @param server_sockfd the listening socket
+ * @param stop_fd the loop returns once this eventfd becomes readable
+ * @param high_water stop receiving from a client once this many of its bytes
+ * are queued to be echoed
+ * @param low_water receive again once its queue has drained to this
+ * @return int nonzero if the loop had to stop
+ */
+int run_uring_loop(
+    int server_sockfd, int stop_fd, size_t high_water, size_t low_water);
+
+#endif  // SERVER_URING_H_
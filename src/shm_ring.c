@@ -0,0 +1,297 @@
+/**
+ * @file shm_ring.c
+ * @author oclyke
+ * @brief shared memory rings shared by the client and server
+ *
+ * The rings follow the usual single producer single consumer protocol: the
+ * producer copies bytes in and then publishes the new head with a release
+ * store, the consumer sees them with an acquire load of the head and gives
+ * the space back by publishing the tail the same way.
+ *
+ * Sleeping needs one more step. A sleeper announces itself in its doorbell
+ * before it checks for work a last time, and a producer checks for an
+ * announced sleeper after it has published. Both sides put a full fence
+ * between their store and their load, so at least one of them sees the
+ * other: either the sleeper finds the work, or the producer finds the sleeper
+ * and bumps the futex word, which makes a FUTEX_WAIT that has not started yet
+ * return right away. Wakeups only cost a syscall when someone really sleeps.
+ *
+ * The futexes live in memory shared between processes, so they are used
+ * without FUTEX_PRIVATE_FLAG.
+ *
+ * References:
+ * - man 2 futex, man 7 shm_overview
+ * - https://www.akkadia.org/drepper/futex.pdf
+ */
+
+#define _GNU_SOURCE
+
+#include "shm_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHM_SPIN_MIN 16
+#define SHM_SPIN_INITIAL 1024
+#define SHM_SPIN_MAX (8 * 1024)
+#define NSEC_PER_SEC 1000000000ull
+
+static size_t shm_region_len(int num_lanes);
+static void shm_cpu_relax(void);
+
+int shm_region_create(
+    const char* name, int num_lanes, struct shm_region** region_out,
+    size_t* len_out) {
+  int ret = 0;
+
+  if ((num_lanes <= 0) || (num_lanes > SHM_MAX_LANES)) {
+    fprintf(stderr, "ERROR: invalid number of shared memory lanes\n");
+    ret = 1;
+    goto out;
+  }
+
+  // a region left behind by a server that did not stop cleanly is replaced,
+  // clients still mapping it keep their (now orphaned) copy
+  shm_unlink(name);
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    fprintf(
+        stderr, "ERROR: failed to create shared memory %s (%d)\n", name,
+        errno);
+    ret = 1;
+    goto out;
+  }
+
+  // the new object reads as zeros, which is a free lane with empty rings
+  size_t len = shm_region_len(num_lanes);
+  struct shm_region* region = MAP_FAILED;
+  if (0 == ftruncate(fd, len)) {
+    region = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (MAP_FAILED == region) {
+    fprintf(stderr, "ERROR: failed to map shared memory %s\n", name);
+    shm_unlink(name);
+    ret = 1;
+    goto out;
+  }
+
+  region->lane_len = sizeof(struct shm_lane);
+  region->num_lanes = num_lanes;
+  atomic_store_explicit(&region->magic, SHM_REGION_MAGIC, memory_order_release);
+
+  *region_out = region;
+  *len_out = len;
+
+out:
+  return ret;
+}
+
+int shm_region_open(
+    const char* name, struct shm_region** region_out, size_t* len_out) {
+  int ret = 0;
+
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: no shared memory named %s\n", name);
+    ret = 1;
+    goto out;
+  }
+
+  struct stat info;
+  struct shm_region* region = MAP_FAILED;
+  if ((0 == fstat(fd, &info)) &&
+      ((size_t)info.st_size >= sizeof(struct shm_region))) {
+    region = mmap(
+        NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (MAP_FAILED == region) {
+    fprintf(stderr, "ERROR: failed to map shared memory %s\n", name);
+    ret = 1;
+    goto out;
+  }
+
+  // a client built with a different lane layout would corrupt the rings
+  if ((SHM_REGION_MAGIC !=
+       atomic_load_explicit(&region->magic, memory_order_acquire)) ||
+      (sizeof(struct shm_lane) != region->lane_len) ||
+      (shm_region_len(region->num_lanes) > (size_t)info.st_size)) {
+    fprintf(stderr, "ERROR: %s is not an echo server region\n", name);
+    munmap(region, info.st_size);
+    ret = 1;
+    goto out;
+  }
+
+  *region_out = region;
+  *len_out = info.st_size;
+
+out:
+  return ret;
+}
+
+void shm_region_close(struct shm_region* region, size_t len) {
+  munmap(region, len);
+}
+
+struct shm_lane* shm_lane_attach(struct shm_region* region) {
+  for (uint32_t idx = 0; idx < region->num_lanes; idx++) {
+    struct shm_lane* lane = &region->lanes[idx];
+    uint32_t expected = SHM_LANE_FREE;
+    if (atomic_compare_exchange_strong(
+            &lane->state, &expected, SHM_LANE_ATTACHED)) {
+      atomic_store(&lane->client_pid, getpid());
+      return lane;
+    }
+  }
+  return NULL;
+}
+
+void shm_lane_detach(struct shm_lane* lane) {
+  atomic_store_explicit(&lane->state, SHM_LANE_DETACHED, memory_order_release);
+  shm_doorbell_wake(&lane->server_bell);
+}
+
+void shm_lane_reset(struct shm_lane* lane) {
+  atomic_store_explicit(&lane->requests.head, 0, memory_order_relaxed);
+  atomic_store_explicit(&lane->requests.tail, 0, memory_order_relaxed);
+  atomic_store_explicit(&lane->responses.head, 0, memory_order_relaxed);
+  atomic_store_explicit(&lane->responses.tail, 0, memory_order_relaxed);
+  atomic_store_explicit(&lane->client_pid, 0, memory_order_relaxed);
+  atomic_store_explicit(&lane->state, SHM_LANE_FREE, memory_order_release);
+}
+
+size_t shm_ring_write(struct shm_ring* ring, const char* data, size_t len) {
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  size_t space = SHM_RING_LEN - (head - tail);
+  if (len > space) {
+    len = space;
+  }
+
+  // the bytes may wrap around the end of the ring
+  size_t offset = head & (SHM_RING_LEN - 1);
+  size_t first = SHM_RING_LEN - offset;
+  if (first > len) {
+    first = len;
+  }
+  memcpy(ring->data + offset, data, first);
+  memcpy(ring->data, data + first, len - first);
+
+  atomic_store_explicit(&ring->head, head + len, memory_order_release);
+  return len;
+}
+
+size_t shm_ring_peek(struct shm_ring* ring, const char** data_out) {
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t offset = tail & (SHM_RING_LEN - 1);
+  size_t len = head - tail;
+  if (len > (SHM_RING_LEN - offset)) {
+    len = SHM_RING_LEN - offset;
+  }
+  *data_out = ring->data + offset;
+  return len;
+}
+
+void shm_ring_consume(struct shm_ring* ring, size_t len) {
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  atomic_store_explicit(&ring->tail, tail + len, memory_order_release);
+}
+
+size_t shm_ring_used(struct shm_ring* ring) {
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  return head - tail;
+}
+
+bool shm_doorbell_ring(struct shm_doorbell* bell) {
+  // pairs with the fence in shm_wait(), see the top of the file
+  atomic_thread_fence(memory_order_seq_cst);
+  if (0 == atomic_load_explicit(&bell->sleeping, memory_order_relaxed)) {
+    return false;
+  }
+  // only the first ring after the sleeper announced itself pays the syscall
+  if (0 == atomic_exchange(&bell->sleeping, 0)) {
+    return false;
+  }
+  shm_doorbell_wake(bell);
+  return true;
+}
+
+void shm_doorbell_wake(struct shm_doorbell* bell) {
+  atomic_fetch_add(&bell->seq, 1);
+  syscall(SYS_futex, &bell->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+void shm_waiter_init(struct shm_waiter* waiter) {
+  memset(waiter, 0, sizeof(*waiter));
+  // on a single core the other side cannot get anything done while this one
+  // spins, so it goes to sleep right away
+  waiter->spin_limit =
+      (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? SHM_SPIN_INITIAL : 0;
+}
+
+void shm_wait(
+    struct shm_waiter* waiter, struct shm_doorbell* bell,
+    bool (*ready)(void* arg), void* arg, uint64_t timeout_ns) {
+  for (uint32_t spin = 0; spin < waiter->spin_limit; spin++) {
+    if (ready(arg)) {
+      waiter->spins++;
+      if (waiter->spin_limit < SHM_SPIN_MAX) {
+        waiter->spin_limit *= 2;
+      }
+      return;
+    }
+    shm_cpu_relax();
+  }
+
+  waiter->sleeps++;
+  if (waiter->spin_limit > SHM_SPIN_MIN) {
+    waiter->spin_limit /= 2;
+  }
+
+  // announce the sleep, then look one last time before going to sleep
+  uint32_t seq = atomic_load(&bell->seq);
+  atomic_store(&bell->sleeping, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (!ready(arg)) {
+    struct timespec timeout = {
+        .tv_sec = timeout_ns / NSEC_PER_SEC,
+        .tv_nsec = timeout_ns % NSEC_PER_SEC,
+    };
+    syscall(SYS_futex, &bell->seq, FUTEX_WAIT, seq, &timeout, NULL, 0);
+  }
+  atomic_store(&bell->sleeping, 0);
+}
+
+/**
+ * @brief computes the size of a region
+ *
+ * @param num_lanes the number of lanes
+ * @return size_t the size of the region in bytes
+ */
+static size_t shm_region_len(int num_lanes) {
+  return sizeof(struct shm_region) +
+         (size_t)num_lanes * sizeof(struct shm_lane);
+}
+
+/**
+ * @brief tells the core that this is a spin loop
+ */
+static void shm_cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
@@ -0,0 +1,249 @@
+/**
+ * @file shm_ring.h
+ * @author oclyke
+ * @brief shared memory rings shared by the client and server
+ *
+ * A region is a POSIX shared memory object created by the server and mapped
+ * by its clients. It holds one lane per server worker, and every lane is a
+ * private channel between the worker and one client:
+ *
+ *   region | header | lane 0 | lane 1 | ...
+ *   lane   | state | server doorbell | client doorbell | requests | responses
+ *
+ * requests and responses are single producer single consumer byte rings, so
+ * a byte stream moves between the processes with nothing but loads, stores
+ * and memcpy(). the client produces requests and consumes responses, the
+ * worker the other way round. a side that has nothing to do spins for a
+ * while and then sleeps on its doorbell, a futex in the lane that the other
+ * side only wakes when it knows the sleeper is asleep.
+ */
+
+#ifndef SHM_RING_H_
+#define SHM_RING_H_
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHM_REGION_MAGIC 0x6d687365u
+// bytes per ring, a power of two
+#define SHM_RING_LEN (256 * 1024)
+#define SHM_MAX_LANES 64
+#define SHM_CACHE_LINE 64
+
+/**
+ * @brief who owns a lane
+ */
+enum shm_lane_state {
+  // the worker has reset the lane and waits for a client
+  SHM_LANE_FREE,
+  // a client has claimed the lane and is using its rings
+  SHM_LANE_ATTACHED,
+  // the client is gone, the worker resets the lane
+  SHM_LANE_DETACHED,
+};
+
+/**
+ * @brief a single producer single consumer byte ring
+ *
+ * head and tail count bytes ever written and read, so they never wrap in
+ * practice and their difference is the number of readable bytes. each one is
+ * written by one side only and lives on its own cache line.
+ */
+struct shm_ring {
+  // written by the producer
+  alignas(SHM_CACHE_LINE) _Atomic uint64_t head;
+  // written by the consumer
+  alignas(SHM_CACHE_LINE) _Atomic uint64_t tail;
+  alignas(SHM_CACHE_LINE) char data[SHM_RING_LEN];
+};
+
+/**
+ * @brief a futex one side sleeps on and the other side rings
+ */
+struct shm_doorbell {
+  alignas(SHM_CACHE_LINE) _Atomic uint32_t seq;
+  _Atomic uint32_t sleeping;
+};
+
+/**
+ * @brief a channel between one worker and one client
+ */
+struct shm_lane {
+  alignas(SHM_CACHE_LINE) _Atomic uint32_t state;
+  _Atomic int32_t client_pid;
+  // the worker sleeps on this one, the client on the other
+  struct shm_doorbell server_bell;
+  struct shm_doorbell client_bell;
+  struct shm_ring requests;
+  struct shm_ring responses;
+};
+
+/**
+ * @brief the mapped shared memory object
+ */
+struct shm_region {
+  // written last by the server, a client checks it before anything else
+  _Atomic uint32_t magic;
+  uint32_t lane_len;
+  uint32_t num_lanes;
+  struct shm_lane lanes[];
+};
+
+/**
+ * @brief adaptive spin-then-sleep policy of one waiting side
+ *
+ * a side spins up to spin_limit times before it goes to sleep. the limit
+ * doubles whenever spinning was enough and halves whenever it was not, so it
+ * settles where spinning still pays off: long while the other side answers
+ * quickly, and close to nothing when it does not (say, both share a core).
+ */
+struct shm_waiter {
+  uint32_t spin_limit;
+  // waits that spinning ended and waits that went to sleep
+  uint64_t spins;
+  uint64_t sleeps;
+};
+
+/**
+ * @brief creates a region, replacing one left behind by an earlier run
+ *
+ * @param name the name of the shared memory object, see shm_open()
+ * @param num_lanes the number of lanes, at most SHM_MAX_LANES
+ * @param region_out the mapped region
+ * @param len_out the length of the mapping
+ * @return int nonzero if the region could not be created
+ */
+int shm_region_create(
+    const char* name, int num_lanes, struct shm_region** region_out,
+    size_t* len_out);
+
+/**
+ * @brief maps a region created by a server
+ *
+ * @param name the name the server was given
+ * @param region_out the mapped region
+ * @param len_out the length of the mapping
+ * @return int nonzero if there is no usable region by that name
+ */
+int shm_region_open(
+    const char* name, struct shm_region** region_out, size_t* len_out);
+
+/**
+ * @brief unmaps a region
+ *
+ * @param region the region
+ * @param len the length of the mapping
+ */
+void shm_region_close(struct shm_region* region, size_t len);
+
+/**
+ * @brief claims a free lane of a region for this process
+ *
+ * @param region the region
+ * @return struct shm_lane* the lane, NULL if every lane is taken
+ */
+struct shm_lane* shm_lane_attach(struct shm_region* region);
+
+/**
+ * @brief gives a lane back, the worker resets it for the next client
+ *
+ * @param lane a lane claimed with shm_lane_attach()
+ */
+void shm_lane_detach(struct shm_lane* lane);
+
+/**
+ * @brief empties both rings of a lane and makes it free again
+ *
+ * only the worker of the lane calls this, once its client is gone.
+ *
+ * @param lane the lane
+ */
+void shm_lane_reset(struct shm_lane* lane);
+
+/**
+ * @brief writes as much of the data as there is room for
+ *
+ * @param ring the ring, written by this side only
+ * @param data the bytes
+ * @param len the number of bytes
+ * @return size_t the number of bytes written
+ */
+size_t shm_ring_write(struct shm_ring* ring, const char* data, size_t len);
+
+/**
+ * @brief finds the readable bytes that are contiguous in the ring
+ *
+ * the bytes stay in the ring until they are consumed, and past the end of
+ * the ring more may be readable from its start.
+ *
+ * @param ring the ring, read by this side only
+ * @param data_out the first readable byte
+ * @return size_t the number of contiguous readable bytes
+ */
+size_t shm_ring_peek(struct shm_ring* ring, const char** data_out);
+
+/**
+ * @brief hands read bytes back to the producer
+ *
+ * @param ring the ring
+ * @param len the number of bytes, at most what shm_ring_peek() reported
+ */
+void shm_ring_consume(struct shm_ring* ring, size_t len);
+
+/**
+ * @brief counts the readable bytes
+ *
+ * @param ring the ring
+ * @return size_t the number of bytes written and not yet consumed
+ */
+size_t shm_ring_used(struct shm_ring* ring);
+
+/**
+ * @brief wakes the other side if it sleeps on the doorbell
+ *
+ * call after publishing anything the other side may be waiting for.
+ *
+ * @param bell the doorbell of the other side
+ * @return bool whether it had to be woken up
+ */
+bool shm_doorbell_ring(struct shm_doorbell* bell);
+
+/**
+ * @brief wakes whoever sleeps on the doorbell, without a reason
+ *
+ * used to make a sleeper look at things outside the lane, like a request to
+ * stop.
+ *
+ * @param bell the doorbell
+ */
+void shm_doorbell_wake(struct shm_doorbell* bell);
+
+/**
+ * @brief sets up a waiter with a moderate spin limit, or none at all on a
+ * single core
+ *
+ * @param waiter the waiter
+ */
+void shm_waiter_init(struct shm_waiter* waiter);
+
+/**
+ * @brief waits until ready() holds, the doorbell rings or the time is up
+ *
+ * spins first and then sleeps on the doorbell. ready() is checked once more
+ * after announcing the sleep, so a ring that comes in between is never
+ * missed. callers check their own conditions again afterwards.
+ *
+ * @param waiter the spin policy of this side
+ * @param bell the doorbell of this side
+ * @param ready whether there is something to do
+ * @param arg passed to ready()
+ * @param timeout_ns the longest sleep
+ */
+void shm_wait(
+    struct shm_waiter* waiter, struct shm_doorbell* bell,
+    bool (*ready)(void* arg), void* arg, uint64_t timeout_ns);
+
+#endif  // SHM_RING_H_
@@ -0,0 +1,135 @@
+/**
+ * @file tcp_stats.c
+ * @author oclyke
+ * @brief distributions of what TCP_INFO says about a set of connections
+ */
+
+#include "tcp_stats.h"
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+
+// the C library's struct tcp_info stops before the delivery rate, the
+// kernel's has every field this kernel knows about
+#include <linux/tcp.h>
+
+// larger values are recorded as these
+#define TCP_STATS_MAX_USEC (60ull * 1000 * 1000)
+#define TCP_STATS_MAX_SEGMENTS (1ull << 24)
+#define TCP_STATS_MAX_BYTES_PER_SEC (1ull << 40)
+
+/**
+ * @brief one histogram of struct tcp_stats and how to show it
+ */
+struct tcp_stats_field {
+  const char* name;
+  size_t offset;
+  uint64_t highest_trackable_value;
+  double unit_divisor;
+  const char* unit_name;
+};
+
+static const struct tcp_stats_field tcp_stats_fields[] = {
+    {"rtt", offsetof(struct tcp_stats, rtt), TCP_STATS_MAX_USEC, 1.0, "us"},
+    {"rtt variance", offsetof(struct tcp_stats, rttvar), TCP_STATS_MAX_USEC,
+     1.0, "us"},
+    {"congestion window", offsetof(struct tcp_stats, cwnd),
+     TCP_STATS_MAX_SEGMENTS, 1.0, "segments"},
+    {"delivery rate", offsetof(struct tcp_stats, delivery_rate),
+     TCP_STATS_MAX_BYTES_PER_SEC, 1e6, "MB/s"},
+    {"retransmits between samples", offsetof(struct tcp_stats, retransmits),
+     TCP_STATS_MAX_SEGMENTS, 1.0, "segments"},
+};
+
+#define TCP_STATS_NUM_FIELDS \
+  (sizeof(tcp_stats_fields) / sizeof(tcp_stats_fields[0]))
+
+static struct histogram* field_histogram(
+    const struct tcp_stats* stats, const struct tcp_stats_field* field);
+
+int tcp_stats_init(struct tcp_stats* stats) {
+  int ret = 0;
+
+  memset(stats, 0, sizeof(*stats));
+  for (size_t idx = 0; idx < TCP_STATS_NUM_FIELDS; idx++) {
+    const struct tcp_stats_field* field = &tcp_stats_fields[idx];
+    if (0 != histogram_init(
+                 field_histogram(stats, field),
+                 field->highest_trackable_value)) {
+      tcp_stats_destroy(stats);
+      ret = 1;
+      goto out;
+    }
+  }
+
+out:
+  return ret;
+}
+
+void tcp_stats_destroy(struct tcp_stats* stats) {
+  for (size_t idx = 0; idx < TCP_STATS_NUM_FIELDS; idx++) {
+    histogram_destroy(field_histogram(stats, &tcp_stats_fields[idx]));
+  }
+}
+
+int tcp_stats_sample(
+    struct tcp_stats* stats, int sockfd, uint32_t* total_retrans) {
+  int ret = 0;
+
+  // an older kernel fills in less, the rest stays zero
+  struct tcp_info info;
+  memset(&info, 0, sizeof(info));
+  socklen_t info_len = sizeof(info);
+  if (0 != getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &info_len)) {
+    ret = 1;
+    goto out;
+  }
+
+  histogram_record(&stats->rtt, info.tcpi_rtt);
+  histogram_record(&stats->rttvar, info.tcpi_rttvar);
+  histogram_record(&stats->cwnd, info.tcpi_snd_cwnd);
+  if (0 != info.tcpi_delivery_rate) {
+    histogram_record(&stats->delivery_rate, info.tcpi_delivery_rate);
+  }
+  histogram_record(
+      &stats->retransmits, info.tcpi_total_retrans - *total_retrans);
+  *total_retrans = info.tcpi_total_retrans;
+
+out:
+  return ret;
+}
+
+void tcp_stats_merge(struct tcp_stats* dst, const struct tcp_stats* src) {
+  for (size_t idx = 0; idx < TCP_STATS_NUM_FIELDS; idx++) {
+    const struct tcp_stats_field* field = &tcp_stats_fields[idx];
+    histogram_merge(field_histogram(dst, field), field_histogram(src, field));
+  }
+}
+
+void tcp_stats_print(
+    const struct tcp_stats* stats, FILE* out, const char* label) {
+  for (size_t idx = 0; idx < TCP_STATS_NUM_FIELDS; idx++) {
+    const struct tcp_stats_field* field = &tcp_stats_fields[idx];
+    const struct histogram* histogram = field_histogram(stats, field);
+    if (histogram->total_count > 0) {
+      char name[128];
+      snprintf(name, sizeof(name), "%s: %s", label, field->name);
+      histogram_print_percentiles(
+          histogram, out, name, field->unit_divisor, field->unit_name);
+    }
+  }
+}
+
+/**
+ * @brief finds one histogram of a struct tcp_stats
+ *
+ * @param stats the statistics
+ * @param field which histogram
+ * @return struct histogram* the histogram
+ */
+static struct histogram* field_histogram(
+    const struct tcp_stats* stats, const struct tcp_stats_field* field) {
+  return (struct histogram*)((char*)stats + field->offset);
+}
@@ -0,0 +1,88 @@
+/**
+ * @file tcp_stats.h
+ * @author oclyke
+ * @brief distributions of what TCP_INFO says about a set of connections
+ *
+ * When latency goes up, the kernel's view of each connection tells whether
+ * the network is to blame: a growing round trip time or variance, segments
+ * that had to be retransmitted, a congestion window that collapsed or a
+ * delivery rate that dropped. Sampling TCP_INFO is one getsockopt() per
+ * connection, so the samples are taken every so often rather than on every
+ * event, and each sample of each connection adds one value to every
+ * histogram.
+ *
+ * References:
+ * - https://man7.org/linux/man-pages/man7/tcp.7.html
+ */
+
+#ifndef TCP_STATS_H_
+#define TCP_STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "histogram.h"
+
+/**
+ * @brief the sampled values of every connection, mixed together
+ */
+struct tcp_stats {
+  // smoothed round trip time and its mean deviation, in microseconds
+  struct histogram rtt;
+  struct histogram rttvar;
+  // congestion window, in segments
+  struct histogram cwnd;
+  // the most recent delivery rate estimate, in bytes per second. samples
+  // taken before the kernel has an estimate are left out
+  struct histogram delivery_rate;
+  // segments retransmitted since the previous sample of the same connection
+  struct histogram retransmits;
+};
+
+/**
+ * @brief allocates the histograms
+ *
+ * @param stats the statistics to set up
+ * @return int nonzero if the histograms could not be allocated, nothing is
+ * left allocated then
+ */
+int tcp_stats_init(struct tcp_stats* stats);
+
+/**
+ * @brief frees the histograms
+ *
+ * @param stats statistics that were set up, or zeroed ones
+ */
+void tcp_stats_destroy(struct tcp_stats* stats);
+
+/**
+ * @brief samples TCP_INFO of one connection
+ *
+ * @param stats where to record the sample
+ * @param sockfd a TCP socket
+ * @param total_retrans the connection's retransmissions as of its previous
+ * sample, 0 before the first one. updated to the current count
+ * @return int nonzero if TCP_INFO could not be read
+ */
+int tcp_stats_sample(
+    struct tcp_stats* stats, int sockfd, uint32_t* total_retrans);
+
+/**
+ * @brief adds the samples of one set of statistics to another
+ *
+ * @param dst the statistics to add to
+ * @param src the statistics to add
+ */
+void tcp_stats_merge(struct tcp_stats* dst, const struct tcp_stats* src);
+
+/**
+ * @brief prints the percentiles of every histogram that has samples
+ *
+ * @param stats the statistics
+ * @param out where to print
+ * @param label printed before the name of each histogram
+ */
+void tcp_stats_print(
+    const struct tcp_stats* stats, FILE* out, const char* label);
+
+#endif  // TCP_STATS_H_
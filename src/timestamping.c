@@ -0,0 +1,146 @@
+/**
+ * @file timestamping.c
+ * @author oclyke
+ * @brief kernel timestamps of the data a socket receives and sends
+ *
+ * References:
+ * - https://docs.kernel.org/networking/timestamping.html
+ */
+
+#include "timestamping.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+// linux/errqueue.h uses struct timespec without including anything for it
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+
+// older headers name the control message only by its socket option
+#ifndef SCM_TIMESTAMPING
+#define SCM_TIMESTAMPING SO_TIMESTAMPING
+#endif
+
+static bool read_timestamp(struct msghdr* msg, uint64_t* ns_out);
+
+int timestamping_enable(int sockfd, bool transmit) {
+  // the software flag is what makes the kernel report software timestamps,
+  // the others only say which ones to take
+  int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+  if (transmit) {
+    // OPT_TSONLY leaves the sent data out of the error queue entries
+    flags |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_TX_ACK |
+             SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+  }
+  return setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+}
+
+ssize_t timestamping_recv(
+    int sockfd, void* buffer, size_t len, int flags, uint64_t* rx_ns_out) {
+  char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+  struct iovec iov = {.iov_base = buffer, .iov_len = len};
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control,
+      .msg_controllen = sizeof(control),
+  };
+  ssize_t chars_received = recvmsg(sockfd, &msg, flags);
+  if (chars_received > 0) {
+    read_timestamp(&msg, rx_ns_out);
+  }
+  return chars_received;
+}
+
+int timestamping_read_transmit(
+    int sockfd, struct timestamping_transmit* transmit) {
+  int ret = 0;
+
+  for (;;) {
+    // an entry carries the timestamp and a description of what it is for
+    char control[CMSG_SPACE(sizeof(struct scm_timestamping)) +
+                 CMSG_SPACE(sizeof(struct sock_extended_err)) +
+                 CMSG_SPACE(sizeof(struct sockaddr_in6))];
+    struct msghdr msg = {
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    // reading the error queue never blocks, it fails with EAGAIN once empty
+    if (recvmsg(sockfd, &msg, MSG_ERRQUEUE) < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+        break;
+      }
+      ret = -1;
+      goto out;
+    }
+
+    uint64_t ns = 0;
+    if (!read_timestamp(&msg, &ns)) {
+      continue;
+    }
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); NULL != cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (!((SOL_IP == cmsg->cmsg_level) && (IP_RECVERR == cmsg->cmsg_type)) &&
+          !((SOL_IPV6 == cmsg->cmsg_level) &&
+            (IPV6_RECVERR == cmsg->cmsg_type))) {
+        continue;
+      }
+      struct sock_extended_err err;
+      memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+      if ((SO_EE_ORIGIN_TIMESTAMPING != err.ee_origin) ||
+          (ENOMSG != err.ee_errno)) {
+        continue;
+      }
+      // ee_info says which point of the send the timestamp was taken at
+      if (SCM_TSTAMP_SND == err.ee_info) {
+        transmit->sent_ns = ns;
+        ret++;
+      } else if (SCM_TSTAMP_ACK == err.ee_info) {
+        transmit->acked_ns = ns;
+        ret++;
+      }
+    }
+  }
+
+out:
+  return ret;
+}
+
+uint64_t timestamping_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief finds the software timestamp among the control messages
+ *
+ * @param msg a message filled in by recvmsg()
+ * @param ns_out set to the timestamp in nanoseconds if there is one
+ * @return bool whether there was one
+ */
+static bool read_timestamp(struct msghdr* msg, uint64_t* ns_out) {
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); NULL != cmsg;
+       cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if ((SOL_SOCKET != cmsg->cmsg_level) ||
+        (SCM_TIMESTAMPING != cmsg->cmsg_type)) {
+      continue;
+    }
+    // ts[0] is the software timestamp, ts[2] would be the hardware one
+    struct scm_timestamping timestamps;
+    memcpy(&timestamps, CMSG_DATA(cmsg), sizeof(timestamps));
+    if ((0 == timestamps.ts[0].tv_sec) && (0 == timestamps.ts[0].tv_nsec)) {
+      return false;
+    }
+    *ns_out = (uint64_t)timestamps.ts[0].tv_sec * 1000000000ull +
+              timestamps.ts[0].tv_nsec;
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,87 @@
+/**
+ * @file timestamping.h
+ * @author oclyke
+ * @brief kernel timestamps of the data a socket receives and sends
+ *
+ * With SO_TIMESTAMPING the kernel notes the time a segment came in from the
+ * device and hands it out with the data through a control message of
+ * recvmsg(). On the sending side it notes when a send left the stack for the
+ * device and when the peer acknowledged its last byte, and queues each of
+ * those on the socket's error queue. All of them are software timestamps
+ * taken with CLOCK_REALTIME, so they can be compared with each other and with
+ * clock_gettime(CLOCK_REALTIME) but not with CLOCK_MONOTONIC.
+ *
+ * On TCP a receive hands out the timestamp of the last segment it read, so a
+ * receive that drains several segments reports when the newest of them
+ * arrived.
+ *
+ * References:
+ * - https://docs.kernel.org/networking/timestamping.html
+ */
+
+#ifndef TIMESTAMPING_H_
+#define TIMESTAMPING_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * @brief the transmit timestamps read from a socket's error queue
+ *
+ * a timestamp is 0 until one of its kind has been read. with several sends
+ * the latest one of each kind is kept.
+ */
+struct timestamping_transmit {
+  // when a send left the stack for the device
+  uint64_t sent_ns;
+  // when the peer acknowledged the last byte of a send
+  uint64_t acked_ns;
+};
+
+/**
+ * @brief asks the kernel to timestamp what a socket receives and, optionally,
+ * what it sends
+ *
+ * transmit timestamps are numbered by the bytes sent, which TCP only allows
+ * on a connected socket.
+ *
+ * @param sockfd the socket
+ * @param transmit also timestamp sends and their acknowledgements
+ * @return int nonzero if the kernel refused
+ */
+int timestamping_enable(int sockfd, bool transmit);
+
+/**
+ * @brief receives like recv() and picks up the receive timestamp
+ *
+ * @param sockfd the socket
+ * @param buffer where to put the characters
+ * @param len the size of the buffer
+ * @param flags flags for recvmsg()
+ * @param rx_ns_out set to the receive timestamp in nanoseconds, left alone
+ * if the kernel did not hand one out
+ * @return ssize_t what recvmsg() returned
+ */
+ssize_t timestamping_recv(
+    int sockfd, void* buffer, size_t len, int flags, uint64_t* rx_ns_out);
+
+/**
+ * @brief reads every transmit timestamp queued on a socket's error queue
+ *
+ * @param sockfd the socket
+ * @param transmit updated with the timestamps read
+ * @return int the number of timestamps read, negative if reading failed
+ */
+int timestamping_read_transmit(
+    int sockfd, struct timestamping_transmit* transmit);
+
+/**
+ * @brief reads the clock the kernel timestamps with
+ *
+ * @return uint64_t CLOCK_REALTIME in nanoseconds
+ */
+uint64_t timestamping_now_ns(void);
+
+#endif  // TIMESTAMPING_H_
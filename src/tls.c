@@ -0,0 +1,257 @@
+/**
+ * @file tls.c
+ * @author oclyke
+ * @brief TLS handshakes handed over to kernel TLS, shared by the client and
+ * server
+ *
+ * With SSL_OP_ENABLE_KTLS OpenSSL switches the socket to the "tls" upper
+ * layer protocol and installs the keys for each direction with
+ * setsockopt(SOL_TLS, TLS_TX / TLS_RX) as soon as the handshake produces
+ * them. Whether that worked is read back from the socket BIOs afterwards,
+ * and only a session the kernel holds in both directions is accepted: the
+ * point is that the echo path never sees a TLS record, so the copy and the
+ * encryption happen in the kernel and send(), splice() and friends keep
+ * working unchanged.
+ *
+ * Two things would need user space after the handshake and are turned off:
+ * TLS 1.3 session tickets (sent by the server right after the handshake) and
+ * TLS 1.2 renegotiation. OpenSSL before 3.2 only offloads receiving for
+ * TLS 1.2, so with those versions sessions stop at TLS 1.2. Records other
+ * than application data (alerts, say) make recv() fail with EIO, which ends
+ * the connection.
+ *
+ * References:
+ * - https://docs.kernel.org/networking/tls.html
+ * - man 3 SSL_CTX_set_options (SSL_OP_ENABLE_KTLS)
+ */
+
+#define _GNU_SOURCE
+
+#include "tls.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef HAVE_OPENSSL
+
+#include <openssl/bio.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+struct tls_context {
+  SSL_CTX* ctx;
+  bool server;
+};
+
+struct tls_session {
+  SSL* ssl;
+};
+
+static struct tls_context* tls_context_new(bool server);
+
+int tls_context_create_server(
+    const char* cert_path, const char* key_path,
+    struct tls_context** context_out) {
+  int ret = 0;
+
+  struct tls_context* context = tls_context_new(true);
+  if (NULL == context) {
+    ret = 1;
+    goto out;
+  }
+  if ((1 != SSL_CTX_use_certificate_chain_file(context->ctx, cert_path)) ||
+      (1 != SSL_CTX_use_PrivateKey_file(
+                context->ctx, key_path, SSL_FILETYPE_PEM)) ||
+      (1 != SSL_CTX_check_private_key(context->ctx))) {
+    fprintf(
+        stderr, "ERROR: failed to load the certificate %s and key %s\n",
+        cert_path, key_path);
+    ERR_print_errors_fp(stderr);
+    tls_context_destroy(context);
+    ret = 1;
+    goto out;
+  }
+
+  *context_out = context;
+
+out:
+  return ret;
+}
+
+int tls_context_create_client(
+    const char* ca_path, struct tls_context** context_out) {
+  int ret = 0;
+
+  struct tls_context* context = tls_context_new(false);
+  if (NULL == context) {
+    ret = 1;
+    goto out;
+  }
+  if (NULL != ca_path) {
+    if (1 != SSL_CTX_load_verify_locations(context->ctx, ca_path, NULL)) {
+      fprintf(stderr, "ERROR: failed to load the certificates %s\n", ca_path);
+      ERR_print_errors_fp(stderr);
+      tls_context_destroy(context);
+      ret = 1;
+      goto out;
+    }
+    SSL_CTX_set_verify(context->ctx, SSL_VERIFY_PEER, NULL);
+  }
+
+  *context_out = context;
+
+out:
+  return ret;
+}
+
+void tls_context_destroy(struct tls_context* context) {
+  SSL_CTX_free(context->ctx);
+  free(context);
+}
+
+struct tls_session* tls_session_create(
+    struct tls_context* context, int sockfd) {
+  struct tls_session* session = calloc(1, sizeof(*session));
+  if (NULL == session) {
+    return NULL;
+  }
+  session->ssl = SSL_new(context->ctx);
+  if ((NULL == session->ssl) || (1 != SSL_set_fd(session->ssl, sockfd))) {
+    ERR_print_errors_fp(stderr);
+    tls_session_destroy(session);
+    return NULL;
+  }
+  if (context->server) {
+    SSL_set_accept_state(session->ssl);
+  } else {
+    SSL_set_connect_state(session->ssl);
+  }
+  return session;
+}
+
+enum tls_status tls_session_handshake(struct tls_session* session) {
+  // errors are queued per thread, so leftovers of another session must not
+  // be blamed on this one
+  ERR_clear_error();
+  int result = SSL_do_handshake(session->ssl);
+  if (1 != result) {
+    int error = SSL_get_error(session->ssl, result);
+    if (SSL_ERROR_WANT_READ == error) {
+      return TLS_WANT_READ;
+    }
+    if (SSL_ERROR_WANT_WRITE == error) {
+      return TLS_WANT_WRITE;
+    }
+    fprintf(stderr, "ERROR: TLS handshake failed (%d)\n", error);
+    ERR_print_errors_fp(stderr);
+    return TLS_FAILED;
+  }
+
+  if (!BIO_get_ktls_send(SSL_get_wbio(session->ssl)) ||
+      !BIO_get_ktls_recv(SSL_get_rbio(session->ssl))) {
+    fprintf(
+        stderr,
+        "ERROR: the kernel did not take over the %s session with %s (is the "
+        "tls module loaded?)\n",
+        SSL_get_version(session->ssl), SSL_get_cipher_name(session->ssl));
+    return TLS_FAILED;
+  }
+  return TLS_DONE;
+}
+
+void tls_session_destroy(struct tls_session* session) {
+  if (NULL == session) {
+    return;
+  }
+  // SSL_set_fd() does not own the socket, freeing the session leaves it open
+  SSL_free(session->ssl);
+  free(session);
+}
+
+/**
+ * @brief creates a context that hands its sessions to the kernel
+ *
+ * @param server whether sessions accept or connect
+ * @return struct tls_context* the context, NULL if OpenSSL failed
+ */
+static struct tls_context* tls_context_new(bool server) {
+  struct tls_context* context = calloc(1, sizeof(*context));
+  if (NULL == context) {
+    return NULL;
+  }
+  context->server = server;
+  context->ctx =
+      SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+  if (NULL == context->ctx) {
+    fprintf(stderr, "ERROR: failed to create a TLS context\n");
+    ERR_print_errors_fp(stderr);
+    free(context);
+    return NULL;
+  }
+
+  SSL_CTX_set_options(
+      context->ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+  SSL_CTX_set_num_tickets(context->ctx, 0);
+#if OPENSSL_VERSION_NUMBER < 0x30200000L
+  SSL_CTX_set_max_proto_version(context->ctx, TLS1_2_VERSION);
+#endif
+  return context;
+}
+
+#else  // HAVE_OPENSSL
+
+struct tls_context {
+  int unused;
+};
+
+int tls_context_create_server(
+    const char* cert_path, const char* key_path,
+    struct tls_context** context_out) {
+  fprintf(stderr, "ERROR: built without OpenSSL, TLS is not supported\n");
+  return 1;
+}
+
+int tls_context_create_client(
+    const char* ca_path, struct tls_context** context_out) {
+  fprintf(stderr, "ERROR: built without OpenSSL, TLS is not supported\n");
+  return 1;
+}
+
+void tls_context_destroy(struct tls_context* context) { free(context); }
+
+struct tls_session* tls_session_create(
+    struct tls_context* context, int sockfd) {
+  return NULL;
+}
+
+enum tls_status tls_session_handshake(struct tls_session* session) {
+  return TLS_FAILED;
+}
+
+void tls_session_destroy(struct tls_session* session) {}
+
+#endif  // HAVE_OPENSSL
+
+int tls_handshake(struct tls_context* context, int sockfd) {
+  int ret = 0;
+
+  int flags = fcntl(sockfd, F_GETFL);
+  if ((flags < 0) || (0 != fcntl(sockfd, F_SETFL, flags & ~O_NONBLOCK))) {
+    ret = 1;
+    goto out;
+  }
+
+  struct tls_session* session = tls_session_create(context, sockfd);
+  if ((NULL == session) || (TLS_DONE != tls_session_handshake(session))) {
+    ret = 1;
+  }
+  tls_session_destroy(session);
+
+  if (0 != fcntl(sockfd, F_SETFL, flags)) {
+    ret = 1;
+  }
+
+out:
+  return ret;
+}
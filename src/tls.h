@@ -0,0 +1,118 @@
+/**
+ * @file tls.h
+ * @author oclyke
+ * @brief TLS handshakes handed over to kernel TLS, shared by the client and
+ * server
+ *
+ * The handshake runs in user space with OpenSSL. Once it is done OpenSSL
+ * installs the session keys on the socket (setsockopt(SOL_TLS)) and from
+ * then on the kernel encrypts and decrypts the records: the socket reads and
+ * writes plain bytes with recv(), send() and splice() like any other, and
+ * nothing of the session is kept in user space. A session the kernel cannot
+ * take over in both directions counts as a failed handshake.
+ *
+ * Without OpenSSL at build time every function reports that TLS is not
+ * supported.
+ */
+
+#ifndef TLS_H_
+#define TLS_H_
+
+#include <stdbool.h>
+
+/**
+ * @brief settings and credentials shared by every session of one side
+ */
+struct tls_context;
+
+/**
+ * @brief one handshake in progress
+ */
+struct tls_session;
+
+/**
+ * @brief how far a handshake got
+ */
+enum tls_status {
+  // the kernel has the keys for both directions
+  TLS_DONE,
+  // the handshake continues once the socket is readable
+  TLS_WANT_READ,
+  // the handshake continues once the socket is writable
+  TLS_WANT_WRITE,
+  TLS_FAILED,
+};
+
+/**
+ * @brief sets up the server side
+ *
+ * @param cert_path a PEM certificate (chain)
+ * @param key_path the PEM private key of the certificate
+ * @param context_out the context
+ * @return int nonzero if TLS is not supported or the files are unusable
+ */
+int tls_context_create_server(
+    const char* cert_path, const char* key_path,
+    struct tls_context** context_out);
+
+/**
+ * @brief sets up the client side
+ *
+ * @param ca_path PEM certificates to verify the server against, NULL to
+ * accept any server (say, one with a self-signed certificate)
+ * @param context_out the context
+ * @return int nonzero if TLS is not supported or the file is unusable
+ */
+int tls_context_create_client(
+    const char* ca_path, struct tls_context** context_out);
+
+/**
+ * @brief frees a context once no session uses it anymore
+ *
+ * @param context the context
+ */
+void tls_context_destroy(struct tls_context* context);
+
+/**
+ * @brief starts a handshake on a connected socket
+ *
+ * @param context the context of this side
+ * @param sockfd the socket, blocking or not
+ * @return struct tls_session* the session, NULL if it could not be created
+ */
+struct tls_session* tls_session_create(
+    struct tls_context* context, int sockfd);
+
+/**
+ * @brief takes the handshake as far as the socket allows
+ *
+ * on a blocking socket this only returns once the handshake is done or has
+ * failed.
+ *
+ * @param session the session
+ * @return enum tls_status TLS_DONE once the kernel owns the session
+ */
+enum tls_status tls_session_handshake(struct tls_session* session);
+
+/**
+ * @brief frees a session, which leaves the socket and its kernel TLS state
+ * alone
+ *
+ * @param session the session, NULL is fine
+ */
+void tls_session_destroy(struct tls_session* session);
+
+/**
+ * @brief runs a whole handshake on a socket
+ *
+ * a non-blocking socket is switched to blocking for the handshake and back
+ * afterwards.
+ *
+ * @param context the context of this side
+ * @param sockfd the connected socket
+ * @return int nonzero if the handshake failed or the kernel did not take it
+ * over
+ */
+int tls_handshake(struct tls_context* context, int sockfd);
+
+#endif  // TLS_H_
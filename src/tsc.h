@@ -0,0 +1,85 @@
+/**
+ * @file tsc.h
+ * @author oclyke
+ * @brief a cheap clock for timing short stretches of the event loop
+ *
+ * On x86 the clock is the time stamp counter, read with rdtsc in a few
+ * nanoseconds and without a syscall or even a vDSO call. Modern cores tick
+ * it at a constant rate whatever their frequency, but the rate itself is not
+ * known up front, so ticks are converted by comparing them with
+ * CLOCK_MONOTONIC over a whole run. Elsewhere the clock simply is
+ * CLOCK_MONOTONIC in nanoseconds, and the same conversion comes out at one
+ * tick per nanosecond.
+ *
+ * rdtsc is not ordered with the instructions around it, which is fine for
+ * stages that take hundreds of nanoseconds or more.
+ */
+
+#ifndef TSC_H_
+#define TSC_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * @brief a tick count and the time it was taken at
+ */
+struct tsc_calibration {
+  uint64_t start_ticks;
+  uint64_t start_ns;
+};
+
+/**
+ * @brief reads the monotonic clock
+ *
+ * @return uint64_t the time in nanoseconds
+ */
+static inline uint64_t tsc_monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief reads the clock
+ *
+ * @return uint64_t the time in ticks
+ */
+static inline uint64_t tsc_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return tsc_monotonic_ns();
+#endif
+}
+
+/**
+ * @brief notes the start of the stretch that the tick rate is measured over
+ *
+ * @param calibration where to note it
+ */
+static inline void tsc_calibration_start(struct tsc_calibration* calibration) {
+  calibration->start_ns = tsc_monotonic_ns();
+  calibration->start_ticks = tsc_now();
+}
+
+/**
+ * @brief measures the tick rate since tsc_calibration_start()
+ *
+ * the longer the stretch, the more precise the rate.
+ *
+ * @param calibration the start of the stretch
+ * @return double ticks per microsecond, 0 if no time has passed
+ */
+static inline double tsc_ticks_per_usec(
+    const struct tsc_calibration* calibration) {
+  uint64_t ticks = tsc_now() - calibration->start_ticks;
+  uint64_t elapsed_ns = tsc_monotonic_ns() - calibration->start_ns;
+  return (elapsed_ns > 0) ? ticks * 1000.0 / elapsed_ns : 0.0;
+}
+
+#endif  // TSC_H_
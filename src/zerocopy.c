@@ -0,0 +1,111 @@
+/**
+ * @file zerocopy.c
+ * @author oclyke
+ * @brief MSG_ZEROCOPY sends and their completion notifications
+ *
+ * References:
+ * - https://docs.kernel.org/networking/msg_zerocopy.html
+ * - https://lwn.net/Articles/752188/ (TCP_ZEROCOPY_RECEIVE)
+ */
+
+#include "zerocopy.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+
+// linux/errqueue.h uses struct timespec without including anything for it
+#include <linux/errqueue.h>
+
+int zerocopy_enable(int sockfd) {
+  int enable = 1;
+  return setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable));
+}
+
+void* zerocopy_receive_map(int sockfd, size_t len) {
+  void* window = mmap(NULL, len, PROT_READ, MAP_SHARED, sockfd, 0);
+  return (MAP_FAILED == window) ? NULL : window;
+}
+
+int zerocopy_receive(
+    int sockfd, void* window, size_t len, size_t* mapped_out,
+    size_t* copy_out) {
+  int ret = 0;
+
+  struct tcp_zerocopy_receive zc;
+  socklen_t zc_len = sizeof(zc);
+  do {
+    memset(&zc, 0, sizeof(zc));
+    zc.address = (uint64_t)(uintptr_t)window;
+    zc.length = len;
+    ret = getsockopt(sockfd, IPPROTO_TCP, TCP_ZEROCOPY_RECEIVE, &zc, &zc_len);
+  } while ((0 != ret) && (EINTR == errno));
+  if (0 != ret) {
+    // the kernel reports the end of the stream as EIO, leave it to recv()
+    if (EIO == errno) {
+      ret = 0;
+      zc.length = 0;
+      zc.recv_skip_hint = 0;
+    } else {
+      ret = 1;
+      goto out;
+    }
+  }
+
+  *mapped_out = zc.length;
+  *copy_out = zc.recv_skip_hint;
+
+out:
+  return ret;
+}
+
+int zerocopy_read_completions(
+    int sockfd, uint32_t* completed_out, uint64_t* copied_out) {
+  int ret = 0;
+
+  for (;;) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) +
+                 CMSG_SPACE(sizeof(struct sockaddr_in6))];
+    struct msghdr msg = {
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    if (recvmsg(sockfd, &msg, MSG_ERRQUEUE) < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+        break;
+      }
+      ret = -1;
+      goto out;
+    }
+
+    // each notification covers the range of ids [ee_info, ee_data]
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); NULL != cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (!((SOL_IP == cmsg->cmsg_level) && (IP_RECVERR == cmsg->cmsg_type)) &&
+          !((SOL_IPV6 == cmsg->cmsg_level) &&
+            (IPV6_RECVERR == cmsg->cmsg_type))) {
+        continue;
+      }
+      struct sock_extended_err err;
+      memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+      if ((SO_EE_ORIGIN_ZEROCOPY != err.ee_origin) || (0 != err.ee_errno)) {
+        continue;
+      }
+      *completed_out = err.ee_data;
+      if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        *copied_out += err.ee_data - err.ee_info + 1;
+      }
+      ret++;
+    }
+  }
+
+out:
+  return ret;
+}
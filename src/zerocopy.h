@@ -0,0 +1,89 @@
+/**
+ * @file zerocopy.h
+ * @author oclyke
+ * @brief MSG_ZEROCOPY sends and their completion notifications
+ */
+
+#ifndef ZEROCOPY_H_
+#define ZEROCOPY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief a buffer that was sent with MSG_ZEROCOPY
+ *
+ * the kernel keeps reading from the buffer after send() returns, so it may
+ * only be reused once the completion for the last send from it has arrived.
+ * every MSG_ZEROCOPY send on a socket gets the next 32 bit id, starting at
+ * zero, and TCP completes the ids in order.
+ */
+struct zerocopy_buffer {
+  struct zerocopy_buffer* next;
+  char* buffer;
+  size_t size;
+  uint32_t id;
+};
+
+/**
+ * @brief allows MSG_ZEROCOPY sends on a socket
+ *
+ * @param sockfd the socket
+ * @return int nonzero if the kernel does not support zerocopy sends
+ */
+int zerocopy_enable(int sockfd);
+
+/**
+ * @brief reads every zerocopy completion queued on a socket's error queue
+ *
+ * @param sockfd the socket
+ * @param completed_out the highest completed send id, only written when at
+ * least one completion was read
+ * @param copied_out incremented by the number of sends the kernel ended up
+ * copying after all
+ * @return int the number of completions read, negative if the error queue
+ * could not be read
+ */
+int zerocopy_read_completions(
+    int sockfd, uint32_t* completed_out, uint64_t* copied_out);
+
+/**
+ * @brief maps a window onto the receive queue of a TCP socket
+ *
+ * @param sockfd the socket
+ * @param len the size of the window, a multiple of the page size
+ * @return void* the window, NULL if the socket cannot be mapped
+ */
+void* zerocopy_receive_map(int sockfd, size_t len);
+
+/**
+ * @brief maps received bytes into the window instead of copying them
+ *
+ * only whole pages can be mapped. bytes before the next page boundary of the
+ * stream have to be read with recv(), zerocopy_receive reports how many. the
+ * pages mapped by the previous call are unmapped first.
+ *
+ * @param sockfd the socket
+ * @param window the window from zerocopy_receive_map()
+ * @param len the size of the window
+ * @param mapped_out the number of bytes mapped at the start of the window
+ * @param copy_out the number of bytes to read with recv() next
+ * @return int nonzero if the socket does not support zerocopy receive
+ */
+int zerocopy_receive(
+    int sockfd, void* window, size_t len, size_t* mapped_out,
+    size_t* copy_out);
+
+/**
+ * @brief tells whether a send id is covered by a completion
+ *
+ * @param id the id of a send
+ * @param completed the highest completed id
+ * @return bool true once the kernel is done with the send
+ */
+static inline bool zerocopy_done(uint32_t id, uint32_t completed) {
+  return (int32_t)(completed - id) >= 0;
+}
+
+#endif  // ZEROCOPY_H_